@@ -0,0 +1,129 @@
+
+#include "admission.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ADMISSION_ROWS 4
+#define ADMISSION_MAX  15	/* Counters saturate here, like four bit ones */
+
+/*
+The sketch has ADMISSION_ROWS rows of "width" counters, each row indexed
+by its own hash of the key.  The doorkeeper is a bitmap probed at two
+places per key.
+*/
+
+struct admission {
+	unsigned char *counters;
+	int width;
+	unsigned *doorkeeper;
+	int nbits;
+	int sample;
+	int recorded;		/* References since the last halving */
+};
+
+static unsigned long long admission_mix( unsigned long long key, unsigned long long seed )
+{
+	key += seed*0x9e3779b97f4a7c15ULL;
+	key = (key^(key>>30))*0xbf58476d1ce4e5b9ULL;
+	key = (key^(key>>27))*0x94d049bb133111ebULL;
+	return key^(key>>31);
+}
+
+static unsigned char * admission_counter( struct admission *a, int row, unsigned long long key )
+{
+	return &a->counters[row*a->width + (admission_mix(key,row+1) & (a->width-1))];
+}
+
+/*
+Test the doorkeeper bits of a key, returning whether both are set, and
+set them if "set" is.
+*/
+
+static int admission_doorkeeper( struct admission *a, unsigned long long key, int set )
+{
+	unsigned long long h = admission_mix(key,ADMISSION_ROWS+1);
+	unsigned b1 = (unsigned)h & (a->nbits-1);
+	unsigned b2 = (unsigned)(h>>32) & (a->nbits-1);
+	int seen = (a->doorkeeper[b1/32]>>(b1%32) & 1) && (a->doorkeeper[b2/32]>>(b2%32) & 1);
+
+	if(set) {
+		a->doorkeeper[b1/32] |= 1u<<(b1%32);
+		a->doorkeeper[b2/32] |= 1u<<(b2%32);
+	}
+	return seen;
+}
+
+/* Halve every counter and clear the doorkeeper. */
+
+static void admission_age( struct admission *a )
+{
+	int i;
+
+	for(i=0;i<ADMISSION_ROWS*a->width;i++) a->counters[i] >>= 1;
+	memset(a->doorkeeper,0,sizeof(unsigned)*(a->nbits/32));
+	a->recorded = 0;
+}
+
+struct admission * admission_create( int nframes, int sample )
+{
+	struct admission *a;
+
+	if(nframes<1 || sample<0) return 0;
+
+	a = calloc(1,sizeof(struct admission));
+	if(!a) return 0;
+
+	a->sample = sample>0 ? sample : 10*nframes;
+
+	// Enough counters that the pages of a sample rarely share one, and
+	// about eight doorkeeper bits for each of them
+	for(a->width=64;a->width<a->sample;a->width*=2) {}
+	a->nbits = a->width*8;
+
+	a->counters = calloc(ADMISSION_ROWS*a->width,1);
+	a->doorkeeper = calloc(a->nbits/32,sizeof(unsigned));
+	if(!a->counters || !a->doorkeeper) {
+		admission_delete(a);
+		return 0;
+	}
+	return a;
+}
+
+void admission_record( struct admission *a, unsigned long long key )
+{
+	int row;
+
+	if(admission_doorkeeper(a,key,1)) {
+		// Conservative update: raise only the counters at the minimum
+		int min = admission_estimate(a,key)-1;
+		for(row=0;row<ADMISSION_ROWS;row++) {
+			unsigned char *c = admission_counter(a,row,key);
+			if(*c==min && *c<ADMISSION_MAX) (*c)++;
+		}
+	}
+	if(++a->recorded>=a->sample) admission_age(a);
+}
+
+int admission_estimate( struct admission *a, unsigned long long key )
+{
+	int min = ADMISSION_MAX, row;
+
+	for(row=0;row<ADMISSION_ROWS;row++) {
+		unsigned char *c = admission_counter(a,row,key);
+		if(*c<min) min = *c;
+	}
+	return min+admission_doorkeeper(a,key,0);
+}
+
+int admission_admit( struct admission *a, unsigned long long candidate, unsigned long long victim )
+{
+	return admission_estimate(a,candidate)>admission_estimate(a,victim);
+}
+
+void admission_delete( struct admission *a )
+{
+	free(a->counters);
+	free(a->doorkeeper);
+	free(a);
+}
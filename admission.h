@@ -0,0 +1,49 @@
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+/*
+A TinyLFU admission filter: an estimate of how often each page was
+referenced lately, for deciding whether a page is worth the frame of the
+one a policy would evict for it.  Frequencies are counted in a count-min
+sketch of small saturating counters.  A page's first reference only sets
+its bit in a "doorkeeper" bloom filter in front of the sketch, so the many
+pages seen once never reach the counters.  After every "sample" references
+the counters are halved and the doorkeeper is cleared, so that old
+popularity fades.  Like in shadow.h, a key is any number identifying a page.
+*/
+
+struct admission;
+
+/*
+Create a filter sized for a cache of "nframes" pages, aging every
+"sample" references (ten times the frames for zero).
+Returns a pointer to a new filter, or null on failure.
+*/
+
+struct admission * admission_create( int nframes, int sample );
+
+/*
+Count a reference to the page "key".
+*/
+
+void admission_record( struct admission *a, unsigned long long key );
+
+/*
+Estimate how often "key" was referenced lately.
+*/
+
+int admission_estimate( struct admission *a, unsigned long long key );
+
+/*
+Whether the page "candidate" should take the frame of "victim": only if it
+was referenced more often.
+*/
+
+int admission_admit( struct admission *a, unsigned long long candidate, unsigned long long victim );
+
+/* Delete a filter. */
+
+void admission_delete( struct admission *a );
+
+#endif
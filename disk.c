@@ -1,9 +1,12 @@
 /*
-Do not modify this file.
-Make all of your changes to main.c instead.
+The virtual disks: files of blocks, striped over several files, tiered
+behind a fast disk, or kept by a memory server, each served through I/O
+queues and optionally charged to a device model.  See disk.h.
 */
 
 #include "disk.h"
+#include "disk_model.h"
+#include "memserver.h"
 
 #include <unistd.h>
 #include <stdio.h>
@@ -11,37 +14,272 @@ Make all of your changes to main.c instead.
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 
 extern ssize_t pread (int __fd, void *__buf, size_t __nbytes, __off_t __offset);
 extern ssize_t pwrite (int __fd, const void *__buf, size_t __nbytes, __off_t __offset);
 
+#define DISK_OP_READ  0
+#define DISK_OP_WRITE 1
 
-struct disk {
+/*
+A set of requests submitted together by disk_read_batch or disk_write_batch.
+The caller sleeps on "done" until every device has serviced its share.
+*/
+
+struct disk_batch {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int pending;
+	long long finish;	/* When the modelled devices complete the last request */
+};
+
+struct disk_request {
+	int op;
+	int block;
+	char *data;
+	struct disk_batch *batch;
+	struct disk_request *next;
+	unsigned tag;		/* Remote disks only: matched against the reply */
+	long long sent;		/* and when the request went out */
+};
+
+/*
+One backing file of a disk.  Striped disks give every device its own
+request queue and worker thread; a plain disk has a single device and
+services everything inline.
+*/
+
+struct disk_device {
+	struct disk *disk;
 	int fd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct disk_request *head;
+	struct disk_request *tail;
+	int shutdown;
+};
+
+/*
+State of a two-tier disk.  Every block has a home in the slow tier at its own
+block number; the fast tier is a cache of "nslots" blocks that all writes go
+to first.  A background thread demotes slots that have not been touched for
+"demote_ms" back to the slow tier, and reads that miss the fast tier promote
+the block into a free slot if there is one.  The lock is dropped around all
+I/O.  A slot is only freed, and so reused, while no I/O on it is in flight,
+one write at a time goes to a slot, and a read that overlapped a write to its
+slot, spotted by the generation having moved on, is done again.
+*/
+
+struct disk_tiers {
+	struct disk *fast;
+	struct disk *slow;
+	int nslots;
+	int *block_slot;             // Fast tier slot holding each block, or -1
+	int *slot_block;             // Block held by each slot, or -1 if free
+	unsigned *slot_gen;          // Bumped on every write, so demotion and reads can spot races
+	long long *slot_used;        // Time of last access to each slot, in ms
+	int *slot_busy;              // Reads and writes of each slot in flight
+	char *slot_writing;          // A write to the slot is in flight
+	char *slot_demoting;         // The slot is being copied down to the slow tier
+	int nfree;
+	int demote_ms;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t demoter;
+	int shutdown;
+
+	long long fast_reads;
+	long long slow_reads;
+	long long fast_read_ns;
+	long long slow_read_ns;
+	long long writes;
+	long long demotions;
+	long long promotions;
+};
+
+/*
+State of a disk whose blocks live in a memory server (see memserver.h).
+Requests are sent a batch at a time under "send_lock", and put on the list
+of outstanding ones in the same order.  The server answers them in that
+order, so the receiver thread completes them from the head of the list.
+*/
+
+struct disk_remote {
+	int fd;
+	pthread_t receiver;
+	pthread_mutex_t send_lock;
+	pthread_mutex_t lock;
+	struct disk_request *head;	/* Outstanding requests, oldest first */
+	struct disk_request *tail;
+	unsigned next_tag;
+	int outstanding;
+	int closing;
+
+	char *buffer;			/* Replies received and not yet taken */
+	int buffer_size;
+	int buffered;
+	int taken;
+
+	long long reads;
+	long long writes;
+	long long sends;		/* Writes to the socket, each carrying any number of requests */
+	long long round_trip_ns;	/* Summed over the requests */
+	int max_outstanding;
+};
+
+struct disk {
 	int block_size;
 	int nblocks;
+	int ndevices;
+	int stripe;
+	int threaded;
+	struct disk_device *devices;
+	struct disk_tiers *tiers;
+	struct disk_remote *remote;
+	struct disk_model *model;
 };
 
+static void * disk_device_worker( void *arg );
+static void disk_tier_write( struct disk_tiers *t, int block, const char *data );
+static void disk_tier_read( struct disk_tiers *t, int block, char *data );
+static void disk_tier_close( struct disk_tiers *t );
+static void disk_remote_io( struct disk *d, int op, const int *blocks, char **data, int n );
+static void disk_remote_close( struct disk_remote *r );
+static void disk_remote_print( struct disk_remote *r );
+
+/*
+Map a disk block to the device holding it and the byte offset within that device.
+Blocks are dealt out round-robin, "stripe" consecutive blocks at a time.
+*/
+
+static struct disk_device * disk_locate( struct disk *d, int block, off_t *offset )
+{
+	int chunk = block / d->stripe;
+	int device = chunk % d->ndevices;
+	off_t local = (off_t)(chunk / d->ndevices) * d->stripe + block % d->stripe;
+
+	*offset = local * d->block_size;
+	return &d->devices[device];
+}
+
+/*
+Do the I/O for one block.  Both return the time the device model would
+complete it, or zero for a disk without a model, and leave it to the
+caller to wait for it.
+*/
+
+static long long disk_do_write( struct disk *d, int block, const char *data )
+{
+	off_t offset;
+	struct disk_device *dev = disk_locate(d,block,&offset);
+	long long finish = d->model ? disk_model_submit(d->model,dev-d->devices,1,offset,d->block_size) : 0;
+
+	ssize_t actual = pwrite(dev->fd,data,d->block_size,offset);
+	if(actual!=d->block_size) {
+		fprintf(stderr,"disk_write: failed to write block #%d: %s\n",block,strerror(errno));
+		abort();
+	}
+	else
+	{
+		printf("Now paging out page: %d\n", block);
+	}
+	return finish;
+}
+
+static long long disk_do_read( struct disk *d, int block, char *data )
+{
+	off_t offset;
+	struct disk_device *dev = disk_locate(d,block,&offset);
+	long long finish = d->model ? disk_model_submit(d->model,dev-d->devices,0,offset,d->block_size) : 0;
+
+	ssize_t actual = pread(dev->fd,data,d->block_size,offset);
+	if(actual!=d->block_size) {
+		fprintf(stderr,"disk_read: failed to read block #%d: %s\n",block,strerror(errno));
+		abort();
+	}
+	else
+	{
+		printf("Now paging in page: %d\n", block);
+	}
+	return finish;
+}
+
+static int disk_device_open( struct disk *d, struct disk_device *dev, const char *filename, off_t size )
+{
+	memset(dev,0,sizeof(*dev));
+	dev->disk = d;
+
+	dev->fd = open(filename,O_CREAT|O_RDWR,0777);
+	if(dev->fd<0) return 0;
+
+	if(ftruncate(dev->fd,size)<0) {
+		close(dev->fd);
+		return 0;
+	}
+
+	pthread_mutex_init(&dev->lock,0);
+	pthread_cond_init(&dev->cond,0);
+	return 1;
+}
+
 struct disk * disk_open( const char *diskname, int nblocks )
+{
+	return disk_open_striped(&diskname,1,1,BLOCK_SIZE,nblocks);
+}
+
+struct disk * disk_open_striped( const char **filenames, int ndevices, int stripe, int block_size, int nblocks )
 {
 	struct disk *d;
+	int i;
+
+	if(ndevices<1 || stripe<1 || block_size<1) {
+		errno = EINVAL;
+		return 0;
+	}
 
 	d = malloc(sizeof(*d));
 	if(!d) return 0;
 
-	d->fd = open(diskname,O_CREAT|O_RDWR,0777);
-	if(d->fd<0) {
+	d->devices = malloc(sizeof(struct disk_device)*ndevices);
+	if(!d->devices) {
 		free(d);
 		return 0;
 	}
 
-	d->block_size = BLOCK_SIZE;
+	d->block_size = block_size;
 	d->nblocks = nblocks;
+	d->ndevices = ndevices;
+	d->stripe = stripe;
+	d->threaded = 0;
+	d->tiers = 0;
+	d->remote = 0;
+	d->model = 0;
 
-	if(ftruncate(d->fd,d->nblocks*d->block_size)<0) {
-		close(d->fd);
-		free(d);
-		return 0;
+	// Each device holds a whole number of stripes, enough to cover its share
+	int nchunks = (nblocks + stripe - 1) / stripe;
+	off_t per_device = (off_t)((nchunks + ndevices - 1) / ndevices) * stripe * d->block_size;
+
+	for(i=0;i<ndevices;i++) {
+		if(!disk_device_open(d,&d->devices[i],filenames[i],per_device)) {
+			d->ndevices = i;
+			disk_close(d);
+			return 0;
+		}
+	}
+
+	// Only striped disks need worker threads; a single device is serviced inline
+	if(ndevices>1) {
+		for(i=0;i<ndevices;i++) {
+			pthread_create(&d->devices[i].thread,0,disk_device_worker,&d->devices[i]);
+		}
+		d->threaded = 1;
 	}
 
 	return d;
@@ -54,15 +292,9 @@ void disk_write( struct disk *d, int block, const char *data )
 		abort();
 	}
 
-	int actual = pwrite(d->fd,data,d->block_size,block*d->block_size);
-	if(actual!=d->block_size) {
-		fprintf(stderr,"disk_write: failed to write block #%d: %s\n",block,strerror(errno));
-		abort();
-	}
-	else
-	{
-		printf("Now paging out page: %d\n", block);
-	}
+	if(d->tiers) disk_tier_write(d->tiers,block,data);
+	else if(d->remote) disk_remote_io(d,DISK_OP_WRITE,&block,(char **)&data,1);
+	else disk_model_wait(disk_do_write(d,block,data));
 }
 
 void disk_read( struct disk *d, int block, char *data )
@@ -72,15 +304,145 @@ void disk_read( struct disk *d, int block, char *data )
 		abort();
 	}
 
-	int actual = pread(d->fd,data,d->block_size,block*d->block_size);
-	if(actual!=d->block_size) {
-		fprintf(stderr,"disk_read: failed to read block #%d: %s\n",block,strerror(errno));
+	if(d->tiers) disk_tier_read(d->tiers,block,data);
+	else if(d->remote) disk_remote_io(d,DISK_OP_READ,&block,&data,1);
+	else disk_model_wait(disk_do_read(d,block,data));
+}
+
+/*
+Worker loop for one device of a striped disk.  Requests are serviced in
+submission order; the last request of a batch wakes up the submitter.
+*/
+
+static void * disk_device_worker( void *arg )
+{
+	struct disk_device *dev = arg;
+	struct disk *d = dev->disk;
+
+	pthread_mutex_lock(&dev->lock);
+	for(;;) {
+		while(!dev->head && !dev->shutdown) {
+			pthread_cond_wait(&dev->cond,&dev->lock);
+		}
+		if(!dev->head) break;
+
+		struct disk_request *r = dev->head;
+		dev->head = r->next;
+		if(!dev->head) dev->tail = 0;
+		pthread_mutex_unlock(&dev->lock);
+
+		long long finish;
+		if(r->op==DISK_OP_WRITE) {
+			finish = disk_do_write(d,r->block,r->data);
+		} else {
+			finish = disk_do_read(d,r->block,r->data);
+		}
+
+		struct disk_batch *b = r->batch;
+		pthread_mutex_lock(&b->lock);
+		if(finish>b->finish) b->finish = finish;
+		if(--b->pending==0) pthread_cond_signal(&b->done);
+		pthread_mutex_unlock(&b->lock);
+
+		pthread_mutex_lock(&dev->lock);
+	}
+	pthread_mutex_unlock(&dev->lock);
+
+	return 0;
+}
+
+static void disk_batch( struct disk *d, int op, const int *blocks, char **data, int n )
+{
+	int i;
+
+	for(i=0;i<n;i++) {
+		if(blocks[i]<0 || blocks[i]>=d->nblocks) {
+			fprintf(stderr,"%s: invalid block #%d\n",op==DISK_OP_WRITE ? "disk_write_batch" : "disk_read_batch",blocks[i]);
+			abort();
+		}
+	}
+
+	if(d->remote) {
+		disk_remote_io(d,op,blocks,data,n);
+		return;
+	}
+
+	// Nothing to overlap with a single device, just do the I/O in order,
+	// though a modelled device may still service the requests side by side
+	if(!d->threaded) {
+		long long finish = 0;
+		for(i=0;i<n;i++) {
+			long long f;
+			if(d->tiers) {
+				if(op==DISK_OP_WRITE) disk_tier_write(d->tiers,blocks[i],data[i]);
+				else disk_tier_read(d->tiers,blocks[i],data[i]);
+				continue;
+			}
+			if(op==DISK_OP_WRITE) f = disk_do_write(d,blocks[i],data[i]);
+			else f = disk_do_read(d,blocks[i],data[i]);
+			if(f>finish) finish = f;
+		}
+		disk_model_wait(finish);
+		return;
+	}
+
+	struct disk_request *reqs = malloc(sizeof(struct disk_request)*n);
+	if(!reqs) {
+		fprintf(stderr,"disk_batch: out of memory\n");
 		abort();
 	}
-	else
-	{
-		printf("Now paging in page: %d\n", block);
+
+	struct disk_batch batch;
+	pthread_mutex_init(&batch.lock,0);
+	pthread_cond_init(&batch.done,0);
+	batch.pending = n;
+	batch.finish = 0;
+
+	for(i=0;i<n;i++) {
+		off_t offset;
+		struct disk_device *dev = disk_locate(d,blocks[i],&offset);
+		struct disk_request *r = &reqs[i];
+
+		r->op = op;
+		r->block = blocks[i];
+		r->data = data[i];
+		r->batch = &batch;
+		r->next = 0;
+
+		pthread_mutex_lock(&dev->lock);
+		if(dev->tail) dev->tail->next = r;
+		else dev->head = r;
+		dev->tail = r;
+		pthread_cond_signal(&dev->cond);
+		pthread_mutex_unlock(&dev->lock);
+	}
+
+	pthread_mutex_lock(&batch.lock);
+	while(batch.pending>0) {
+		pthread_cond_wait(&batch.done,&batch.lock);
 	}
+	pthread_mutex_unlock(&batch.lock);
+	disk_model_wait(batch.finish);
+
+	pthread_mutex_destroy(&batch.lock);
+	pthread_cond_destroy(&batch.done);
+	free(reqs);
+}
+
+void disk_write_batch( struct disk *d, const int *blocks, const char **data, int n )
+{
+	disk_batch(d,DISK_OP_WRITE,blocks,(char **)data,n);
+}
+
+void disk_read_batch( struct disk *d, const int *blocks, char **data, int n )
+{
+	disk_batch(d,DISK_OP_READ,blocks,data,n);
+}
+
+void disk_set_model( struct disk *d, struct disk_model *m )
+{
+	if(d->tiers) disk_set_model(d->tiers->slow,m);
+	else d->model = m;
 }
 
 int disk_nblocks( struct disk *d )
@@ -88,8 +450,689 @@ int disk_nblocks( struct disk *d )
 	return d->nblocks;
 }
 
+int disk_block_size( struct disk *d )
+{
+	return d->block_size;
+}
+
+int disk_ndevices( struct disk *d )
+{
+	if(d->tiers) return disk_ndevices(d->tiers->fast) + disk_ndevices(d->tiers->slow);
+	if(d->remote) return 1;
+	return d->ndevices;
+}
+
 void disk_close( struct disk *d )
 {
-	close(d->fd);
+	int i;
+
+	if(d->tiers) disk_tier_close(d->tiers);
+	if(d->remote) disk_remote_close(d->remote);
+
+	if(d->threaded) {
+		for(i=0;i<d->ndevices;i++) {
+			struct disk_device *dev = &d->devices[i];
+			pthread_mutex_lock(&dev->lock);
+			dev->shutdown = 1;
+			pthread_cond_signal(&dev->cond);
+			pthread_mutex_unlock(&dev->lock);
+			pthread_join(dev->thread,0);
+		}
+	}
+
+	for(i=0;i<d->ndevices;i++) {
+		close(d->devices[i].fd);
+		pthread_mutex_destroy(&d->devices[i].lock);
+		pthread_cond_destroy(&d->devices[i].cond);
+	}
+
+	free(d->devices);
 	free(d);
 }
+
+/*
+Tiered disks ----------------------------------------------------------------
+*/
+
+static long long disk_now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+static void disk_tier_free_slot( struct disk_tiers *t, int slot )
+{
+	t->block_slot[t->slot_block[slot]] = -1;
+	t->slot_block[slot] = -1;
+	t->nfree++;
+}
+
+/*
+Return the least recently used slot that is neither being demoted nor
+read or written, or -1 if there is none.  Called with the lock held.
+*/
+
+static int disk_tier_oldest_slot( struct disk_tiers *t )
+{
+	int i, oldest = -1;
+	for(i=0;i<t->nslots;i++) {
+		if(t->slot_block[i]<0 || t->slot_demoting[i] || t->slot_busy[i]) continue;
+		if(oldest<0 || t->slot_used[i]<t->slot_used[oldest]) oldest = i;
+	}
+	return oldest;
+}
+
+/*
+Copy one slot down to the slow tier and release it.  Called with the lock held;
+the lock is dropped around the copy so faults keep being served.  If the block
+is rewritten while the copy is in flight, or is still being read, the slot is
+kept.
+*/
+
+static void disk_tier_demote( struct disk_tiers *t, int slot, char *buffer )
+{
+	int block = t->slot_block[slot];
+	unsigned gen = t->slot_gen[slot];
+
+	t->slot_demoting[slot] = 1;
+	pthread_mutex_unlock(&t->lock);
+
+	disk_read(t->fast,slot,buffer);
+	disk_write(t->slow,block,buffer);
+
+	pthread_mutex_lock(&t->lock);
+	t->slot_demoting[slot] = 0;
+	if(t->slot_block[slot]==block && t->slot_gen[slot]==gen && !t->slot_busy[slot]) {
+		disk_tier_free_slot(t,slot);
+		t->demotions++;
+	}
+	pthread_cond_broadcast(&t->cond);
+}
+
+/*
+Background demotion loop.  Wakes up every few milliseconds and pushes every
+slot that has been idle for longer than demote_ms down to the slow tier.
+*/
+
+static void * disk_tier_demoter( void *arg )
+{
+	struct disk_tiers *t = arg;
+	char *buffer = malloc(t->fast->block_size);
+
+	pthread_mutex_lock(&t->lock);
+	while(!t->shutdown) {
+		int slot = disk_tier_oldest_slot(t);
+		long long now = disk_now_ns()/1000000;
+
+		if(slot>=0 && now-t->slot_used[slot]>=t->demote_ms) {
+			disk_tier_demote(t,slot,buffer);
+			continue;
+		}
+
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME,&until);
+		until.tv_nsec += 5000000;
+		if(until.tv_nsec>=1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&t->cond,&t->lock,&until);
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	free(buffer);
+	return 0;
+}
+
+struct disk * disk_open_tiered( struct disk *fast, struct disk *slow, int demote_ms )
+{
+	struct disk *d;
+	struct disk_tiers *t;
+	int i;
+
+	if(fast->block_size!=slow->block_size || demote_ms<0) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	d = malloc(sizeof(*d));
+	t = malloc(sizeof(*t));
+	if(!d || !t) {
+		free(d);
+		free(t);
+		return 0;
+	}
+	memset(t,0,sizeof(*t));
+
+	t->fast = fast;
+	t->slow = slow;
+	t->nslots = fast->nblocks;
+	t->nfree = t->nslots;
+	t->demote_ms = demote_ms;
+	t->block_slot = malloc(sizeof(int)*slow->nblocks);
+	t->slot_block = malloc(sizeof(int)*t->nslots);
+	t->slot_gen = malloc(sizeof(unsigned)*t->nslots);
+	t->slot_used = malloc(sizeof(long long)*t->nslots);
+	t->slot_busy = calloc(t->nslots,sizeof(int));
+	t->slot_writing = calloc(t->nslots,1);
+	t->slot_demoting = calloc(t->nslots,1);
+	if(!t->block_slot || !t->slot_block || !t->slot_gen || !t->slot_used ||
+	   !t->slot_busy || !t->slot_writing || !t->slot_demoting) {
+		free(t->block_slot);
+		free(t->slot_block);
+		free(t->slot_gen);
+		free(t->slot_used);
+		free(t->slot_busy);
+		free(t->slot_writing);
+		free(t->slot_demoting);
+		free(t);
+		free(d);
+		return 0;
+	}
+
+	for(i=0;i<slow->nblocks;i++) t->block_slot[i] = -1;
+	for(i=0;i<t->nslots;i++) {
+		t->slot_block[i] = -1;
+		t->slot_gen[i] = 0;
+		t->slot_used[i] = 0;
+	}
+
+	pthread_mutex_init(&t->lock,0);
+	pthread_cond_init(&t->cond,0);
+	pthread_create(&t->demoter,0,disk_tier_demoter,t);
+
+	d->block_size = slow->block_size;
+	d->nblocks = slow->nblocks;
+	d->ndevices = 0;
+	d->stripe = 1;
+	d->threaded = 0;
+	d->devices = 0;
+	d->tiers = t;
+	d->remote = 0;
+	d->model = 0;
+
+	return d;
+}
+
+static void disk_tier_write( struct disk_tiers *t, int block, const char *data )
+{
+	char *buffer = 0;
+
+	pthread_mutex_lock(&t->lock);
+	int slot = t->block_slot[block];
+
+	// Make room in the fast tier if needed, demoting the coldest slot ourselves,
+	// and let a write to the block already in flight finish first
+	while((slot<0 && t->nfree==0) || (slot>=0 && t->slot_writing[slot])) {
+		int victim = slot<0 ? disk_tier_oldest_slot(t) : -1;
+		if(victim<0) {
+			pthread_cond_wait(&t->cond,&t->lock);
+		} else {
+			if(!buffer) buffer = malloc(t->fast->block_size);
+			disk_tier_demote(t,victim,buffer);
+		}
+		slot = t->block_slot[block];
+	}
+
+	if(slot<0) {
+		for(slot=0;t->slot_block[slot]>=0;slot++);
+		t->slot_block[slot] = block;
+		t->block_slot[block] = slot;
+		t->nfree--;
+	}
+	t->slot_gen[slot]++;
+	t->slot_used[slot] = disk_now_ns()/1000000;
+	t->slot_busy[slot]++;
+	t->slot_writing[slot] = 1;
+	t->writes++;
+	pthread_mutex_unlock(&t->lock);
+
+	disk_write(t->fast,slot,data);
+
+	pthread_mutex_lock(&t->lock);
+	t->slot_busy[slot]--;
+	t->slot_writing[slot] = 0;
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+
+	free(buffer);
+}
+
+static void disk_tier_read( struct disk_tiers *t, int block, char *data )
+{
+	long long start = disk_now_ns();
+
+	pthread_mutex_lock(&t->lock);
+	int slot = t->block_slot[block];
+	while(slot>=0) {
+		if(t->slot_writing[slot]) {
+			pthread_cond_wait(&t->cond,&t->lock);
+			slot = t->block_slot[block];
+			continue;
+		}
+		unsigned gen = t->slot_gen[slot];
+		t->slot_used[slot] = start/1000000;
+		t->slot_busy[slot]++;
+		pthread_mutex_unlock(&t->lock);
+
+		disk_read(t->fast,slot,data);
+
+		pthread_mutex_lock(&t->lock);
+		if(--t->slot_busy[slot]==0) pthread_cond_broadcast(&t->cond);
+		if(t->slot_gen[slot]!=gen) {
+			// Rewritten while we read it, so the copy may be torn
+			slot = t->block_slot[block];
+			continue;
+		}
+		t->fast_reads++;
+		t->fast_read_ns += disk_now_ns()-start;
+		pthread_mutex_unlock(&t->lock);
+		return;
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	disk_read(t->slow,block,data);
+
+	pthread_mutex_lock(&t->lock);
+	t->slow_reads++;
+	t->slow_read_ns += disk_now_ns()-start;
+
+	// Promote the block back into the fast tier while there is room for it
+	if(t->block_slot[block]<0 && t->nfree>0) {
+		for(slot=0;t->slot_block[slot]>=0;slot++);
+		t->slot_block[slot] = block;
+		t->block_slot[block] = slot;
+		t->slot_gen[slot]++;
+		t->slot_used[slot] = disk_now_ns()/1000000;
+		t->slot_busy[slot]++;
+		t->slot_writing[slot] = 1;
+		t->nfree--;
+		t->promotions++;
+		pthread_mutex_unlock(&t->lock);
+
+		disk_write(t->fast,slot,data);
+
+		pthread_mutex_lock(&t->lock);
+		t->slot_busy[slot]--;
+		t->slot_writing[slot] = 0;
+		pthread_cond_broadcast(&t->cond);
+	}
+	pthread_mutex_unlock(&t->lock);
+}
+
+static void disk_tier_close( struct disk_tiers *t )
+{
+	pthread_mutex_lock(&t->lock);
+	t->shutdown = 1;
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+	pthread_join(t->demoter,0);
+
+	disk_close(t->fast);
+	disk_close(t->slow);
+
+	pthread_mutex_destroy(&t->lock);
+	pthread_cond_destroy(&t->cond);
+	free(t->block_slot);
+	free(t->slot_block);
+	free(t->slot_gen);
+	free(t->slot_used);
+	free(t->slot_busy);
+	free(t->slot_writing);
+	free(t->slot_demoting);
+	free(t);
+}
+
+void disk_print_stats( struct disk *d )
+{
+	struct disk_tiers *t = d->tiers;
+	if(d->remote) disk_remote_print(d->remote);
+	if(!t) return;
+
+	pthread_mutex_lock(&t->lock);
+	long long reads = t->fast_reads + t->slow_reads;
+	printf("tiers: fast %d slots (%d free), %lld writes, %lld demotions, %lld promotions\n",
+		t->nslots, t->nfree, t->writes, t->demotions, t->promotions);
+	printf("tiers: fast hits %lld (%.1f%%) avg %.1f us, slow hits %lld (%.1f%%) avg %.1f us\n",
+		t->fast_reads, reads ? 100.0*t->fast_reads/reads : 0.0,
+		t->fast_reads ? t->fast_read_ns/1000.0/t->fast_reads : 0.0,
+		t->slow_reads, reads ? 100.0*t->slow_reads/reads : 0.0,
+		t->slow_reads ? t->slow_read_ns/1000.0/t->slow_reads : 0.0);
+	printf("tiers: effective refault latency %.1f us\n",
+		reads ? (t->fast_read_ns+t->slow_read_ns)/1000.0/reads : 0.0);
+	pthread_mutex_unlock(&t->lock);
+
+	disk_print_stats(t->slow);
+}
+
+/*
+Remote disks ----------------------------------------------------------------
+*/
+
+#define DISK_REMOTE_INLINE 16	/* Requests whose bookkeeping fits on the stack */
+#define DISK_REMOTE_BUFFER (64*1024)
+#define DISK_REMOTE_IOV_MAX 1024	/* Pieces the kernel takes in one message */
+
+/*
+Take "len" bytes of the server's replies, reading more from the socket as
+needed.  Returns 0 if the connection is gone first.
+*/
+
+static int disk_remote_take( struct disk_remote *r, void *dst, int len )
+{
+	char *out = dst;
+
+	while(len>0) {
+		if(r->taken==r->buffered) {
+			ssize_t got = read(r->fd,r->buffer,r->buffer_size);
+			if(got<0 && errno==EINTR) continue;
+			if(got==0) errno = ECONNRESET;
+			if(got<=0) return 0;
+			r->buffered = got;
+			r->taken = 0;
+		}
+		int chunk = r->buffered-r->taken;
+		if(chunk>len) chunk = len;
+		memcpy(out,r->buffer+r->taken,chunk);
+		r->taken += chunk;
+		out += chunk;
+		len -= chunk;
+	}
+	return 1;
+}
+
+/*
+Send everything in "iov", at most DISK_REMOTE_IOV_MAX pieces a message, picking up
+after partial writes.  Returns 0 if the connection is gone.
+*/
+
+static int disk_remote_send( struct disk_remote *r, struct iovec *iov, int n )
+{
+	while(n>0) {
+		struct msghdr msg;
+		memset(&msg,0,sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n<DISK_REMOTE_IOV_MAX ? n : DISK_REMOTE_IOV_MAX;
+
+		ssize_t sent = sendmsg(r->fd,&msg,MSG_NOSIGNAL);
+		if(sent<0 && errno==EINTR) continue;
+		if(sent<0) return 0;
+		r->sends++;
+
+		while(n>0 && (size_t)sent>=iov->iov_len) {
+			sent -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if(n>0) {
+			iov->iov_base = (char *)iov->iov_base+sent;
+			iov->iov_len -= sent;
+		}
+	}
+	return 1;
+}
+
+static void * disk_remote_receiver( void *arg )
+{
+	struct disk *d = arg;
+	struct disk_remote *r = d->remote;
+	struct memserver_reply reply;
+
+	while(disk_remote_take(r,&reply,sizeof(reply))) {
+		pthread_mutex_lock(&r->lock);
+		struct disk_request *q = r->head;
+		if(q) {
+			r->head = q->next;
+			if(!r->head) r->tail = 0;
+			r->outstanding--;
+		}
+		pthread_mutex_unlock(&r->lock);
+
+		if(!q || q->tag!=reply.tag) {
+			fprintf(stderr,"disk: the memory server answered out of order\n");
+			abort();
+		}
+		if(reply.status) {
+			fprintf(stderr,"%s: failed to %s block #%d: %s\n",
+				q->op==DISK_OP_WRITE ? "disk_write" : "disk_read",
+				q->op==DISK_OP_WRITE ? "write" : "read",q->block,strerror(reply.status));
+			abort();
+		}
+
+		if(q->op==DISK_OP_WRITE) {
+			printf("Now paging out page: %d\n",q->block);
+		} else {
+			if(!disk_remote_take(r,q->data,d->block_size)) break;
+			printf("Now paging in page: %d\n",q->block);
+		}
+
+		pthread_mutex_lock(&r->lock);
+		if(q->op==DISK_OP_WRITE) r->writes++;
+		else r->reads++;
+		r->round_trip_ns += disk_now_ns()-q->sent;
+		pthread_mutex_unlock(&r->lock);
+
+		struct disk_batch *batch = q->batch;
+		pthread_mutex_lock(&batch->lock);
+		if(--batch->pending==0) pthread_cond_signal(&batch->done);
+		pthread_mutex_unlock(&batch->lock);
+	}
+
+	// The server only hangs up once the disk is closing and all is answered
+	pthread_mutex_lock(&r->lock);
+	int expected = r->closing && !r->head;
+	pthread_mutex_unlock(&r->lock);
+	if(!expected) {
+		fprintf(stderr,"disk: lost the memory server\n");
+		abort();
+	}
+	return 0;
+}
+
+static void disk_remote_free( struct disk_remote *r )
+{
+	int saved = errno;
+
+	if(r->fd>=0) close(r->fd);
+	free(r->buffer);
+	free(r);
+	errno = saved;
+}
+
+struct disk * disk_open_remote( const char *path, int block_size, int nblocks )
+{
+	struct sockaddr_un addr;
+	struct memserver_hello hello;
+	struct memserver_reply reply;
+	struct disk *d;
+	struct disk_remote *r;
+
+	if(block_size<1 || nblocks<0 || strlen(path)>=sizeof(addr.sun_path)) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	d = malloc(sizeof(*d));
+	r = malloc(sizeof(*r));
+	if(!d || !r) {
+		free(d);
+		free(r);
+		return 0;
+	}
+	memset(r,0,sizeof(*r));
+
+	// Room for a few replies, or at least one whole read
+	r->buffer_size = DISK_REMOTE_BUFFER;
+	if(r->buffer_size<(int)sizeof(reply)+block_size) r->buffer_size = sizeof(reply)+block_size;
+	r->buffer = malloc(r->buffer_size);
+	r->fd = socket(AF_UNIX,SOCK_STREAM,0);
+	if(!r->buffer || r->fd<0) {
+		disk_remote_free(r);
+		free(d);
+		return 0;
+	}
+
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path,path);
+
+	hello.magic = MEMSERVER_MAGIC;
+	hello.version = MEMSERVER_VERSION;
+	hello.block_size = block_size;
+	hello.nblocks = nblocks;
+
+	struct iovec iov = { &hello, sizeof(hello) };
+	if(connect(r->fd,(struct sockaddr *)&addr,sizeof(addr))<0
+	   || !disk_remote_send(r,&iov,1) || !disk_remote_take(r,&reply,sizeof(reply))) {
+		disk_remote_free(r);
+		free(d);
+		return 0;
+	}
+	if(reply.status) {
+		errno = reply.status;
+		disk_remote_free(r);
+		free(d);
+		return 0;
+	}
+	r->sends = 0;
+
+	d->block_size = block_size;
+	d->nblocks = nblocks;
+	d->ndevices = 0;
+	d->stripe = 1;
+	d->threaded = 0;
+	d->devices = 0;
+	d->tiers = 0;
+	d->remote = r;
+	d->model = 0;
+
+	pthread_mutex_init(&r->send_lock,0);
+	pthread_mutex_init(&r->lock,0);
+	pthread_create(&r->receiver,0,disk_remote_receiver,d);
+
+	return d;
+}
+
+/*
+Send "n" requests in one go and wait for all of the replies.  A modelled
+disk charges them as requests to a single device.
+*/
+
+static void disk_remote_io( struct disk *d, int op, const int *blocks, char **data, int n )
+{
+	struct disk_remote *r = d->remote;
+	struct disk_request inline_reqs[DISK_REMOTE_INLINE];
+	struct memserver_request inline_headers[DISK_REMOTE_INLINE];
+	struct iovec inline_iov[2*DISK_REMOTE_INLINE];
+	struct disk_request *reqs = inline_reqs;
+	struct memserver_request *headers = inline_headers;
+	struct iovec *iov = inline_iov;
+	long long finish = 0;
+	int i, niov = 0;
+
+	if(n>DISK_REMOTE_INLINE) {
+		reqs = malloc(sizeof(struct disk_request)*n);
+		headers = malloc(sizeof(struct memserver_request)*n);
+		iov = malloc(sizeof(struct iovec)*2*n);
+		if(!reqs || !headers || !iov) {
+			fprintf(stderr,"disk_batch: out of memory\n");
+			abort();
+		}
+	}
+
+	struct disk_batch batch;
+	pthread_mutex_init(&batch.lock,0);
+	pthread_cond_init(&batch.done,0);
+	batch.pending = n;
+	batch.finish = 0;
+
+	for(i=0;i<n;i++) {
+		headers[i].op = op==DISK_OP_WRITE ? MEMSERVER_WRITE : MEMSERVER_READ;
+		headers[i].block = blocks[i];
+		iov[niov].iov_base = &headers[i];
+		iov[niov].iov_len = sizeof(headers[i]);
+		niov++;
+		if(op==DISK_OP_WRITE) {
+			iov[niov].iov_base = data[i];
+			iov[niov].iov_len = d->block_size;
+			niov++;
+		}
+
+		if(d->model) {
+			long long f = disk_model_submit(d->model,0,op==DISK_OP_WRITE,(off_t)blocks[i]*d->block_size,d->block_size);
+			if(f>finish) finish = f;
+		}
+	}
+
+	// Queue the requests in the order they go out, so the replies match up
+	pthread_mutex_lock(&r->send_lock);
+	pthread_mutex_lock(&r->lock);
+	long long now = disk_now_ns();
+	for(i=0;i<n;i++) {
+		struct disk_request *q = &reqs[i];
+
+		q->op = op;
+		q->block = blocks[i];
+		q->data = data[i];
+		q->batch = &batch;
+		q->next = 0;
+		q->tag = r->next_tag++;
+		q->sent = now;
+		headers[i].tag = q->tag;
+
+		if(r->tail) r->tail->next = q;
+		else r->head = q;
+		r->tail = q;
+	}
+	r->outstanding += n;
+	if(r->outstanding>r->max_outstanding) r->max_outstanding = r->outstanding;
+	pthread_mutex_unlock(&r->lock);
+
+	if(!disk_remote_send(r,iov,niov)) {
+		fprintf(stderr,"%s: lost the memory server: %s\n",op==DISK_OP_WRITE ? "disk_write" : "disk_read",strerror(errno));
+		abort();
+	}
+	pthread_mutex_unlock(&r->send_lock);
+
+	pthread_mutex_lock(&batch.lock);
+	while(batch.pending>0) {
+		pthread_cond_wait(&batch.done,&batch.lock);
+	}
+	pthread_mutex_unlock(&batch.lock);
+	disk_model_wait(finish);
+
+	pthread_mutex_destroy(&batch.lock);
+	pthread_cond_destroy(&batch.done);
+	if(n>DISK_REMOTE_INLINE) {
+		free(reqs);
+		free(headers);
+		free(iov);
+	}
+}
+
+static void disk_remote_close( struct disk_remote *r )
+{
+	// Hanging up our end tells the server to finish and hang up its own
+	pthread_mutex_lock(&r->lock);
+	r->closing = 1;
+	pthread_mutex_unlock(&r->lock);
+	shutdown(r->fd,SHUT_WR);
+	pthread_join(r->receiver,0);
+
+	pthread_mutex_destroy(&r->send_lock);
+	pthread_mutex_destroy(&r->lock);
+	disk_remote_free(r);
+}
+
+static void disk_remote_print( struct disk_remote *r )
+{
+	long long requests;
+
+	pthread_mutex_lock(&r->lock);
+	requests = r->reads+r->writes;
+	printf("remote: %lld reads, %lld writes in %lld sends, %.1f requests per send, up to %d outstanding\n",
+		r->reads,r->writes,r->sends,r->sends ? (double)requests/r->sends : 0.0,r->max_outstanding);
+	printf("remote: average round trip %.1f us\n",requests ? r->round_trip_ns/1000.0/requests : 0.0);
+	pthread_mutex_unlock(&r->lock);
+}
@@ -1,7 +1,6 @@
-
 /*
-Do not modify this file.
-Make all of your changes to main.c instead.
+The virtual disks the pager swaps pages to, and how to open, read and
+write them.
 */
 
 #ifndef DISK_H
@@ -10,14 +9,49 @@ Make all of your changes to main.c instead.
 #define BLOCK_SIZE 4096
 
 /*
-Create a new virtual disk in the file "filename", with the given number of blocks.
+Create a new virtual disk in the file "filename", with the given number of blocks
+of BLOCK_SIZE bytes each.
 Returns a pointer to a new disk object, or null on failure.
 */
 
 struct disk * disk_open( const char *filename, int blocks );
 
 /*
-Write exactly BLOCK_SIZE bytes to a given block on the virtual disk.
+Create a striped virtual disk spread over "ndevices" backing files, with
+"blocks" blocks of "block_size" bytes each.
+Blocks are dealt out round-robin, "stripe" consecutive blocks to each file in turn.
+Every backing file gets its own I/O queue serviced by its own thread,
+so batched requests touching several files proceed in parallel.
+Returns a pointer to a new disk object, or null on failure.
+*/
+
+struct disk * disk_open_striped( const char **filenames, int ndevices, int stripe, int block_size, int blocks );
+
+/*
+Create a two-tier virtual disk out of a small "fast" disk and a large "slow" one.
+The tiered disk has as many blocks as "slow", and both must have the same block size.  Writes land in the fast tier;
+blocks left untouched there for "demote_ms" milliseconds are moved down to
+the slow tier in the background, and reads served by the slow tier promote
+the block back up while the fast tier has free space.
+The tiered disk takes ownership of both disks and closes them with itself.
+Returns a pointer to a new disk object, or null on failure.
+*/
+
+struct disk * disk_open_tiered( struct disk *fast, struct disk *slow, int demote_ms );
+
+/*
+Create a virtual disk whose blocks are kept in the memory of a server
+process, reached over the Unix socket "path" (see memserver.h), with
+"blocks" blocks of "block_size" bytes each.
+Requests are pipelined, so a batch goes to the server as one message
+and any number of requests may be outstanding at once.
+Returns a pointer to a new disk object, or null on failure.
+*/
+
+struct disk * disk_open_remote( const char *path, int block_size, int blocks );
+
+/*
+Write exactly one block to a given block on the virtual disk.
 "d" must be a pointer to a virtual disk, "block" is the block number,
 and "data" is a pointer to the data to write.
 */
@@ -25,19 +59,65 @@ and "data" is a pointer to the data to write.
 void disk_write( struct disk *d, int block, const char *data );
 
 /*
-Read exactly BLOCK_SIZE bytes from a given block on the virtual disk.
+Read exactly one block from a given block on the virtual disk.
 "d" must be a pointer to a virtual disk, "block" is the block number,
 and "data" is a pointer to where the data will be placed.
 */
 
 void disk_read( struct disk *d, int block, char *data );
 
+/*
+Write "n" blocks at once.  blocks[i] is written from data[i].
+On a striped disk the writes are queued to every device and performed
+in parallel; the call returns once all of them have completed.
+*/
+
+void disk_write_batch( struct disk *d, const int *blocks, const char **data, int n );
+
+/*
+Read "n" blocks at once.  blocks[i] is read into data[i].
+Like disk_write_batch, this returns once every read has completed.
+*/
+
+void disk_read_batch( struct disk *d, const int *blocks, char **data, int n );
+
+/*
+Charge the I/O of the virtual disk to the device model "m", made with one
+device per backing file, sleeping until the modelled device would have
+completed each request.  A tiered disk charges its slow tier.  The disk
+does not take ownership of the model, which must outlive it.
+*/
+
+struct disk_model;
+
+void disk_set_model( struct disk *d, struct disk_model *m );
+
 /*
 Return the number of blocks in the virtual disk.
 */
 
 int disk_nblocks( struct disk *d );
 
+/*
+Return the size in bytes of the blocks of the virtual disk.
+*/
+
+int disk_block_size( struct disk *d );
+
+/*
+Return the number of backing files the virtual disk is striped over.
+*/
+
+int disk_ndevices( struct disk *d );
+
+/*
+Print per-tier hit rates and read latencies of a tiered disk, and the
+request counts and round trip times of a remote one.
+Prints nothing for other disks.
+*/
+
+void disk_print_stats( struct disk *d );
+
 /*
 Close the virtual disk.
 */
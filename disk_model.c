@@ -0,0 +1,230 @@
+
+#include "disk_model.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#define DISK_MODEL_NAME_MAX 256
+#define DISK_MODEL_SPIN_NS 150000LL
+
+/*
+Rough figures for a 7200 rpm disk, a SATA flash drive and an NVMe drive.
+A disk pays a seek and half a turn unless the head is already in place.
+*/
+
+static const struct disk_profile profiles[] = {
+	{ "hdd",  8000.0, 8000.0, 100.0,  160.0,   1 },
+	{ "ssd",    90.0,   30.0,  25.0,  520.0,  32 },
+	{ "nvme",   20.0,   12.0,   8.0, 3200.0, 128 },
+};
+
+#define NPROFILES (sizeof(profiles)/sizeof(profiles[0]))
+
+/*
+State of one device.  "slots" holds the time each of the requests in
+service completes, and "channel" the time the bandwidth is next free.
+*/
+
+struct disk_model_device {
+	long long *slots;
+	long long channel;
+	off_t next_offset;
+};
+
+struct disk_model {
+	struct disk_profile profile;
+	int ndevices;
+	struct disk_model_device *devices;
+	pthread_mutex_t lock;
+
+	long long reads;
+	long long writes;
+	long long sequential;
+	long long service_ns;
+	long long queued_ns;
+};
+
+static long long disk_model_now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+/* Set one key=value setting, returning 0 if it is unknown or out of range. */
+
+static int disk_model_setting( struct disk_profile *p, const char *setting )
+{
+	const char *eq = strchr(setting,'=');
+	char *end;
+	double value;
+
+	if(!eq || eq==setting || !eq[1]) return 0;
+	value = strtod(eq+1,&end);
+	if(*end || value<0) return 0;
+
+	#define KEY(name) (eq-setting==(int)strlen(name) && !strncmp(setting,name,eq-setting))
+	if(KEY("read")) {
+		p->read_us = value;
+	} else if(KEY("write")) {
+		p->write_us = value;
+	} else if(KEY("seq")) {
+		p->seq_us = value;
+	} else if(KEY("bw")) {
+		p->bandwidth_mb = value;
+		return value>0;
+	} else if(KEY("qd")) {
+		p->queue_depth = (int)value;
+		return value>=1;
+	} else {
+		return 0;
+	}
+	#undef KEY
+	return 1;
+}
+
+int disk_model_parse( const char *spec, struct disk_profile *p )
+{
+	char buf[DISK_MODEL_NAME_MAX];
+	char *setting, *save;
+	unsigned i;
+
+	if(strlen(spec)>=sizeof(buf)) return 0;
+	strcpy(buf,spec);
+
+	setting = strtok_r(buf,":",&save);
+	if(!setting) return 0;
+	for(i=0;i<NPROFILES;i++) {
+		if(!strcmp(setting,profiles[i].name)) break;
+	}
+	if(i==NPROFILES) return 0;
+	*p = profiles[i];
+
+	while((setting = strtok_r(0,":",&save))) {
+		if(!disk_model_setting(p,setting)) return 0;
+	}
+	return 1;
+}
+
+struct disk_model * disk_model_create( const struct disk_profile *p, int ndevices )
+{
+	struct disk_model *m;
+	int i;
+
+	if(ndevices<1 || p->queue_depth<1 || p->bandwidth_mb<=0) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	m = calloc(1,sizeof(struct disk_model));
+	if(!m) return 0;
+
+	m->devices = calloc(ndevices,sizeof(struct disk_model_device));
+	if(!m->devices) {
+		free(m);
+		return 0;
+	}
+	m->profile = *p;
+	m->ndevices = ndevices;
+	pthread_mutex_init(&m->lock,0);
+
+	for(i=0;i<ndevices;i++) {
+		m->devices[i].slots = calloc(p->queue_depth,sizeof(long long));
+		if(!m->devices[i].slots) {
+			disk_model_delete(m);
+			return 0;
+		}
+		m->devices[i].next_offset = -1;
+	}
+
+	return m;
+}
+
+long long disk_model_submit( struct disk_model *m, int device, int write, off_t offset, int bytes )
+{
+	struct disk_profile *p = &m->profile;
+	struct disk_model_device *dev = &m->devices[device];
+	long long now = disk_model_now_ns();
+	long long latency, transfer, start, finish;
+	int sequential, slot, i;
+
+	pthread_mutex_lock(&m->lock);
+
+	sequential = offset==dev->next_offset;
+	latency = (long long)(1000*(sequential ? p->seq_us : write ? p->write_us : p->read_us));
+	transfer = (long long)(bytes*1000.0/p->bandwidth_mb);
+
+	// Wait for the request in service that completes first
+	slot = 0;
+	for(i=1;i<p->queue_depth;i++) {
+		if(dev->slots[i]<dev->slots[slot]) slot = i;
+	}
+	start = dev->slots[slot]>now ? dev->slots[slot] : now;
+
+	// Then for the channel, once the device has found the data
+	finish = start+latency;
+	if(dev->channel>finish) finish = dev->channel;
+	finish += transfer;
+
+	dev->slots[slot] = finish;
+	dev->channel = finish;
+	dev->next_offset = offset+bytes;
+
+	if(write) m->writes++;
+	else m->reads++;
+	if(sequential) m->sequential++;
+	m->service_ns += latency+transfer;
+	m->queued_ns += finish-now-latency-transfer;
+
+	pthread_mutex_unlock(&m->lock);
+	return finish;
+}
+
+/*
+A sleep can overrun by the timer slack, tens of microseconds, which is as
+long as a whole request to a flash drive.  So sleep until shortly before
+and spin for the rest.
+*/
+
+void disk_model_wait( long long until )
+{
+	struct timespec ts;
+	long long wake = until-DISK_MODEL_SPIN_NS;
+
+	if(!until) return;
+	if(wake>disk_model_now_ns()) {
+		ts.tv_sec = wake/1000000000LL;
+		ts.tv_nsec = wake%1000000000LL;
+		while(clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&ts,0)==EINTR);
+	}
+	while(disk_model_now_ns()<until);
+}
+
+void disk_model_print( struct disk_model *m )
+{
+	struct disk_profile *p = &m->profile;
+	long long requests;
+
+	pthread_mutex_lock(&m->lock);
+	requests = m->reads+m->writes;
+	printf("disk model: %s, read %.0f us, write %.0f us, sequential %.0f us, %.0f MB/s, queue depth %d\n",
+		p->name,p->read_us,p->write_us,p->seq_us,p->bandwidth_mb,p->queue_depth);
+	printf("disk model: %lld reads, %lld writes, %.1f%% sequential, %.1f ms service, %.1f ms queued\n",
+		m->reads,m->writes,requests ? 100.0*m->sequential/requests : 0.0,
+		m->service_ns/1e6,m->queued_ns/1e6);
+	pthread_mutex_unlock(&m->lock);
+}
+
+void disk_model_delete( struct disk_model *m )
+{
+	int i;
+
+	for(i=0;i<m->ndevices;i++) free(m->devices[i].slots);
+	pthread_mutex_destroy(&m->lock);
+	free(m->devices);
+	free(m);
+}
@@ -0,0 +1,74 @@
+
+#ifndef DISK_MODEL_H
+#define DISK_MODEL_H
+
+#include <sys/types.h>
+
+/*
+A model of the cost of I/O on a real device, for layering under a virtual
+disk whose backing files sit in the page cache.  Every request is given a
+service time worked out from the profile alone: a fixed latency, cheaper
+when it carries on where the last request to the device left off, plus the
+time to move its bytes at the device bandwidth.  Up to "queue_depth"
+requests are serviced at once and later ones queue behind them, and all of
+them share the bandwidth.  The service times depend on nothing but the
+order of the requests, so a serial run is charged the same every time.
+
+A profile is given on the command line by name, optionally followed by
+colon separated settings that override it, e.g.
+
+	ssd:read=120:qd=4
+*/
+
+struct disk_profile {
+	const char *name;
+	double read_us;		/* Latency of a random read */
+	double write_us;	/* Latency of a random write */
+	double seq_us;		/* Latency of a request that follows on from the last one */
+	double bandwidth_mb;	/* MB per second moved by each device */
+	int queue_depth;	/* Requests each device services at once */
+};
+
+/*
+Parse a profile given as described above into "p".  Returns 1 on success,
+or 0 if it names no profile or has a setting that is unknown or out of range.
+*/
+
+int disk_model_parse( const char *spec, struct disk_profile *p );
+
+struct disk_model;
+
+/*
+Create a model of "ndevices" devices of profile "p".
+Returns a pointer to a new model, or null on failure.
+*/
+
+struct disk_model * disk_model_create( const struct disk_profile *p, int ndevices );
+
+/*
+Submit a request for "bytes" bytes at "offset" of "device" now.  Returns the
+time on the monotonic clock, in nanoseconds, at which the device would
+complete it.
+*/
+
+long long disk_model_submit( struct disk_model *m, int device, int write, off_t offset, int bytes );
+
+/*
+Sleep until the monotonic clock reaches "until", as returned by
+disk_model_submit.  Returns at once for zero.
+*/
+
+void disk_model_wait( long long until );
+
+/*
+Print how many requests were modelled, how many followed on, and the time
+they were charged for service and spent queueing.
+*/
+
+void disk_model_print( struct disk_model *m );
+
+/* Delete a model. */
+
+void disk_model_delete( struct disk_model *m );
+
+#endif
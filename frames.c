@@ -0,0 +1,429 @@
+#include "frames.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define GREEDY_DECAY 8	/* Latencies are averaged over roughly this many operations */
+
+struct frame_hooks frame_hooks = { NULL, NULL, NULL, NULL };
+
+f_node *frame_table = NULL;
+struct address_space *victim_space = NULL;
+
+f_node *fifo_head = NULL;
+f_node *fifo_tail = NULL;
+
+f_node *ff_head = NULL;
+f_node *ff_tail = NULL;
+f_node *sf_head = NULL;
+f_node *sf_tail = NULL;
+int FIRST_L;
+int SECOND_L;
+int f_entries = 0;
+int s_entries = 0;
+int chance = 0;
+
+int *greedy_heap = NULL;
+int greedy_size = 0;
+double greedy_inflation = 0;
+double greedy_read_ns = 0;
+double greedy_write_ns = 0;
+
+static int is_hot( f_node *node )
+{
+	return frame_hooks.hot != NULL && frame_hooks.hot(node);
+}
+
+static int is_pinned( f_node *node )
+{
+	return frame_hooks.pinned != NULL && frame_hooks.pinned(node);
+}
+
+static int is_victim( f_node *node )
+{
+	return victim_space == NULL || node->space == victim_space;
+}
+
+/*
+Create and insert a new node with the specified frame_index into the fifo list
+*/
+
+void fifo_insert( int frame_index )
+{
+	f_node *node = &frame_table[frame_index];
+
+	/* Pinned pages stay off the list so they are never picked for eviction */
+	if(is_pinned(node)) return;
+
+	/* Insert frame_index into fifo at tail (making it the new tail) */
+	if(fifo_tail == NULL) {
+		fifo_head = node;
+		fifo_tail = node;
+		node->next = NULL;
+		node->prev = NULL;
+		node->f_list = 1;
+	} else {
+		/* Don't insert already inserted items */
+		if(node->f_list == 1) return;
+
+		node->next = fifo_tail;
+		node->prev = NULL;
+		fifo_tail->prev = node;
+		fifo_tail = node;
+		node->f_list = 1;
+	}
+}
+
+/*
+Remove the head node of the fifo list and return its frame_index value,
+or -1 if the fifo list is empty
+*/
+
+int fifo_remove()
+{
+	if(fifo_head == NULL) return -1;
+
+	/* The oldest frame, of the victim address space if there is one, and
+	   not hinted hot unless every candidate is */
+	f_node *node = fifo_pick(1);
+	if(node == NULL) node = fifo_pick(0);
+	if(node == NULL) node = fifo_head;
+	fifo_unlink(node);
+	return FRAMEID(node);
+}
+
+/*
+Find the oldest node in the fifo list belonging to the victim address
+space (any if there is none), optionally passing over hot pages.
+*/
+
+f_node * fifo_pick( int skip_hot )
+{
+	for(f_node *node = fifo_head; node != NULL; node = node->prev) {
+		if(!is_victim(node)) continue;
+		if(skip_hot && is_hot(node)) continue;
+		return node;
+	}
+	return NULL;
+}
+
+/*
+Remove an arbitrary node from the fifo list.
+*/
+
+void fifo_unlink( f_node *node )
+{
+	/* 'next' points towards the head and 'prev' towards the tail */
+	if(node->prev != NULL) node->prev->next = node->next;
+	else fifo_tail = node->next;
+	if(node->next != NULL) node->next->prev = node->prev;
+	else fifo_head = node->prev;
+
+	node->next = NULL;
+	node->prev = NULL;
+	node->f_list = 0;
+}
+
+/*
+Searches the fifo list for a non-dirty page that can be evicted without
+writing back to disk, and takes it off.  Which page we ultimately return
+depends on how many unmodified pages we have out of "nframes".
+Returns -1 if there is none.
+*/
+
+int find_clean_frame( int nframes )
+{
+	if(fifo_tail == NULL) return -1;
+	f_node *node = fifo_tail->next;
+	f_node *candidate = NULL;
+	chance = nframes * 5/6;
+	int i = 0;
+	while(node != NULL && i < chance) {
+		if((node->bits & (~PROT_WRITE)) && is_victim(node) && !is_hot(node)) {
+			i++;
+			candidate = node;
+		}
+		node = node->next;
+	}
+	if(candidate == NULL) return -1;
+	fifo_unlink(candidate);
+	return FRAMEID(candidate);
+}
+
+/*
+Insert a node into the combined first- and second-chance lists.
+In the event that the first list is full, this properly moves one to the second list.
+If that is full as well, this properly evicts the oldest page of the second list.
+*/
+
+void sfo_insert( f_node *node )
+{
+	if(ff_head == NULL) {
+		ff_head = node;
+		ff_tail = node;
+		node->next = NULL;
+		node->prev = NULL;
+	} else {
+		ff_tail->next = node;
+		node->prev = ff_tail;
+		ff_tail = node;
+		node->next = NULL;
+	}
+	node->f_list = 1;
+	f_entries++;
+	sfo_trim();
+}
+
+/*
+Bumps pages from the first-chance list to the second while the first is
+over its size, and evicts from the second while that one is.
+*/
+
+void sfo_trim()
+{
+	f_node *node;
+	while(f_entries > FIRST_L) {
+		/* The oldest one not hinted hot goes, if there is one */
+		f_node *demoted = ff_head;
+		for(node = ff_head; node != NULL; node = node->next) {
+			if(!is_hot(node)) { demoted = node; break; }
+		}
+		sfo_remove(demoted, &ff_head);
+		demoted->prev = sf_tail;
+		demoted->next = NULL;
+		if(sf_tail == NULL) sf_head = demoted;
+		else sf_tail->next = demoted;
+		sf_tail = demoted;
+		demoted->f_list = 2;
+		s_entries++;
+		f_entries--;
+		if(frame_hooks.demoted != NULL) frame_hooks.demoted(demoted);
+	}
+	while(s_entries > SECOND_L) {
+		f_node *victim = sf_head;
+		for(node = sf_head; node != NULL; node = node->next) {
+			if(!is_hot(node)) { victim = node; break; }
+		}
+		if(frame_hooks.evicted != NULL) frame_hooks.evicted(victim);
+		sfo_remove(victim, &sf_head);
+		victim->f_list = 0;
+		s_entries--;
+	}
+}
+
+/*
+Remove a node from our first- or second-chance list and returns its frame number.
+This does _not_ free the node or evict it to disk, since that depends on the context it's called in.
+Note the double-pointer is so we can use this with either list's head.
+*/
+
+int sfo_remove( f_node *node, f_node **head )
+{
+	if(*head == NULL) {
+		printf("Error: We're removing from an empty list!\n");
+		exit(1);
+	}
+	if(node == *head) {
+		int frame = FRAMEID((*head));
+		*head = (*head)->next;
+		if(*head != NULL) {
+			(*head)->prev = NULL;
+		} else if(head == &sf_head) {
+			/* Don't leave a stale tail behind for the next removal to trip over */
+			sf_tail = NULL;
+		} else {
+			ff_tail = NULL;
+		}
+		return frame;
+	}
+	if(head == &sf_head && node == sf_tail) {
+		sf_tail = sf_tail->prev;
+		sf_tail->next = NULL;
+	} else if(head == &ff_head && node == ff_tail) {
+		ff_tail = ff_tail->prev;
+		ff_tail->next = NULL;
+	} else {
+		node->prev->next = node->next;
+		node->next->prev = node->prev;
+	}
+	return FRAMEID(node);
+}
+
+/*
+Pick the node the 2FIFO handler should evict: the oldest in the second-chance
+list, or the first-chance list if that is empty.  When the victim must come
+from a particular address space, its oldest node is used instead.
+*/
+
+f_node * sfo_victim()
+{
+	/* Pages hinted hot are only taken when nothing else qualifies */
+	for(int skip_hot = 1; skip_hot >= 0; --skip_hot) {
+		f_node *node;
+		for(node = sf_head; node != NULL; node = node->next) {
+			if(is_victim(node) && !(skip_hot && is_hot(node))) return node;
+		}
+		for(node = ff_head; node != NULL; node = node->next) {
+			if(is_victim(node) && !(skip_hot && is_hot(node))) return node;
+		}
+	}
+	return sf_head != NULL ? sf_head : ff_head;
+}
+
+/*
+Sizes the 2FIFO first- and second-chance lists for "nframes" frames.
+*/
+
+void split_lists( int nframes )
+{
+	if(nframes < 5) {
+		FIRST_L = nframes - 1;
+		SECOND_L = 1;
+	} else {
+		FIRST_L = nframes * 3/4;
+		SECOND_L = nframes * 1/4;
+		if(nframes % 4 != 0) FIRST_L++;
+	}
+}
+
+/*
+Under GreedyDual every page in a frame carries a credit: the inflation value
+when it came in or was first written, plus what evicting it costs, which
+is a read to bring it back if it is clean and a write as well if it is
+dirty, at the disk latencies measured so far.  The page with the least
+credit is evicted and the inflation value rises to its credit, which ages
+all the others without touching them.  The frames are kept in a binary
+min-heap on their credit, which greedy_heap must have room for all of.
+The pager only sees a reference when it faults, so credit is not renewed on
+every use as GreedyDual would have it, only on fault-in and first write:
+in effect this is FIFO weighted by the cost of eviction.
+*/
+
+/*
+Put a frame on the GreedyDual heap, or move it if it is already there,
+with the inflation value plus its cost to evict as its credit.
+*/
+
+void greedy_insert( int frame_index )
+{
+	f_node *node = &frame_table[frame_index];
+
+	/* Pinned pages stay off the heap so they are never picked for eviction */
+	if(is_pinned(node)) return;
+
+	node->credit = greedy_inflation + greedy_cost(node);
+	if(node->f_list != 1) {
+		node->f_list = 1;
+		node->heap_pos = greedy_size;
+		greedy_heap[greedy_size++] = frame_index;
+	}
+	greedy_sift(node->heap_pos);
+}
+
+/*
+Take the page with the least credit off the heap, of the victim address
+space if there is one and not hinted hot unless every candidate is, and
+raise the inflation value to its credit.  Returns its frame index, or -1
+if the heap is empty.
+*/
+
+int greedy_remove()
+{
+	if(greedy_size == 0) return -1;
+
+	f_node *node = greedy_pick(1);
+	if(node == NULL) node = greedy_pick(0);
+	if(node == NULL) node = &frame_table[greedy_heap[0]];
+	if(node->credit > greedy_inflation) greedy_inflation = node->credit;
+	greedy_unlink(node);
+	return FRAMEID(node);
+}
+
+/*
+Find the node with the least credit belonging to the victim address space
+(any if there is none), optionally passing over hot pages.  That is the
+top of the heap unless it is passed over, when the whole heap is searched:
+with a victim address space set or hot pages about, each eviction costs
+time linear in the number of frames, all of it under the pager lock.
+*/
+
+f_node * greedy_pick( int skip_hot )
+{
+	f_node *best = NULL;
+	for(int i = 0; i < greedy_size; ++i) {
+		f_node *node = &frame_table[greedy_heap[i]];
+		if(!is_victim(node)) continue;
+		if(skip_hot && is_hot(node)) continue;
+		if(i == 0) return node;
+		if(best == NULL || node->credit < best->credit) best = node;
+	}
+	return best;
+}
+
+/*
+Remove an arbitrary node from the heap.
+*/
+
+void greedy_unlink( f_node *node )
+{
+	int pos = node->heap_pos;
+	int last = greedy_heap[--greedy_size];
+
+	node->f_list = 0;
+	if(pos == greedy_size) return;
+	greedy_heap[pos] = last;
+	frame_table[last].heap_pos = pos;
+	greedy_sift(pos);
+}
+
+/*
+Restore the heap order around a node whose credit has changed.
+*/
+
+void greedy_sift( int pos )
+{
+	int frame_index = greedy_heap[pos];
+	double credit = frame_table[frame_index].credit;
+
+	while(pos > 0 && frame_table[greedy_heap[(pos - 1) / 2]].credit > credit) {
+		greedy_heap[pos] = greedy_heap[(pos - 1) / 2];
+		frame_table[greedy_heap[pos]].heap_pos = pos;
+		pos = (pos - 1) / 2;
+	}
+	for(;;) {
+		int child = 2 * pos + 1;
+		if(child >= greedy_size) break;
+		if(child + 1 < greedy_size && frame_table[greedy_heap[child + 1]].credit < frame_table[greedy_heap[child]].credit) {
+			++child;
+		}
+		if(frame_table[greedy_heap[child]].credit >= credit) break;
+		greedy_heap[pos] = greedy_heap[child];
+		frame_table[greedy_heap[pos]].heap_pos = pos;
+		pos = child;
+	}
+	greedy_heap[pos] = frame_index;
+	frame_table[frame_index].heap_pos = pos;
+}
+
+/*
+What evicting a page costs in disk time: reading it back, and writing it
+out first if it is dirty.  Until a latency is measured it counts as one.
+*/
+
+double greedy_cost( f_node *node )
+{
+	double read = greedy_read_ns > 0 ? greedy_read_ns : 1;
+	double write = greedy_write_ns > 0 ? greedy_write_ns : 1;
+	return (node->bits & PROT_WRITE) ? read + write : read;
+}
+
+/*
+Fold a measured latency into a moving average.
+*/
+
+void greedy_observe( double *average, long long ns )
+{
+	if(*average == 0) *average = ns;
+	else *average += (ns - *average) / GREEDY_DECAY;
+}
@@ -0,0 +1,109 @@
+#ifndef FRAMES_H
+#define FRAMES_H
+
+/*
+The frame database of the pager and the lists the replacement policies keep
+its frames on: the FIFO list (also used by the custom policy), the first-
+and second-chance lists of 2FIFO and the GreedyDual heap.  They live apart
+from the pager so that virtmem-bench can time the very same operations.
+None of them lock anything; the pager calls them holding its lock.
+*/
+
+struct address_space;
+
+typedef struct _f_node {
+	int page;
+	int bits; // Not necessarily identical to the BITS in the page table.
+	int free;
+	int f_list; //0 if in none, 1 if in FIFO or first-chance, 2 if in second
+	int busy;   // Set while a page is being read into this frame
+	int writing; // Set while its page is written out with the pager lock dropped
+	int trapped; // Access taken away only to see the next reference (adaptive)
+	double credit; // Eviction order under GreedyDual, least first
+	int heap_pos;  // Place in the GreedyDual heap while f_list is set
+	int probation; // Set aside for pages the admission filter turned away
+	int refs;      // Clones mapping this snapshot frame, besides the snapshot itself
+	int pending;   // Contents still only in the checkpoint restarted from
+	int speculative; // Read back with a cluster, without access until its first reference
+	struct address_space *space; // Owner of the page held in this frame
+	struct _f_node * next;
+	struct _f_node * prev;
+} f_node;
+
+// The below are simple ways to access useful data in the frame database
+// provided the frame number in all but the last case and the node address
+// in the last.
+#define PAGE(x) frame_table[x].page
+#define BITS(x) frame_table[x].bits
+#define FREE(x) frame_table[x].free
+#define BUSY(x) frame_table[x].busy
+#define SPACE(x) frame_table[x].space
+#define FRAMEID(x) ((int) (x - frame_table))
+
+/*
+What the lists need to know of the pages in them, and what they do to them,
+from whoever uses them.  Any hook left null is taken as never hot, never
+pinned, or nothing to do.
+*/
+
+struct frame_hooks {
+	int (*hot)( f_node *node );     /* Hinted hot, only picked when nothing else is */
+	int (*pinned)( f_node *node );  /* Kept off the lists altogether */
+	void (*demoted)( f_node *node ); /* Just moved to the 2FIFO second-chance list */
+	void (*evicted)( f_node *node ); /* Falling off the second-chance list, still on it */
+};
+extern struct frame_hooks frame_hooks;
+
+// Our page frame database.  Each entry is an above-defined f_node.
+extern f_node *frame_table;
+
+// Only frames of this address space are picked as victims, any if null.
+extern struct address_space *victim_space;
+
+// The head and tail of our FIFO list.
+extern f_node *fifo_head;
+extern f_node *fifo_tail;
+
+// The heads and tails of our 2FIFO list.  Due to differences in style,
+// the 2FIFO lists use 'next' to point towards the tail, and the FIFO
+// lists use 'next' to point towards the head.
+extern f_node *ff_head;
+extern f_node *ff_tail;
+extern f_node *sf_head;
+extern f_node *sf_tail;
+extern int FIRST_L;
+extern int SECOND_L; //Sizes for first and second-chance lists
+extern int f_entries;
+extern int s_entries;
+extern int chance; // Used in our custom algorithm to determine where in our list
+                   // to remove a node.
+
+// The GreedyDual heap (see greedy_insert).
+extern int *greedy_heap; // Frame indices, least credit first
+extern int greedy_size;
+extern double greedy_inflation;
+extern double greedy_read_ns;  // Moving averages of the disk latencies, 0 until measured
+extern double greedy_write_ns;
+
+void fifo_insert( int frame_index );
+int  fifo_remove();
+f_node * fifo_pick( int skip_hot );
+void fifo_unlink( f_node * node );
+int find_clean_frame( int nframes );
+
+// We use separate functions to handle the second-chance FIFO insertions/removals.
+void sfo_insert( f_node * node );
+void sfo_trim();
+int sfo_remove( f_node * node, f_node ** head );
+f_node * sfo_victim();
+void split_lists( int nframes );
+
+void greedy_insert( int frame_index );
+int greedy_remove();
+f_node * greedy_pick( int skip_hot );
+void greedy_unlink( f_node * node );
+void greedy_sift( int pos );
+double greedy_cost( f_node * node );
+void greedy_observe( double *average, long long ns );
+
+#endif
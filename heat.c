@@ -0,0 +1,257 @@
+
+#include "heat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HEAT_HOTTEST 8
+
+/*
+The counters of a page, kept together so that a fault touches one line.
+"since" is one more than the time the page was read into its frame, and
+"evicted_at" one more than the eviction clock when it was last evicted;
+zero means it is not in a frame, or was not evicted.
+*/
+
+struct heat_page {
+	unsigned faults;
+	unsigned refaults;
+	unsigned writes;
+	unsigned resident;
+	unsigned since;
+	unsigned evicted_at;
+};
+
+struct heat {
+	int npages;
+	int ncolumns;
+	int interval;
+	struct heat_page *pages;
+	unsigned distances[HEAT_DISTANCES];
+	unsigned current[HEAT_COLUMNS];
+	unsigned rows[HEAT_ROWS][HEAT_COLUMNS];
+	int nrows;
+	int span;	/* Samples folded into each row */
+	int pending;	/* Samples folded into the row being filled */
+};
+
+struct heat * heat_create( int npages, int interval )
+{
+	struct heat *h;
+
+	if(npages<1) return 0;
+
+	h = calloc(1,sizeof(struct heat));
+	if(!h) return 0;
+
+	h->pages = calloc(npages,sizeof(struct heat_page));
+	if(!h->pages) {
+		free(h);
+		return 0;
+	}
+	h->npages = npages;
+	h->ncolumns = npages<HEAT_COLUMNS ? npages : HEAT_COLUMNS;
+	h->interval = interval;
+	h->span = 1;
+	return h;
+}
+
+void heat_fault( struct heat *h, int page, int write )
+{
+	h->pages[page].faults++;
+	if(write) h->pages[page].writes++;
+	h->current[(long long)page*h->ncolumns/h->npages]++;
+}
+
+void heat_page_in( struct heat *h, int page, unsigned now, unsigned evictions )
+{
+	struct heat_page *p = &h->pages[page];
+
+	if(p->evicted_at) {
+		unsigned distance = evictions-(p->evicted_at-1);
+		int b = distance>1 ? 31-__builtin_clz(distance) : 0;
+		h->distances[b<HEAT_DISTANCES ? b : HEAT_DISTANCES-1]++;
+		p->refaults++;
+		p->evicted_at = 0;
+	}
+	p->since = now+1;
+}
+
+void heat_page_out( struct heat *h, int page, unsigned now, unsigned evictions, int evicted )
+{
+	struct heat_page *p = &h->pages[page];
+
+	if(p->since) p->resident += now-(p->since-1);
+	p->since = 0;
+	p->evicted_at = evicted ? evictions+1 : 0;
+}
+
+void heat_sample( struct heat *h )
+{
+	int r, c;
+
+	for(c=0;c<h->ncolumns;c++) {
+		h->rows[h->nrows][c] += h->current[c];
+		h->current[c] = 0;
+	}
+	if(++h->pending<h->span) return;
+
+	h->pending = 0;
+	if(++h->nrows<HEAT_ROWS) return;
+
+	// Out of rows: merge them in pairs, each covering twice the time from now on
+	for(r=0;r<HEAT_ROWS/2;r++) {
+		for(c=0;c<h->ncolumns;c++) {
+			h->rows[r][c] = h->rows[2*r][c]+h->rows[2*r+1][c];
+		}
+	}
+	memset(h->rows[HEAT_ROWS/2],0,sizeof(h->rows[0])*(HEAT_ROWS/2));
+	h->nrows = HEAT_ROWS/2;
+	h->span *= 2;
+}
+
+static int compare_counts( const void *pa, const void *pb )
+{
+	unsigned a = *(const unsigned *)pa;
+	unsigned b = *(const unsigned *)pb;
+	return a<b ? 1 : a>b ? -1 : 0;
+}
+
+/*
+Print how few pages take up half, nine tenths and nearly all of the faults.
+*/
+
+static void heat_print_hot_set( struct heat *h, unsigned long long faults )
+{
+	static const double shares[] = { 0.5, 0.9, 0.99 };
+	unsigned *counts = malloc(sizeof(unsigned)*h->npages);
+	unsigned long long seen = 0;
+	int i, s = 0;
+
+	if(!counts || !faults) {
+		free(counts);
+		return;
+	}
+	for(i=0;i<h->npages;i++) counts[i] = h->pages[i].faults;
+	qsort(counts,h->npages,sizeof(unsigned),compare_counts);
+
+	printf("heat: hot set");
+	for(i=0;i<h->npages && s<3;i++) {
+		seen += counts[i];
+		while(s<3 && seen>=shares[s]*faults) {
+			printf(" %.0f%% of faults in %d pages%s",shares[s]*100,i+1,s<2 ? "," : "");
+			s++;
+		}
+	}
+	printf("\n");
+	free(counts);
+}
+
+/*
+Print the pages that faulted most, with how much of the time they held a frame.
+*/
+
+static void heat_print_hottest( struct heat *h, unsigned now )
+{
+	int hottest[HEAT_HOTTEST];
+	int n = 0, i, j;
+
+	for(i=0;i<h->npages;i++) {
+		unsigned faults = h->pages[i].faults;
+		if(!faults) continue;
+		if(n<HEAT_HOTTEST) j = n++;
+		else if(faults>h->pages[hottest[n-1]].faults) j = n-1;
+		else continue;
+		for(;j>0 && h->pages[hottest[j-1]].faults<faults;j--) hottest[j] = hottest[j-1];
+		hottest[j] = i;
+	}
+
+	printf("heat: %8s %8s %8s %8s %9s\n","page","faults","refaults","writes","resident");
+	for(i=0;i<n;i++) {
+		struct heat_page *p = &h->pages[hottest[i]];
+		unsigned resident = p->resident+(p->since ? now-(p->since-1) : 0);
+		printf("heat: %8d %8u %8u %8u %8.1f%%\n",hottest[i],p->faults,p->refaults,p->writes,
+			now ? 100.0*resident/now : 0.0);
+	}
+}
+
+/*
+Print the distribution of refault distances.  A page evicted "d" evictions
+before it was read back in would roughly have stayed in with "d" more
+frames, so the cumulative share is what that many more frames would save.
+*/
+
+static void heat_print_distances( struct heat *h, unsigned long long refaults )
+{
+	unsigned long long seen = 0;
+	int last = -1, b;
+
+	for(b=0;b<HEAT_DISTANCES;b++) if(h->distances[b]) last = b;
+	if(last<0) return;
+
+	printf("heat: %14s %8s %10s\n","distance <","refaults","cumulative");
+	for(b=0;b<=last;b++) {
+		seen += h->distances[b];
+		printf("heat: %14u %8u %9.1f%%\n",2u<<b,h->distances[b],100.0*seen/refaults);
+	}
+}
+
+/*
+Print the heatmap, darker for more faults: a row per stretch of time, a
+column per range of pages.
+*/
+
+static void heat_print_map( struct heat *h )
+{
+	static const char shades[] = " .:-=+*#%@";
+	unsigned rows[HEAT_ROWS+1][HEAT_COLUMNS];
+	unsigned max = 0;
+	int nrows = h->nrows, r, c;
+
+	memcpy(rows,h->rows,sizeof(h->rows));
+	for(c=0;c<h->ncolumns;c++) rows[nrows][c] += h->current[c];
+	for(c=0;c<h->ncolumns;c++) if(rows[nrows][c]) break;
+	if(c<h->ncolumns) nrows++;
+
+	for(r=0;r<nrows;r++) {
+		for(c=0;c<h->ncolumns;c++) if(rows[r][c]>max) max = rows[r][c];
+	}
+	if(!max) return;
+
+	printf("heat: faults over pages 0-%d (columns) and time (rows), darkest %u\n",h->npages-1,max);
+	for(r=0;r<nrows;r++) {
+		printf("heat: %10llu |",(unsigned long long)r*h->span*h->interval);
+		for(c=0;c<h->ncolumns;c++) {
+			unsigned cell = rows[r][c];
+			putchar(cell ? shades[1+(int)((unsigned long long)cell*(sizeof(shades)-3)/max)] : ' ');
+		}
+		printf("|\n");
+	}
+}
+
+void heat_print( struct heat *h, unsigned now )
+{
+	unsigned long long faults = 0, refaults = 0, writes = 0;
+	int touched = 0, i;
+
+	for(i=0;i<h->npages;i++) {
+		faults += h->pages[i].faults;
+		refaults += h->pages[i].refaults;
+		writes += h->pages[i].writes;
+		if(h->pages[i].faults) touched++;
+	}
+
+	printf("heat: %d of %d pages touched, %llu faults, %llu writes, %llu refaults\n",
+		touched,h->npages,faults,writes,refaults);
+	heat_print_hot_set(h,faults);
+	heat_print_hottest(h,now);
+	heat_print_distances(h,refaults);
+	heat_print_map(h);
+}
+
+void heat_delete( struct heat *h )
+{
+	free(h->pages);
+	free(h);
+}
@@ -0,0 +1,66 @@
+
+#ifndef HEAT_H
+#define HEAT_H
+
+/*
+Per-page heat of an address space: how often each page faulted, was read
+back in after being evicted, and was written, and for how long it held a
+frame.  Time is counted in faults and distance in evictions, both from
+clocks kept by the caller, so that several address spaces sharing frames
+can be compared.  A sampler closes off a row of a heatmap of faults over
+ranges of pages every so often.
+*/
+
+#define HEAT_COLUMNS 64
+#define HEAT_ROWS    32
+#define HEAT_DISTANCES 24
+
+struct heat;
+
+/*
+Create the heat of an address space of "npages" pages, sampled every
+"interval" faults (only used to label the heatmap).
+Returns a pointer to a new heat, or null on failure.
+*/
+
+struct heat * heat_create( int npages, int interval );
+
+/*
+Count a fault on "page", "write" set if it only wanted write access.
+*/
+
+void heat_fault( struct heat *h, int page, int write );
+
+/*
+Count "page" being read into a frame at time "now", with "evictions" the
+eviction clock, so that a page evicted before is counted as a refault.
+*/
+
+void heat_page_in( struct heat *h, int page, unsigned now, unsigned evictions );
+
+/*
+Count "page" leaving its frame at time "now".  If "evicted" is set it was
+pushed out to make room, and reading it back later is a refault.
+*/
+
+void heat_page_out( struct heat *h, int page, unsigned now, unsigned evictions, int evicted );
+
+/*
+Close off the current row of the heatmap.
+*/
+
+void heat_sample( struct heat *h );
+
+/*
+Print a report on the heat at time "now": totals, the hot set, the hottest
+pages, refault distances and how many refaults more frames would have
+avoided, and the heatmap.
+*/
+
+void heat_print( struct heat *h, unsigned now );
+
+/* Delete the heat of an address space. */
+
+void heat_delete( struct heat *h );
+
+#endif
@@ -1,7 +1,6 @@
 /*
-Main program for the virtual memory project.
-Make all of your modifications to this file.
-You may add or rearrange any code or data as you need.
+Main program for the virtual memory project: the pager, its replacement
+policies and everything around them.
 The header files page_table.h and disk.h explain
 how to use the page table and disk interfaces.
 */
@@ -19,125 +18,730 @@ how to use the page table and disk interfaces.
 #include "page_table.h"
 #include "disk.h"
 #include "program.h"
+#include "shadow.h"
+#include "stats_shm.h"
+#include "heat.h"
+#include "workload.h"
+#include "disk_model.h"
+#include "admission.h"
+#include "frames.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 //#define DEBUG
 //#define MOVE
 //#define DEBUG2
 //#define RESULTS
 
-// The below are simple ways for us to access useful data in the page table
-// provided the frame number in the former three cases and the node address
-// in the last.
-#define PAGE(x) frame_table[x].page
-#define BITS(x) frame_table[x].bits
-#define FREE(x) frame_table[x].free
-#define FRAMEID(x) ((int) (x - frame_table))
-
-int FIRST_L;
-int SECOND_L; //Sizes for first and second-chance lists
+// The disk block of the page in a frame, besides those in frames.h.
+#define BLOCK(x) (frame_table[x].space->base + frame_table[x].page)
 
 struct disk *disk = NULL;
+struct disk_model *disk_model = NULL;
 char *virtmem = NULL;
 char *physmem = NULL;
-int f_entries = 0;
-int s_entries = 0;
-int chance = 0; // Used in our custom algorithm to determine where in our list
-                // to remove a node.
 
 
 // Statistics -----------------------------------------------------------------
+// Every thread counts into its own copy of stats, which is added into
+// total_stats when the thread exits (or when merge_stats is called).
 struct stats {
     int page_faults;
     int disk_reads;
     int disk_writes;
     int evictions;
+    int fault_arounds; // Neighbouring pages mapped along with a fault
+    int readaheads;    // Pages brought in ahead of time on a hint
+    int discards;      // Pages dropped on a hint without being written back
+    int traps;         // References to sampled pages seen by the adaptive policy
+    int restores;      // Pages copied into their frame from the checkpoint restarted from
 };
-struct stats stats;
+__thread struct stats stats;
+struct stats total_stats;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t stats_key;
 
+void merge_stats();
 void print_stats(); // Outputs statistics slightly nicely.
 void graph_stats(); // Used to output data for graphing. 
 
+
+// Statistics export ----------------------------------------------------------
+// With -s the counters above, a histogram of how long faults take to handle
+// and the state of the frames are published to shared memory (see
+// stats_shm.h) for virtmem-top to watch while the programs run.  Each thread
+// adds in what it has counted since it last published, at the end of every
+// fault; the frames are scanned at most once every EXPORT_SCAN_NS.
+#define EXPORT_SCAN_NS 10000000LL
+
+struct stats_shm *stats_export = NULL;
+__thread struct stats published;   // What this thread has published so far
+long long export_scanned = 0;      // When the frames were last scanned
+
+long long now_ns();
+void export_stats(long long start);
+void export_counters();
+void export_counters_locked();
+void export_scan(long long now);
+void export_finish();
+
+
+// Concurrency ----------------------------------------------------------------
+// The page table serializes faults on the same page; pager_lock protects
+// the frame table and the policy lists.  It is dropped while a page is read
+// in from disk, with the frame marked busy so nobody else reuses it.
+pthread_mutex_t pager_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t frame_cond = PTHREAD_COND_INITIALIZER;
+
+__thread int thread_id = -1;
+int nthreads_seen = 0;
+
+int nbusy = 0;
+
+void read_page(int page, int frame_index);
+int wait_for_frame();
+
+
+// Address spaces -------------------------------------------------------------
+// Every tenant has its own page table, all of them faulting into one shared
+// pool of frames, and its own region of the disk.  Under global replacement
+// any frame may be taken; under local replacement a tenant that has reached
+// its quota of frames must give up one of its own, and the quotas are
+// periodically redistributed according to the allocation policy.
+#define MAX_SPACES 16
+
+struct address_space {
+    struct page_table *pt;
+    const char *program;
+    int id;
+    int base;          // First disk block of this address space
+    int resident;      // Frames currently holding its pages
+    int quota;         // Frames it may hold under local replacement
+    int faults;        // Faults taken in the current allocation window
+    int total_faults;
+    unsigned char *touched; // Pages faulted on in the current window
+    int wss;           // Distinct pages faulted on in the current window
+    unsigned char *swapped; // Pages written to disk at least once (fault-around only)
+    unsigned char *advice;  // Access hints given for each page (hints only)
+    struct heat *heat;      // Per-page heat (heat tracking only)
+    int clone_of;           // Space this one runs in a clone of, -1 for none
+    struct address_space *backing; // Snapshot holding the pages not written since (clones only)
+    unsigned char *own;     // Pages it has its own copy of, NULL for all of them
+    int owned;              // Pages set in own
+    int exited;             // Its program is done and nothing is left to clone it (clones only)
+    long long *evicted_at;  // Eviction each page was last logged at, plus one (cluster readahead only)
+    long long writebacks;   // Pages written out to disk so far
+};
+struct address_space spaces[MAX_SPACES];
+int nspaces = 0;
+
+enum scope_e { GLOBAL, LOCAL };
+enum scope_e replacement_scope = GLOBAL;
+
+enum alloc_e { ALLOC_EQUAL, ALLOC_WSS, ALLOC_PFF };
+enum alloc_e alloc_policy = ALLOC_PFF;
+
+int window_faults = 0; // Faults since quotas were last redistributed
+
+// With -H the heat of every page is tracked (see heat.h), with time counted
+// in faults and refault distances in evictions over all address spaces, and
+// a row of the heatmap is sampled every args.heat_interval faults.
+unsigned heat_now = 0;
+unsigned heat_evictions = 0;
+
+void heat_tick();
+void print_heat();
+
+// The address space of the fault being handled, and the one that has to
+// give up a frame if one must be evicted (victim_space in frames.h, NULL for
+// any).  Both are only meaningful while holding the pager lock.
+struct address_space *fault_space = NULL;
+
+struct address_space * space_of(struct page_table *pt);
+struct address_space * choose_victim_space();
+void account_fault(int page);
+int fill_page(struct address_space *space, int page, int frame_index);
+void rebalance_quotas();
+void print_spaces();
+
+
+// Access hints ---------------------------------------------------------------
+// Programs describe how they use their memory through page_table_advise.
+// The access pattern of each page is kept in the low bits of its advice
+// byte, the rest are flags.  Sequential pages are read ahead of faults,
+// random ones never are, hot pages are evicted last, and pinned pages are
+// taken off the policy lists altogether so they are never evicted.  Of the
+// pages read ahead or asked for ahead of time, the ones that have to come
+// from disk are read in batches (see disk_read_batch), which a striped disk
+// spreads over its devices.
+#define ADVICE_PATTERN   0x03
+#define ADVICE_HOT       0x04
+#define ADVICE_PINNED    0x08
+#define ADVICE_DISCARDED 0x10 // Dropped without writeback; reads back as zeros
+
+#define ADVICE(space, page) ((space)->advice != NULL ? (space)->advice[page] : 0)
+
+int npinned = 0;
+
+void page_advice_handler( struct page_table *pt, int page, int npages, int advice );
+void read_ahead(struct page_table *pt, int page);
+void prefetch_page(struct page_table *pt, int page);
+void prefetch_range(struct page_table *pt, int first, int n);
+void stage_pages(struct address_space *space, int first, int n);
+void drop_page(struct page_table *pt, int page);
+void pin_page(struct page_table *pt, int page);
+void unpin_page(struct page_table *pt, int page);
+int readahead_window();
+
+
+// Memory balloon -------------------------------------------------------------
+// The frame pool may grow or shrink while the programs run.  Shrinking
+// evicts through the active policy until the pages in frames fit, then moves
+// the ones left beyond the new size down into the frames that were freed.
+// With -B a driver thread resizes on a schedule, and the fault rate of every
+// step of the schedule is reported at the end.
+#define MAX_RESIZES 16
+
+struct resize_step {
+    int at_ms;        // When to resize, counted from the start of the programs
+    int nframes;      // Frames from then on
+    int reached;      // Set once the step has been taken
+    int failed;       // The pool could not be shrunk that far
+    double started;   // Seconds since the start when the step was taken
+    int faults_at;    // Faults taken before the step
+    int evicted;      // Pages evicted to shrink the pool
+    int moved;        // Pages moved down into lower frames
+};
+// Step 0 is the size the programs start with
+struct resize_step schedule[MAX_RESIZES + 1];
+int nresizes = 0;
+
+pthread_mutex_t balloon_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t balloon_cond = PTHREAD_COND_INITIALIZER;
+int balloon_stop = 0;
+struct timespec balloon_start;
+double balloon_ended;
+int balloon_faults;
+
+int resize_frames(int nframes, int *evicted, int *moved);
+int policy_victim();
+void move_frame(int from, int to);
+void rebuild_frame_table(int nframes);
+int parse_schedule(char *list);
+void * balloon_driver(void *arg);
+void take_step(int i);
+int total_faults();
+double balloon_clock();
+void print_balloon();
+
+
 // Program arguments ----------------------------------------------------------
+#define MAX_DISKS 16
+
+// How programs touch their memory: plain loads and stores that fault through
+// a signal, the software access functions of the page table, or both one
+// after the other for comparison.
+enum access_e { ACCESS_SIGNAL, ACCESS_SOFT, ACCESS_COMPARE };
+
 struct args {
     int npages;
     int nframes;
     const char *policy;
     const char *program;
+    int nthreads;                 // Run the parallel version of the program
+    char *programs;               // Comma separated, one address space each
+    const char *disks[MAX_DISKS]; // Backing files, more than one means striped
+    int ndisks;
+    int stripe;                   // Consecutive blocks per backing file
+    const char *memserver;        // Socket of a memory server to keep the disk in instead
+    const char *fast_disk;        // Fast swap tier in front of the disks above
+    int fast_blocks;
+    int demote_ms;                // Idle time before fast tier blocks are demoted
+    enum access_e access;
+    int page_size;                // Bytes per page and per disk block
+    int fault_around;             // Pages mapped together on a fault
+    int batch;                    // Defer page table updates to the end of each fault
+    int hints;                    // Act on the access hints given by the programs
+    int filter;                   // Put a TinyLFU admission filter in front of the policy
+    const char *stats_name;       // Shared memory segment to publish statistics in
+    int heat_interval;            // Faults between heatmap rows, 0 to not track heat
+    const char *device;           // Profile of the device model the disk is charged to
+    struct disk_profile profile;
+    const char *checkpoint;       // File to save the pager state in when the programs are done
+    const char *restart;          // Checkpoint to start from instead of empty
+    int cluster;                  // Read back the pages evicted along with a refaulted one
 };
 struct args args;
 
+void usage();
+int parse_disks(char *list);
+int parse_fast_disk(char *spec);
+int parse_programs(char *list);
+int known_program(const char *program);
+int parse_size(const char *arg);
+void run_program(const char *program, struct page_table *pt);
+void * run_space(void *arg);
+double run_spaces(int soft);
+void reset_pager();
+
+int soft_access = 0; // Programs currently run through the software access path
+
 
 // Page fault handling policies and handler functions -------------------------
-enum policy_e { RAND, FIFO, TWO_FIFO, CUSTOM };
+enum policy_e { RAND, FIFO, TWO_FIFO, CUSTOM, GREEDY };
 enum policy_e fault_policy;
 
 void page_fault_handler_rand( struct page_table *pt, int page );
 void page_fault_handler_fifo( struct page_table *pt, int page );
 void page_fault_handler_2fifo( struct page_table *pt, int page );
 void page_fault_handler_custom( struct page_table *pt, int page );
+void page_fault_handler_greedy( struct page_table *pt, int page );
+void page_fault_around_handler( struct page_table *pt, int page );
+void handle_fault( struct page_table *pt, int page );
+void map_page( struct page_table *pt, int page );
+void register_thread();
+int fault_around_group();
 
 // Functions to help in determining where to put a new frame.
 int find_free_frame();
-int find_clean_frame();
-
-
-// FIFO list ------------------------------------------------------------------
-typedef struct _f_node {
-    int page;
-    int bits; // Not necessarily identical to the BITS in the page table.
-    int free;
-    int f_list; //0 if in none, 1 if in FIFO or first-chance, 2 if in second
-    struct _f_node * next;
-    struct _f_node * prev;
-} f_node;
+int find_random_frame();
 
-// Our page frame database.  Each entry is an above-defined f_node.
-f_node *frame_table = NULL;
 
-// The head and tail of our FIFO list.
-f_node *fifo_head = NULL;
-f_node *fifo_tail = NULL;
+// Free frame allocator -------------------------------------------------------
+// Free frames are spread over several independently locked stacks.  Each
+// thread allocates from its own shard first and only steals from the others
+// when that runs dry, so concurrent faults rarely contend on the same lock.
+#define FRAME_SHARDS 8
 
-// The heads and tails of our 2FIFO list.  Due to differences in style,
-// the 2FIFO lists use 'next' to point towards the tail, and the FIFO
-// lists use 'next' to point towards the head.
-f_node *ff_head = NULL;
-f_node *ff_tail = NULL;
-f_node *sf_head = NULL;
-f_node *sf_tail = NULL;
+struct frame_shard {
+    pthread_mutex_t lock;
+    int *frames;
+    int nfree;
+};
+struct frame_shard frame_shards[FRAME_SHARDS];
+
+void frame_pool_init(int nframes);
+void frame_pool_destroy();
+void release_frame(int frame_index);
+int frame_shard_of(int frame_index);
+
+
+// Policy lists ---------------------------------------------------------------
+// The frame database and the lists the policies keep frames on are in
+// frames.h.  These tell the lists about the pager's pages.
+void unlist_frame(int frame_index);
+int page_is_hot(f_node * node);
+int page_is_pinned(f_node * node);
+void demote_frame(f_node * node);
+void drop_frame(f_node * node);
+
+void evict(int f_num);
+void evict_for_read(int f_num);
+void defer_writebacks(int max);
+void flush_writebacks();
+
+// Dirty pages evicted while writebacks are deferred, to be written out in one batch
+int *deferred_blocks = NULL;
+char **deferred_data = NULL;
+int ndeferred = 0;
+__thread int unlocked_writeback = 0; // Set while evict may drop the pager lock to write a page out
+
+
+// Admission filter -----------------------------------------------------------
+// With -F a TinyLFU filter (see admission.h) sits in front of the live
+// policy, whichever it is, and counts every fault as a reference.  When a
+// demand fault needs a frame, the page the policy offers up is only evicted
+// if the newcomer was referenced more often lately.  Otherwise the victim
+// goes back on the policy's list and the newcomer is served from one of a
+// few probation frames, kept off the lists and reused in turn.  A page that
+// keeps coming back through probation gains frequency until it is let in,
+// while pages touched once, as in a scan, never displace anything.
+#define PROBATION_SHARE 32 // One probation frame per this many frames, at least one
+
+struct admission *admission = NULL;
+int *probation = NULL;      // Frames set aside for pages turned away
+int nprobation = 0;
+int probation_next = 0;     // The probation frame to reuse next
+__thread int filtering = 0; // Set while this thread maps the page of a demand fault
+int admitted = 0;           // Demand faults that displaced the policy's victim
+int rejected = 0;           // Demand faults served through probation instead
+
+void admission_init();
+void admission_destroy();
+int admission_fault(struct page_table *pt, int page);
+int probation_slot();
+int propose_victim();
+void relist_frame(int frame_index);
+int frames_free();
+
+
+// Snapshots ------------------------------------------------------------------
+// A program given as program@k runs in a clone of space k, taken once the
+// program of space k is done.  Cloning hands the pages of k, in frames and
+// in its disk region, over to a frozen snapshot, and backs both k and the
+// clone with it; k starts over in a fresh disk region.  A page a space has
+// not written since is looked up in its snapshot (or in that one's own
+// snapshot, for clones of clones) and the snapshot's frame is mapped
+// read-only, counted in the frame's refs.  Writing it gives the space its own
+// copy: the frame is copied if anyone else still sees the snapshot's page,
+// and otherwise just handed over.  A clone thus costs a pass over the frames
+// to take write access from the resident pages, whatever the size of the
+// space, and only the pages it writes take memory of its own.  A space whose
+// program is done and that nothing is left to clone exits, giving up its
+// frames, so the snapshot's pages only it still saw can be handed over.
+struct address_space snapshots[MAX_SPACES];
+int nsnapshots = 0;
+int nclones = 0;
+int nregions = 0;        // Disk regions handed out, one space's worth of blocks each
+__thread int copy_from = -1; // Frame to fill the page being brought in from, -1 to read it
+
+// Snapshot pages being brought in, which other faults on them wait for
+struct fetch {
+    struct address_space *space;
+    int page;
+    struct fetch *next;
+};
+struct fetch *fetching = NULL;
+
+int clones_taken = 0;
+long long clone_ns = 0;  // Spent taking all of them
+int cow_shared = 0;      // Faults served by mapping a snapshot's frame
+int cow_copied = 0;      // Writes that copied a snapshot's frame
+int cow_handed = 0;      // Writes that took a snapshot's frame over
+
+void clone_space(struct address_space *clone);
+void exit_space(struct address_space *space);
+void take_snapshot(struct address_space *space);
+int shared_fault(struct page_table *pt, int page);
+int snapshot_frame(struct address_space *snapshot, int page);
+void unshare_frame(int frame_index);
+struct address_space * source_of(struct address_space *space, int page);
+int owns(struct address_space *space, int page);
+void own_page(struct address_space *space, int page);
+int inherited(struct address_space *snapshot, struct address_space *except, int page);
+
+
+// Checkpoints ----------------------------------------------------------------
+// With -c the state of the pager is saved to a file once the programs are
+// done: the page of which space every frame holds and with what access,
+// the order of the policy lists, the pages written out to disk, and an
+// image of every frame in use.  With -r a run starts from such a file
+// instead of from empty frames.  The frame table and the lists are set up
+// again at once, but a page is only copied into its frame from the image on
+// its first access, which then costs no disk read and no eviction.  Pages
+// not touched again are never copied in unless they are evicted dirty.  The
+// file is in native byte order, and describes the disk as it was when it
+// was saved, so restarting is refused once the disk files have changed.
+#define CHECKPOINT_MAGIC "vmckpt1"
+
+struct checkpoint_header {
+    char magic[8];
+    int npages;
+    int nframes;
+    int page_size;
+    int nspaces;
+    int policy;
+    int ndisks;
+    int stripe;
+    int swapped;           // Whether the pages written out are recorded (fault-around only)
+    int listed[2];         // Frames on the policy list, and on the 2FIFO second-chance list
+    double greedy_inflation;
+    double greedy_read_ns;
+    double greedy_write_ns;
+    long long disk_size[MAX_DISKS];
+    long long disk_mtime[MAX_DISKS];
+};
 
-void fifo_insert(int frame_index);
-int  fifo_remove();
+// What is saved of each frame, followed by the frames on the lists in order
+struct checkpoint_frame {
+    int space;             // -1 for a free frame
+    int page;
+    int bits;
+    int f_list;
+    double credit;
+};
 
-// We use separate functions to handle the second-chance FIFO insertions/removals.
-void sfo_insert(struct page_table *pt, f_node * node);
-int sfo_remove(f_node * node, f_node ** head);
+struct checkpoint_header restart_header;
+FILE *restart_file = NULL;     // Checkpoint started from, which holds the images not copied in
+off_t restart_images = 0;      // Where the frame images start in it
+int nrestarted = 0;            // Frames restarted with a page in them
+int npending = 0;              // Of those, the ones whose image is not copied in yet
+int restart_written = 0;       // Of those, copied in only to be written back or checkpointed
+int restart_dropped = 0;       // Of those, forgotten as their page was dropped or evicted clean
+long long restart_ns = 0;      // Spent setting the frames up again
+
+int open_checkpoint(const char *name);
+int restore_checkpoint();
+int save_checkpoint(const char *name);
+int restore_fault(struct page_table *pt, int page);
+void restore_image(int frame_index);
+void forget_image(int frame_index);
+int stat_disks(long long *size, long long *mtime);
+
+
+// Cluster readahead ----------------------------------------------------------
+// Pages evicted together tend to be referenced together again, whatever
+// their addresses, as in focus or the phases of sort.  With -C every
+// eviction is logged, and runs of CLUSTER_PAGES consecutive ones make up a
+// cluster.  When a page is refaulted while its cluster is still in the log,
+// the pages of its space evicted in the same cluster that are still out are
+// read back along with it, all in one batch (see disk_read_batch).  They go
+// into frames without access, so that their next reference shows that
+// reading them paid off; one evicted first was wasted.  After every window
+// of CLUSTER_WINDOW such outcomes, clusters stop being read back if fewer
+// than half were hits.  While they are not, the refaults are still matched
+// against the clusters to see which pages would have been read back, and
+// reading starts again once half of those would have been hits.
+#define CLUSTER_PAGES  8
+#define CLUSTER_WINDOW 64
+
+struct evicted_page {
+    struct address_space *space;
+    int page;
+};
+struct evicted_page *evict_log = NULL; // The last evict_log_size evictions
+int evict_log_size = 0;                 // A multiple of CLUSTER_PAGES
+long long evict_seq = 0;                // Evictions logged so far
+
+// The pages of a cluster read back, staged until they are in frames
+struct cluster {
+    struct address_space *space;
+    int n;
+    int pages[CLUSTER_PAGES];        // The refaulted page first
+    long long evicted[CLUSTER_PAGES]; // The eviction each was read back from
+    long long writebacks;            // -1, or the space's writebacks when read ahead instead
+    char *data;                      // The pages, one after the other
+};
+__thread struct cluster *staged = NULL;
 
-void evict(struct page_table * pt, int f_num);
+// Clusters that would have been read back, while they are not
+struct ghost_cluster {
+    long long first;  // Its first eviction plus one
+    long long opened; // Evictions logged when it would have been read back
+    int left;         // Pages that would have been read back and have not refaulted yet
+};
+struct ghost_cluster *ghosts = NULL;
+
+int clustering = 1;      // Whether clusters are read back, or only watched
+int nspeculative = 0;    // Frames holding pages read back and not referenced since
+int cluster_reads = 0;   // Clusters read back
+int cluster_pages = 0;   // Pages read back along with a refaulted one
+int cluster_hits = 0;    // Of those, the ones referenced before they were evicted
+int cluster_wasted = 0;  // and the ones evicted first
+int cluster_offs = 0;    // Times reading clusters back was switched off
+int cluster_ons = 0;     // and back on
+int window_hits = 0;     // Outcomes in the current window
+int window_wasted = 0;
+int ghost_reads = 0;     // Pages that would have been read back in the current window
+int ghost_hits = 0;      // and of those, the ones refaulted
+
+void cluster_init();
+void cluster_destroy();
+void log_eviction(struct address_space *space, int page);
+void read_cluster(struct page_table *pt, int page);
+int cluster_mates(struct address_space *space, int page, long long first, int *mates, long long *evicted);
+int needs_read(struct address_space *space, int page);
+void watch_cluster(long long first, int n);
+char * staged_page(struct address_space *space, int page);
+void staged_writeback(struct address_space *space, int page);
+void unstage();
+int claim_speculative(struct page_table *pt, int page, int referenced);
+void unspeculate(int frame_index);
+void cluster_outcome(int hit);
+
+
+// Adaptive policy ------------------------------------------------------------
+// Under the "adaptive" policy every candidate policy is simulated in a shadow
+// (see shadow.h) over a sample of the pages.  Only faults reach the pager, so
+// to see the references to sampled pages that are in frames, the ones
+// referenced last keep their access and the one pushed out by a new one
+// loses it.  Touching it again traps, which gives it straight back without
+// involving the live policy.  The shadows thus see the references to the
+// sampled pages less the ones repeated within the last so many.  As many are
+// left with access as a shadow has frames, since a page referenced again that
+// soon would mostly still be in them, plus a few for every thread faulting
+// at the same time; so a working set that fits in the frames stops trapping,
+// and the sample stays sparse however few the frames, so that the traps stay
+// a fraction of the references when it does not.
+// After each window of sampled references the live policy switches to the
+// candidate with the lowest shadow miss rate, if it beats the live one by
+// enough to be worth reshuffling the frames.  The rates weigh each window
+// equally with all the ones before it, so one odd window does not switch.
+#define ADAPTIVE_WINDOW 32          // Sampled references between decisions, at least
+#define ADAPTIVE_MARGIN 0.05        // Relative improvement needed to switch
+#define ADAPTIVE_SHADOW_FRAMES 32   // Sampling stops at shadows this small
+#define ADAPTIVE_MIN_SAMPLE 4       // Sample at most one page in this many
+#define ADAPTIVE_MAX_SAMPLE 16      // and at least one in this many
+#define ADAPTIVE_TRACKED 4          // More sampled pages left with access for each thread
+
+int adaptive = 0;
+struct shadow *shadows[SHADOW_POLICIES];
+int shadow_sample = 1;   // One page in this many is simulated
+int shadow_refs = 0;     // Sampled references since the last decision
+long long shadow_accesses[SHADOW_POLICIES]; // Totals over the whole run
+long long shadow_misses[SHADOW_POLICIES];
+double shadow_rates[SHADOW_POLICIES];       // Decaying miss rates, -1 before any window
+int policy_switches = 0;
+int switching = 0;       // Set while a switch waits for other faults
+
+// The sampled pages referenced last, which are the only ones left with access
+struct tracked_page {
+    struct address_space *space;
+    int page;
+} *tracked = NULL;
+int ntracked = 0;
+int tracked_next = 0;
+
+// Shadow policy of each live policy, and back
+const int shadow_of[] = { [RAND] = SHADOW_RAND, [FIFO] = SHADOW_FIFO,
+                          [TWO_FIFO] = SHADOW_2FIFO, [CUSTOM] = SHADOW_CUSTOM,
+                          [GREEDY] = SHADOW_GREEDY };
+const enum policy_e policy_of[] = { [SHADOW_RAND] = RAND, [SHADOW_FIFO] = FIFO,
+                                    [SHADOW_2FIFO] = TWO_FIFO, [SHADOW_CUSTOM] = CUSTOM,
+                                    [SHADOW_GREEDY] = GREEDY };
+
+void adaptive_init();
+void adaptive_destroy();
+int adaptive_sampled(int page);
+int adaptive_trap(struct page_table *pt, int page);
+int untrap(struct page_table *pt, int page);
+void adaptive_access(int page, int write);
+void adaptive_decide();
+void switch_policy(enum policy_e to);
 
 /**
  * Generic page fault handler.
  */
 void page_fault_handler( struct page_table *pt, int page ) {
+    long long start = stats_export != NULL ? now_ns() : 0;
+    int frame, bits;
+
+    register_thread();
+    pthread_mutex_lock(&pager_lock);
+    fault_space = space_of(pt);
+    if (adaptive && adaptive_trap(pt, page)) {
+        if (stats_export != NULL) export_stats(start);
+        pthread_mutex_unlock(&pager_lock);
+        return;
+    }
+    if (nspeculative > 0 && claim_speculative(pt, page, 1)) {
+        if (stats_export != NULL) export_stats(start);
+        pthread_mutex_unlock(&pager_lock);
+        return;
+    }
     ++stats.page_faults;
-        // Delegate to appropriate page handler for active policy
-        switch (fault_policy) {
-            case RAND:      page_fault_handler_rand(pt, page);   break;
-            case FIFO:      page_fault_handler_fifo(pt, page);   break;
-            case TWO_FIFO:  page_fault_handler_2fifo(pt, page);  break;
-            case CUSTOM:    page_fault_handler_custom(pt, page); break;
-            default:
-            {
-                printf("unhandled page fault on page #%d\n",page);
-                exit(1);
-            }
+    account_fault(page);
+    page_table_get_entry(pt, page, &frame, &bits);
+    if (fault_space->heat) {
+        heat_fault(fault_space->heat, page, bits & PROT_READ);
+        heat_tick();
+    }
+    // Pages taken back off the 2FIFO second-chance list were never gone
+    int missing = !bits && !(SPACE(frame) == fault_space && PAGE(frame) == page &&
+                             frame_table[frame].f_list == 2);
+    if (missing && evict_log != NULL) read_cluster(pt, page);
+    filtering = 1;
+    map_page(pt, page);
+    filtering = 0;
+    if (staged != NULL) unstage();
+    if (missing && (ADVICE(fault_space, page) & ADVICE_PATTERN) == PAGE_ADVICE_SEQUENTIAL) {
+        read_ahead(pt, page);
+    }
+    if (stats_export != NULL) export_stats(start);
+    pthread_mutex_unlock(&pager_lock);
+}
+
+/**
+ * First fault (or hint) in this thread: arrange for its stats to be merged at exit.
+ */
+void register_thread() {
+    if (thread_id < 0) {
+        thread_id = __sync_fetch_and_add(&nthreads_seen, 1);
+        pthread_setspecific(stats_key, &stats);
+    }
+}
+
+/**
+ * Pages per fault-around group.  A group never takes more than half of a
+ * space's share of frames, or it would evict the very page that faulted.
+ */
+int fault_around_group() {
+    int group = args.fault_around;
+    while (group > 1 && group > args.nframes / nspaces / 2) group /= 2;
+    return group;
+}
+
+/**
+ * Fault-around handler, called for the neighbours of a faulting page.  Only
+ * maps pages that need no disk read: ones still resident in a frame (on the
+ * 2FIFO second-chance list, waiting for their image since a restart, or read
+ * back with a cluster) and ones never written out, which are all zeros.
+ */
+void page_fault_around_handler( struct page_table *pt, int page ) {
+    long long start = stats_export != NULL ? now_ns() : 0;
+    struct address_space *space = space_of(pt);
+    int frame, bits;
+
+    pthread_mutex_lock(&pager_lock);
+    fault_space = space;
+    if (adaptive && untrap(pt, page)) {
+        if (stats_export != NULL) export_stats(start);
+        pthread_mutex_unlock(&pager_lock);
+        return;
+    }
+    page_table_get_entry(pt, page, &frame, &bits);
+    int resident = SPACE(frame) == space && PAGE(frame) == page &&
+                   (frame_table[frame].f_list == 2 || frame_table[frame].pending ||
+                    frame_table[frame].speculative);
+    int random = (ADVICE(space, page) & ADVICE_PATTERN) == PAGE_ADVICE_RANDOM;
+    if (!bits && !random && owns(space, page) && (resident || !space->swapped[page])) {
+        ++stats.fault_arounds;
+        map_page(pt, page);
+    }
+    if (stats_export != NULL) export_stats(start);
+    pthread_mutex_unlock(&pager_lock);
+}
+
+/**
+ * Bring a page in (or grant it write access) through the active policy,
+ * picking the address space that gives up a frame first.
+ * Must be called with the pager lock held and fault_space set.
+ */
+void map_page( struct page_table *pt, int page ) {
+    victim_space = choose_victim_space();
+    if (args.batch) page_table_begin_updates();
+    handle_fault(pt, page);
+    if (args.batch) page_table_end_updates();
+}
+
+/**
+ * Delegate to appropriate page handler for active policy.
+ * Must be called with the pager lock held.
+ */
+void handle_fault( struct page_table *pt, int page ) {
+    if (fault_space->backing != NULL && shared_fault(pt, page)) return;
+    if (npending > 0 && restore_fault(pt, page)) return;
+    if (nspeculative > 0 && claim_speculative(pt, page, 0)) return;
+    if (admission != NULL && admission_fault(pt, page)) return;
+    switch (fault_policy) {
+        case RAND:      page_fault_handler_rand(pt, page);   break;
+        case FIFO:      page_fault_handler_fifo(pt, page);   break;
+        case TWO_FIFO:  page_fault_handler_2fifo(pt, page);  break;
+        case CUSTOM:    page_fault_handler_custom(pt, page); break;
+        case GREEDY:    page_fault_handler_greedy(pt, page); break;
+        default:
+        {
+            printf("unhandled page fault on page #%d\n",page);
+            exit(1);
         }
+    }
 }
 
 
@@ -145,44 +749,195 @@ void page_fault_handler( struct page_table *pt, int page ) {
  * Main function.  Performs basic setup and parses arguments.
  */
 int main( int argc, char *argv[] ) {
-	if(argc!=5) {
-		printf("use: virtmem <npages> <nframes> <rand|fifo|2fifo|custom> <sort|scan|focus>\n");
+    memset(&args, 0, sizeof(struct args));
+    args.stripe = 1;
+    args.demote_ms = 1000;
+    args.page_size = PAGE_SIZE;
+    args.fault_around = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:w:M:f:a:t:S:A:m:p:g:biB:s:H:D:Fc:r:C")) != -1) {
+        switch (opt) {
+            case 'd':
+                if (!parse_disks(optarg)) {
+                    printf("invalid argument: at most %d disk files may be given\n", MAX_DISKS);
+                    return 1;
+                }
+                break;
+            case 'w': args.stripe = atoi(optarg); break;
+            case 'M': args.memserver = optarg; break;
+            case 'f':
+                if (!parse_fast_disk(optarg)) {
+                    printf("invalid argument: fast tier must be given as file:nblocks\n");
+                    return 1;
+                }
+                break;
+            case 'a': args.demote_ms = atoi(optarg); break;
+            case 't': args.nthreads = atoi(optarg); break;
+            case 'S':
+                     if (!strcmp(optarg, "global")) replacement_scope = GLOBAL;
+                else if (!strcmp(optarg, "local"))  replacement_scope = LOCAL;
+                else { usage(); return 1; }
+                break;
+            case 'A':
+                     if (!strcmp(optarg, "equal")) alloc_policy = ALLOC_EQUAL;
+                else if (!strcmp(optarg, "wss"))   alloc_policy = ALLOC_WSS;
+                else if (!strcmp(optarg, "pff"))   alloc_policy = ALLOC_PFF;
+                else { usage(); return 1; }
+                break;
+            case 'm':
+                     if (!strcmp(optarg, "signal"))  args.access = ACCESS_SIGNAL;
+                else if (!strcmp(optarg, "soft"))    args.access = ACCESS_SOFT;
+                else if (!strcmp(optarg, "compare")) args.access = ACCESS_COMPARE;
+                else { usage(); return 1; }
+                break;
+            case 'p': args.page_size = parse_size(optarg); break;
+            case 'g': args.fault_around = atoi(optarg); break;
+            case 'b': args.batch = 1; break;
+            case 'i': args.hints = 1; break;
+            case 'F': args.filter = 1; break;
+            case 'B':
+                if (!parse_schedule(optarg)) {
+                    printf("invalid argument: schedule must be up to %d ms:nframes steps in time order\n", MAX_RESIZES);
+                    return 1;
+                }
+                break;
+            case 's': args.stats_name = optarg; break;
+            case 'H': args.heat_interval = atoi(optarg); break;
+            case 'D':
+                if (!disk_model_parse(optarg, &args.profile)) {
+                    printf("invalid argument: device must be hdd, ssd or nvme, optionally followed by\n");
+                    printf("  :read=us, :write=us, :seq=us, :bw=MB/s or :qd=n settings\n");
+                    return 1;
+                }
+                args.device = optarg;
+                break;
+            case 'c': args.checkpoint = optarg; break;
+            case 'r': args.restart = optarg; break;
+            case 'C': args.cluster = 1; break;
+            default:  usage(); return 1;
+        }
+    }
+
+	if(argc-optind!=4) {
+		usage();
 		return 1;
 	}
 
-    memset(&args, 0, sizeof(struct args));
-    args.npages  = atoi(argv[1]);
-    args.nframes = atoi(argv[2]);
-    args.policy  = argv[3];
-    args.program = argv[4];
+    args.npages  = atoi(argv[optind]);
+    args.nframes = atoi(argv[optind+1]);
+    args.policy  = argv[optind+2];
+    args.program = argv[optind+3];
+    args.programs = strdup(args.program);
+
+    if (args.memserver != NULL && args.ndisks > 0) {
+        printf("invalid argument: the disk is either in files or in a memory server, not both\n");
+        return 1;
+    }
+
+    if (args.ndisks == 0) {
+        args.disks[args.ndisks++] = "myvirtualdisk";
+    }
+
+    if (args.stripe < 1) {
+        printf("invalid argument: stripe width must be greater than 0\n");
+        return 1;
+    }
+
+    if (args.nthreads < 0) {
+        printf("invalid argument: number of threads must be greater than 0\n");
+        return 1;
+    }
+
+    if (args.nthreads > 0 && args.access != ACCESS_SIGNAL) {
+        printf("invalid argument: software access only runs the serial programs\n");
+        return 1;
+    }
+
+    if (args.page_size < PAGE_SIZE || args.page_size % PAGE_SIZE != 0) {
+        printf("invalid argument: page size must be a multiple of %d\n", PAGE_SIZE);
+        return 1;
+    }
+
+    if (nresizes > 0 && args.access == ACCESS_COMPARE) {
+        printf("invalid argument: a resize schedule cannot be combined with comparing access methods\n");
+        return 1;
+    }
+
+    if (args.heat_interval < 0 || (args.heat_interval > 0 && args.access == ACCESS_COMPARE)) {
+        printf("invalid argument: heat is tracked every so many faults of a single run\n");
+        return 1;
+    }
+
+    if (args.fault_around < 1) {
+        printf("invalid argument: fault-around group must be at least 1 page\n");
+        return 1;
+    }
 
     if (args.npages < 1 || args.nframes < 1) {
         printf("invalid argument: number of pages and frames must be greater than 0\n");
         return 1;
     }
-    
-    if (args.nframes < 5) {
-        FIRST_L = args.nframes - 1;
-        SECOND_L = 1;
+
+    if (!parse_programs(args.programs)) {
+        printf("invalid argument: between 1 and %d programs may be given, clones as program@k\n", MAX_SPACES);
+        return 1;
     }
-    else {
-        FIRST_L = args.nframes * 3/4;
-        SECOND_L = args.nframes * 1/4;
-        if (args.nframes % 4 != 0) {
-            FIRST_L++;
+
+    if (nspaces > args.nframes) {
+        printf("invalid argument: need at least one frame per program\n");
+        return 1;
+    }
+
+    if (args.filter && (nspaces == args.nframes || nresizes > 0)) {
+        printf("invalid argument: the admission filter needs a frame more than the programs, and a fixed number\n");
+        return 1;
+    }
+
+    for (int s = 0; s < nspaces; ++s) {
+        if (!known_program(spaces[s].program)) {
+            printf("invalid argument: unknown program or workload setting in %s\n", spaces[s].program);
+            return 1;
+        }
+        if (spaces[s].clone_of >= s) {
+            printf("invalid argument: %s can only run in a clone of an earlier program\n", spaces[s].program);
+            return 1;
         }
     }
+    
+    split_lists(args.nframes);
 
     // Set page fault handling policy
          if (!strcmp(args.policy,"rand"))   fault_policy = RAND;
     else if (!strcmp(args.policy,"fifo"))   fault_policy = FIFO;
     else if (!strcmp(args.policy,"2fifo"))  fault_policy = TWO_FIFO;
     else if (!strcmp(args.policy,"custom")) fault_policy = CUSTOM;
+    else if (!strcmp(args.policy,"greedy")) fault_policy = GREEDY;
+    else if (!strcmp(args.policy,"adaptive")) {
+        // Starts out with our own policy until the shadows know better
+        fault_policy = CUSTOM;
+        adaptive = 1;
+    }
     else {
-		printf("use: virtmem <npages> <nframes> <rand|fifo|2fifo|custom> <sort|scan|focus>\n");
+		usage();
 		return 1;
     }
 
+    if (nclones > 0 && (adaptive || args.filter || args.hints || nresizes > 0 || args.heat_interval > 0 ||
+                        replacement_scope == LOCAL || args.access == ACCESS_COMPARE)) {
+        printf("invalid argument: clones cannot be combined with the adaptive policy, -F, -i, -B, -H,\n");
+        printf("  local replacement or comparing access methods\n");
+        return 1;
+    }
+
+    if ((args.checkpoint != NULL || args.restart != NULL) && (nclones > 0 || adaptive || args.filter ||
+                                                              args.hints || nresizes > 0 || args.fast_disk != NULL ||
+                                                              args.memserver != NULL || args.access == ACCESS_COMPARE)) {
+        printf("invalid argument: checkpoints cannot be combined with clones, the adaptive policy, -F, -i, -B,\n");
+        printf("  a fast tier, a memory server or comparing access methods\n");
+        return 1;
+    }
+
     // Setup frame table and statistics
     frame_table = malloc(args.nframes * sizeof(f_node));
     if (frame_table == NULL) {
@@ -190,46 +945,466 @@ int main( int argc, char *argv[] ) {
         exit(1);
     }
     memset(frame_table, 0, args.nframes * sizeof(f_node));
+    frame_hooks.hot = page_is_hot;
+    frame_hooks.pinned = page_is_pinned;
+    frame_hooks.demoted = demote_frame;
+    frame_hooks.evicted = drop_frame;
     memset(&stats, 0, sizeof(struct stats));
+    memset(&total_stats, 0, sizeof(struct stats));
+    pthread_key_create(&stats_key, (void (*)(void *)) merge_stats);
+    frame_pool_init(args.nframes);
+    if (adaptive) adaptive_init();
+    if (args.filter) admission_init();
+    if (args.cluster) cluster_init();
+    if (fault_policy == GREEDY || adaptive) {
+        greedy_heap = malloc(args.nframes * sizeof(int));
+        if (greedy_heap == NULL) {
+            printf("Warning: could not allocate space for GreedyDual heap!\n");
+            exit(1);
+        }
+    }
+
+    if (args.stats_name != NULL) {
+        stats_export = stats_shm_create(args.stats_name);
+        if (stats_export == NULL) {
+            fprintf(stderr, "couldn't create statistics segment %s: %s\n", args.stats_name, strerror(errno));
+            return 1;
+        }
+        stats_shm_begin(stats_export);
+        stats_export->npages = args.npages;
+        stats_export->nspaces = nspaces;
+        stats_shm_end(stats_export);
+    }
 
-    // Initialize disk
-	disk = disk_open("myvirtualdisk",args.npages);
+    // The checkpoint has to be checked against the disk before opening it touches the files
+    if (args.restart != NULL && !open_checkpoint(args.restart)) return 1;
+
+    // Initialize disk, in a memory server or striped if more than one backing file was given
+	if(args.memserver) disk = disk_open_remote(args.memserver,args.page_size,args.npages*(nspaces+nclones));
+	else disk = disk_open_striped(args.disks,args.ndisks,args.stripe,args.page_size,args.npages*(nspaces+nclones));
+	if(disk && args.device) {
+		disk_model = disk_model_create(&args.profile,disk_ndevices(disk));
+		if(disk_model) disk_set_model(disk,disk_model);
+		else {
+			disk_close(disk);
+			disk = NULL;
+		}
+	}
+	if(disk && args.fast_disk) {
+		struct disk *fast = disk_open_striped(&args.fast_disk,1,1,args.page_size,args.fast_blocks);
+		struct disk *tiered = fast ? disk_open_tiered(fast,disk,args.demote_ms) : NULL;
+		if(!tiered) {
+			if(fast) disk_close(fast);
+			disk_close(disk);
+		}
+		disk = tiered;
+	}
 	if(!disk) {
 		fprintf(stderr,"couldn't create virtual disk: %s\n",strerror(errno));
 		return 1;
 	}
 
-    // Initialize page table
-	struct page_table *pt = page_table_create( args.npages, args.nframes, page_fault_handler );
+    // Initialize page tables, every address space after the first sharing its frames
+	struct page_table *pt = page_table_create_sized( args.npages, args.nframes, args.page_size, page_fault_handler );
 	if(!pt) {
 		fprintf(stderr,"couldn't create page table: %s\n",strerror(errno));
 		return 1;
 	}
+    for (int i = 0; i < nspaces; ++i) {
+        spaces[i].pt = i == 0 ? pt : page_table_create_shared(pt, args.npages, page_fault_handler);
+        if (!spaces[i].pt) {
+            fprintf(stderr,"couldn't create page table: %s\n",strerror(errno));
+            return 1;
+        }
+        spaces[i].id = i;
+        spaces[i].base = nregions++ * args.npages;
+        // Working sets only matter when there is more than one space to share frames
+        spaces[i].touched = nspaces > 1 ? calloc(args.npages, 1) : NULL;
+
+        if (args.fault_around > 1) {
+            spaces[i].swapped = calloc(args.npages, 1);
+            page_table_set_fault_around(spaces[i].pt, fault_around_group(), page_fault_around_handler);
+        }
+
+        if (args.hints) {
+            spaces[i].advice = calloc(args.npages, 1);
+            page_table_set_advice_handler(spaces[i].pt, page_advice_handler);
+        }
+
+        if (args.heat_interval > 0) {
+            spaces[i].heat = heat_create(args.npages, args.heat_interval);
+            if (!spaces[i].heat) {
+                printf("Warning: could not allocate space for page heat!\n");
+                exit(1);
+            }
+        }
+    }
+    rebalance_quotas();
 
 	virtmem = page_table_get_virtmem(pt);
 	physmem = page_table_get_physmem(pt);
+    if (restart_file != NULL && !restore_checkpoint()) return 1;
 	
 	// Initial value for how many entries we allow to be unmodified before evicting one when we search.
 	// Used in the custom algorithm.
 	chance = args.nframes/3;
 
-    // Run a program
-	     if(!strcmp(args.program,"sort"))  sort_program(virtmem,args.npages*PAGE_SIZE);
-	else if(!strcmp(args.program,"scan"))  scan_program(virtmem,args.npages*PAGE_SIZE);
-	else if(!strcmp(args.program,"focus")) focus_program(virtmem,args.npages*PAGE_SIZE);
-	else {
-		fprintf(stderr,"unknown program: %s\n", args.program);
-	}
+    // Run the programs, timing signal against software access if asked to
+    if (args.access == ACCESS_COMPARE) {
+        double signal_time = run_spaces(0);
+        merge_stats();
+        struct stats signal_stats = total_stats;
+        reset_pager();
+
+        double soft_time = run_spaces(1);
+        merge_stats();
+
+        long long hits, misses;
+        page_table_get_tlb_stats(&hits, &misses);
+        printf("\n%-8s %10s %8s %8s %8s %8s\n", "access", "time (s)", "flt", "rd", "wr", "ev");
+        printf("%-8s %10.3f %8d %8d %8d %8d\n", "signal", signal_time, signal_stats.page_faults,
+            signal_stats.disk_reads, signal_stats.disk_writes, signal_stats.evictions);
+        printf("%-8s %10.3f %8d %8d %8d %8d\n", "soft", soft_time, total_stats.page_faults,
+            total_stats.disk_reads, total_stats.disk_writes, total_stats.evictions);
+        printf("tlb: hits(%lld) misses(%lld) hit rate %.2f%%\n", hits, misses,
+            hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0);
+    } else {
+        double elapsed = run_spaces(args.access == ACCESS_SOFT);
+
+        if (args.nthreads > 0 || nspaces > 1 || args.access == ACCESS_SOFT ||
+            args.page_size != PAGE_SIZE || args.fault_around > 1 || args.batch || args.hints ||
+            nresizes > 0 || adaptive || fault_policy == GREEDY || admission != NULL ||
+            args.restart != NULL || args.cluster) {
+            merge_stats();
+            printf("%d threads: %.3f s\n", (args.nthreads > 0 ? args.nthreads : 1) * nspaces, elapsed);
+            print_stats();
+        }
+        if (nresizes > 0) print_balloon();
+        if (args.access == ACCESS_SOFT) {
+            long long hits, misses;
+            page_table_get_tlb_stats(&hits, &misses);
+            printf("tlb: hits(%lld) misses(%lld)\n", hits, misses);
+        }
+    }
+    if (nspaces > 1) print_spaces();
+    if (args.heat_interval > 0) print_heat();
+
+    disk_print_stats(disk);
+    if (disk_model != NULL) disk_model_print(disk_model);
+    if (args.checkpoint != NULL && !save_checkpoint(args.checkpoint)) return 1;
+    if (stats_export != NULL) export_finish();
 
     // Cleanup
+    frame_pool_destroy();
     free(frame_table);
-	page_table_delete(pt);
+    if (adaptive) adaptive_destroy();
+    free(greedy_heap);
+    if (admission != NULL) admission_destroy();
+    if (args.cluster) cluster_destroy();
+    for (int i = nspaces - 1; i >= 0; --i) {
+        page_table_delete(spaces[i].pt);
+        free(spaces[i].touched);
+        free(spaces[i].swapped);
+        free(spaces[i].advice);
+        if (spaces[i].heat) heat_delete(spaces[i].heat);
+        free(spaces[i].own);
+    }
+    for (int i = nsnapshots - 1; i >= 0; --i) {
+        page_table_delete(snapshots[i].pt);
+        free(snapshots[i].swapped);
+        free(snapshots[i].own);
+    }
+    free(args.programs);
+    if (restart_file != NULL) fclose(restart_file);
 	disk_close(disk);
+    if (disk_model != NULL) disk_model_delete(disk_model);
+    if (stats_export != NULL) stats_shm_close(stats_export, args.stats_name);
 
 	return 0;
 }
 
 
+/**
+ * Prints the command line usage.
+ */
+void usage() {
+    printf("use: virtmem [options] <npages> <nframes> <rand|fifo|2fifo|custom|greedy|adaptive> <program>[,...]\n");
+    printf("  several comma separated programs each run in their own address space, and\n");
+    printf("  program@k in a copy-on-write clone of space k taken once its program is done\n");
+    printf("  a program is sort, scan, focus or a synthetic workload\n");
+    printf("    <uniform|zipf|hotcold|loop|stride|phase>[:setting=value...] with settings\n");
+    printf("    seed, refs (default 10 per page), wss (working set pages, default all),\n");
+    printf("    write (share of writes, default 0.25), theta (zipf skew, default 0.99),\n");
+    printf("    hot, hotprob (hot share of pages and references, default 0.2 and 0.8),\n");
+    printf("    stride (default 16) and phases (default 4), e.g. zipf:theta=1.2:wss=512\n");
+    printf("  -d file1,file2,...  stripe the virtual disk over these files (default myvirtualdisk)\n");
+    printf("  -w stripe           consecutive blocks per disk file (default 1)\n");
+    printf("  -M socket           keep the disk in the memory of virtmem-memserver listening on socket\n");
+    printf("  -f file:nblocks     put a fast swap tier of nblocks in front of the disk\n");
+    printf("  -a ms               demote fast tier blocks idle for this long (default 1000)\n");
+    printf("  -t nthreads         run the parallel version of the program and time it\n");
+    printf("  -S global|local     replacement scope between address spaces (default global)\n");
+    printf("  -A equal|wss|pff    frame allocation between address spaces under local scope (default pff)\n");
+    printf("  -m signal|soft|compare  access memory directly, through the software TLB, or time both\n");
+    printf("  -p size             page and disk block size, e.g. 16k, 64k or 2m (default 4k)\n");
+    printf("  -g npages           on a fault also map the neighbouring pages that need no disk read,\n");
+    printf("                      in aligned groups of npages\n");
+    printf("  -b                  batch the page table updates of each fault into fewer system calls\n");
+    printf("  -i                  act on the access hints the programs give\n");
+    printf("  -B ms:nframes,...   resize the frame pool on this schedule and report the fault\n");
+    printf("                      rate of each step\n");
+    printf("  -s name             publish live statistics in shared memory segment name\n");
+    printf("                      for virtmem-top\n");
+    printf("  -H faults           track the heat of every page and report it, with a heatmap\n");
+    printf("                      row every this many faults\n");
+    printf("  -F                  only let a page displace the policy's victim if it was referenced\n");
+    printf("                      more often lately (TinyLFU), serving it from probation otherwise\n");
+    printf("  -D hdd|ssd|nvme     charge every disk request the time such a device would take,\n");
+    printf("                      tuned with :read=us, :write=us, :seq=us, :bw=MB/s or :qd=n\n");
+    printf("  -c file             save the state of the pager in file when the programs are done\n");
+    printf("  -r file             start from the state saved in file, bringing each page back into\n");
+    printf("                      its frame on first access\n");
+    printf("  -C                  on a refault also read back the pages evicted along with it, in one\n");
+    printf("                      I/O, for as long as that keeps predicting refaults\n");
+}
+
+/**
+ * Splits a comma separated list of disk files into args.disks.
+ * Returns 0 if there are too many files.
+ */
+int parse_disks(char *list) {
+    char *name;
+    for (name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        if (args.ndisks == MAX_DISKS) return 0;
+        args.disks[args.ndisks++] = name;
+    }
+    return 1;
+}
+
+
+/**
+ * Parses a fast tier given as file:nblocks into args.
+ * Returns 0 if it is malformed.
+ */
+int parse_fast_disk(char *spec) {
+    char *colon = strrchr(spec, ':');
+    if (colon == NULL) return 0;
+    *colon = '\0';
+    args.fast_disk = spec;
+    args.fast_blocks = atoi(colon + 1);
+    return args.fast_blocks > 0;
+}
+
+
+/**
+ * Splits a comma separated list of programs into one address space each,
+ * noting the space a program given as program@k runs in a clone of.
+ * Returns 0 if there are none or too many, or a clone is malformed.
+ */
+int parse_programs(char *list) {
+    char *name;
+    for (name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        if (nspaces == MAX_SPACES) return 0;
+        char *at = strrchr(name, '@');
+        spaces[nspaces].clone_of = -1;
+        if (at != NULL) {
+            char *end;
+            *at = '\0';
+            spaces[nspaces].clone_of = (int) strtol(at + 1, &end, 10);
+            if (at[1] == '\0' || *end != '\0' || spaces[nspaces].clone_of < 0) return 0;
+            ++nclones;
+        }
+        spaces[nspaces++].program = name;
+    }
+    return nspaces > 0;
+}
+
+/**
+ * Whether a program is one of the built in ones or a well formed workload.
+ */
+int known_program(const char *program) {
+    struct workload_spec spec;
+    if (!strcmp(program, "sort") || !strcmp(program, "scan") || !strcmp(program, "focus")) return 1;
+    return workload_parse(program, &spec);
+}
+
+/**
+ * Parses a resize schedule given as ms:nframes steps in time order.
+ * Returns 0 if it is malformed.
+ */
+int parse_schedule(char *list) {
+    char *step;
+    for (step = strtok(list, ","); step != NULL; step = strtok(NULL, ",")) {
+        struct resize_step *next = &schedule[nresizes + 1];
+        if (nresizes == MAX_RESIZES) return 0;
+        if (sscanf(step, "%d:%d", &next->at_ms, &next->nframes) != 2) return 0;
+        if (next->at_ms < 0 || next->nframes < 1) return 0;
+        if (nresizes > 0 && next->at_ms < schedule[nresizes].at_ms) return 0;
+        ++nresizes;
+    }
+    return nresizes > 0;
+}
+
+/**
+ * Parses a size in bytes with an optional k or m suffix.
+ * Returns 0 if it is malformed.
+ */
+int parse_size(const char *arg) {
+    char *end;
+    long size = strtol(arg, &end, 10);
+    if (*end == 'k' || *end == 'K') { size *= 1024; ++end; }
+    else if (*end == 'm' || *end == 'M') { size *= 1024 * 1024; ++end; }
+    return *end == '\0' && size > 0 && size <= (1 << 30) ? (int) size : 0;
+}
+
+/**
+ * Runs a program by name over the virtual memory of a page table, through the
+ * software access path if soft_access is set, or its parallel version when a
+ * thread count is given.
+ */
+void run_program(const char *program, struct page_table *pt) {
+    char *data = page_table_get_virtmem(pt);
+    size_t length = (size_t)page_table_get_npages(pt)*page_table_get_page_size(pt);
+
+    if (soft_access) {
+	         if(!strcmp(program,"sort"))  soft_sort_program(pt,length);
+	    else if(!strcmp(program,"scan"))  soft_scan_program(pt,length);
+	    else if(!strcmp(program,"focus")) soft_focus_program(pt,length);
+	    else soft_workload_program(program,pt,length);
+    } else if (args.nthreads > 0) {
+	         if(!strcmp(program,"sort"))  parallel_sort_program(data,length,args.nthreads);
+	    else if(!strcmp(program,"scan"))  parallel_scan_program(data,length,args.nthreads);
+	    else if(!strcmp(program,"focus")) parallel_focus_program(data,length,args.nthreads);
+	    else parallel_workload_program(program,data,length,page_table_get_page_size(pt),args.nthreads);
+    } else {
+	         if(!strcmp(program,"sort"))  sort_program(data,length);
+	    else if(!strcmp(program,"scan"))  scan_program(data,length);
+	    else if(!strcmp(program,"focus")) focus_program(data,length);
+	    else workload_program(program,data,length,page_table_get_page_size(pt));
+    }
+}
+
+/**
+ * Thread body running the program of one address space.
+ */
+void * run_space(void *arg) {
+    struct address_space *space = arg;
+    run_program(space->program, space->pt);
+    return NULL;
+}
+
+/**
+ * Runs the program of every address space, each in its own thread if there
+ * is more than one.  Returns the elapsed time in seconds.
+ */
+double run_spaces(int soft) {
+    struct timespec start, end;
+
+    pthread_t balloon;
+
+    soft_access = soft;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (nresizes > 0) {
+        balloon_start = start;
+        balloon_stop = 0;
+        take_step(0);
+        pthread_create(&balloon, NULL, balloon_driver, NULL);
+    }
+    if (nspaces == 1) {
+        run_program(spaces[0].program, spaces[0].pt);
+    } else {
+        // In waves: a clone starts once the program of the space it clones is done
+        pthread_t threads[MAX_SPACES];
+        int state[MAX_SPACES] = { 0 }; // 0 waiting, 1 running, 2 done
+        for (int left = nspaces; left > 0; ) {
+            for (int i = 0; i < nspaces; ++i) {
+                if (state[i] != 0 || (spaces[i].clone_of >= 0 && state[spaces[i].clone_of] != 2)) continue;
+                if (spaces[i].clone_of >= 0) clone_space(&spaces[i]);
+                pthread_create(&threads[i], NULL, run_space, &spaces[i]);
+                state[i] = 1;
+            }
+            for (int i = 0; i < nspaces && nclones > 0; ++i) {
+                int cloned = 0;
+                for (int j = i + 1; j < nspaces; ++j) cloned |= state[j] == 0 && spaces[j].clone_of == i;
+                if (state[i] == 2 && !cloned && !spaces[i].exited) exit_space(&spaces[i]);
+            }
+            for (int i = 0; i < nspaces; ++i) {
+                if (state[i] != 1) continue;
+                pthread_join(threads[i], NULL);
+                state[i] = 2;
+                --left;
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // Steps not reached by the time the programs end are never taken
+    if (nresizes > 0) {
+        pthread_mutex_lock(&balloon_lock);
+        balloon_stop = 1;
+        pthread_cond_signal(&balloon_cond);
+        pthread_mutex_unlock(&balloon_lock);
+        pthread_join(balloon, NULL);
+
+        pthread_mutex_lock(&pager_lock);
+        balloon_ended = balloon_clock();
+        balloon_faults = total_faults();
+        pthread_mutex_unlock(&pager_lock);
+    }
+
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/**
+ * Unmaps every page and returns all frames to the free pool, without writing
+ * anything back, so that the programs can be run again from a clean slate.
+ * Nothing may be faulting at the time.
+ */
+void reset_pager() {
+    page_table_begin_updates();
+    for (int i = 0; i < args.nframes; ++i) {
+        int frame, bits;
+        if (SPACE(i) == NULL) continue;
+        page_table_get_entry(SPACE(i)->pt, PAGE(i), &frame, &bits);
+        if (frame == i) page_table_set_entry(SPACE(i)->pt, PAGE(i), 0, PROT_NONE);
+    }
+    page_table_end_updates();
+
+    memset(frame_table, 0, args.nframes * sizeof(f_node));
+    fifo_head = fifo_tail = NULL;
+    ff_head = ff_tail = sf_head = sf_tail = NULL;
+    f_entries = s_entries = 0;
+    greedy_size = 0;
+    greedy_inflation = 0;
+    frame_pool_destroy();
+    frame_pool_init(args.nframes);
+    if (adaptive) {
+        adaptive_destroy();
+        adaptive_init();
+    }
+    if (admission != NULL) {
+        admission_destroy();
+        admission_init();
+        admitted = rejected = 0;
+    }
+    if (args.cluster) {
+        cluster_destroy();
+        cluster_init();
+    }
+
+    for (int i = 0; i < nspaces; ++i) {
+        spaces[i].resident = 0;
+        spaces[i].total_faults = 0;
+    }
+    rebalance_quotas();
+
+    if (stats_export != NULL) export_counters();
+    memset(&stats, 0, sizeof(struct stats));
+    memset(&published, 0, sizeof(struct stats));
+    memset(&total_stats, 0, sizeof(struct stats));
+}
+
+
 /**
  * Random handler.
  */
@@ -244,12 +1419,11 @@ void page_fault_handler_rand( struct page_table *pt, int page ) {
         if ((frame_index = find_free_frame()) < 0) {
             // No free frames available, evict a random frame's page
             // and use that frame to load the new page
-            frame_index = (int) lrand48() % args.nframes;
-            evict(pt, frame_index);
+            frame_index = find_random_frame();
+            evict_for_read(frame_index);
         }
         // Read in from disk to physical memory
-        disk_read(disk, page, &physmem[frame_index * PAGE_SIZE]);
-        ++stats.disk_reads;
+        read_page(page, frame_index);
     } else if (bits & PROT_READ && !(bits & PROT_WRITE)) { // Missing write bit
         bits |= PROT_WRITE;
         frame_index = frame;
@@ -281,15 +1455,17 @@ void page_fault_handler_fifo( struct page_table *pt, int page ) {
         bits |= PROT_READ;
         if ((frame_index = find_free_frame()) < 0) {
             // Evict page from tail of queue, eg. fifo_head
-            if ((frame_index = fifo_remove()) < 0) {
-                printf("Warning: attempted to remove frame index from empty fifo!\n");
-                return;
+            while ((frame_index = fifo_remove()) < 0) {
+                // Frames being read in by other threads are off the list
+                if (!wait_for_frame()) {
+                    printf("Warning: attempted to remove frame index from empty fifo!\n");
+                    return;
+                }
             }
-            evict(pt, frame_index);
+            evict_for_read(frame_index);
         }
         // Read in from disk to physical memory
-        disk_read(disk, page, &physmem[frame_index * PAGE_SIZE]);
-        ++stats.disk_reads;
+        read_page(page, frame_index);
     } else if (bits & PROT_READ && !(bits & PROT_WRITE)) { // Missing write bit
         bits |= PROT_WRITE;
         frame_index = frame;
@@ -323,18 +1499,18 @@ void page_fault_handler_2fifo( struct page_table *pt, int page ) {
         bits |= PROT_READ;
         //Get the corresponding frame node
         f_node * tempNode = &frame_table[frame]; 
-        if ((page == PAGE(frame)) && tempNode->f_list == 2) { //Note: the page == PAGE(frame) check is to ensure it's paged in.
+        if ((page == PAGE(frame)) && SPACE(frame) == fault_space && tempNode->f_list == 2) { //Note: the page == PAGE(frame) check is to ensure it's paged in.
             //We have an entry in the second chance list, bump that back up
             sfo_remove(tempNode, &sf_head);
             
             // Decrement the number of second-chance entries, insert to the first-chance list, and update the releavnt fields.
             s_entries--;
-            sfo_insert(pt, tempNode);
+            sfo_insert(tempNode);
             tempNode->f_list = 1;
             frame_index = frame;
             bits = tempNode->bits;
         }
-        else if ((page == PAGE(frame)) && tempNode->f_list == 1) {
+        else if ((page == PAGE(frame)) && SPACE(frame) == fault_space && tempNode->f_list == 1) {
             printf("We have a read page fault, yet we're in the first 2FIFO list.  This should be impossible.\n");
             exit(1);
         }
@@ -344,28 +1520,37 @@ void page_fault_handler_2fifo( struct page_table *pt, int page ) {
             if (frame_index == -1) {
                 // We have no free frames.  We need to evict the oldest page.
                 // Evict from second-chance list if present (which it should be except in very low frame cases); otherwise evict from first list.
-                if (sf_head == NULL) {
-                    frame_index = sfo_remove(ff_head, &ff_head);
+                while ((tempNode = sfo_victim()) == NULL) {
+                    // Frames being read in by other threads are off the lists
+                    if (!wait_for_frame()) {
+                        printf("Warning: attempted to remove frame index from empty 2FIFO lists!\n");
+                        return;
+                    }
+                }
+                if (tempNode->f_list == 1) {
+                    frame_index = sfo_remove(tempNode, &ff_head);
                     f_entries--;
                 }
                 else {
-                    frame_index = sfo_remove(sf_head, &sf_head);
+                    frame_index = sfo_remove(tempNode, &sf_head);
                     s_entries--;
                 }
                 if (frame_index == -1) {
                     printf("2FIFO: could not get a frame by removing.  What?\n");
                     return;
                 }
-                evict(pt, frame_index);
+                // Off the lists while it is read into, or its old page would look resident
+                tempNode->f_list = 0;
+                evict_for_read(frame_index);
             }
+            // Read in from disk to physical memory.  The frame stays off the
+            // lists until then, so nobody picks it while the lock is dropped.
+            read_page(page, frame_index);
             // Fetch our evicted node and update its relevant fields.
             tempNode = &frame_table[frame_index];
             tempNode->page = page;
-            sfo_insert(pt, tempNode);
+            sfo_insert(tempNode);
             tempNode->f_list = 1;
-            // Read in from disk to physical memory
-            disk_read(disk, page, &physmem[frame_index * PAGE_SIZE]);
-            ++stats.disk_reads;
         }
     } else if (bits & PROT_READ && !(bits & PROT_WRITE)) { // Missing write bit
         bits |= PROT_WRITE;
@@ -402,18 +1587,20 @@ void page_fault_handler_custom( struct page_table *pt, int page ) {
         bits |= PROT_READ;
         if ((frame_index = find_free_frame()) < 0) {
             // Evict clean page (if there is one)
-            if ((frame_index = find_clean_frame()) < 0) {
+            while ((frame_index = find_clean_frame(args.nframes)) < 0) {
                 // No clean pages available, remove oldest one via FIFO list
-                if ((frame_index = fifo_remove()) < 0) {
+                if ((frame_index = fifo_remove()) >= 0) break;
+
+                // Frames being read in by other threads are off the list
+                if (!wait_for_frame()) {
                     printf("Warning: attempted to remove frame index from empty fifo!\n");
                     return;
                 }
             }
-            evict(pt, frame_index);
+            evict_for_read(frame_index);
         }
         // Read in from disk to physical memory
-        disk_read(disk, page, &physmem[frame_index * PAGE_SIZE]);
-        ++stats.disk_reads;
+        read_page(page, frame_index);
     } else if (bits & PROT_READ && !(bits & PROT_WRITE)) { // Missing write bit
         bits |= PROT_WRITE;
         frame_index = frame;
@@ -435,236 +1622,2377 @@ void page_fault_handler_custom( struct page_table *pt, int page ) {
 
 
 /**
- * Search for unused frame, return its index if found or -1 if none available
+ * GreedyDual handler.  Evicts the page whose credit is least, and gives a
+ * page credit again when it comes in or is first written, the only
+ * references it sees.
  */
-int find_free_frame() {
-    // Search frame table for a free (unused) frame, return its index if found
-    for (int i = 0; i < args.nframes; ++i) {
-        if (FREE(i) == 0) return i;
-    }
-    // No free frames were found, return error code
-    return -1;
-}
-
+void page_fault_handler_greedy( struct page_table *pt, int page ) {
+    int frame, bits;
+    page_table_get_entry(pt, page, &frame, &bits);
 
-/**
- * Searches for a non-dirty page that can be evicted without writing back to disk.
- * Which page we ultimately return depends on how many unmodified pages we have.
- */
-int find_clean_frame() {
-    // Search frame table for a clean frame, return its index if found
-    f_node * node = fifo_tail->next;
-    f_node * candidate = NULL;
-    chance = args.nframes * 5/6;
-    int i = 0;
-    while (node != NULL && i < chance) {
-        if (node->bits & (~PROT_WRITE)) {
-            i++;
-            candidate = node;
-        }
-        node = node->next;
-    }
-    if ( candidate != NULL ) {
-        node = candidate;
-            if (node == fifo_tail) {
-                fifo_tail = fifo_tail->next;
-                if (fifo_tail != NULL) {
-                    fifo_tail->prev = NULL;
-                }
-                else {
-                    fifo_head = fifo_tail;
+    // Update protection bits and find the frame index for page loading
+    int frame_index = -1;
+    if (!bits) { // Missing read bit
+        bits |= PROT_READ;
+        if ((frame_index = find_free_frame()) < 0) {
+            while ((frame_index = greedy_remove()) < 0) {
+                // Frames being read in by other threads are off the heap
+                if (!wait_for_frame()) {
+                    printf("Warning: attempted to remove frame index from empty heap!\n");
+                    return;
                 }
-                node->f_list = 0;
-                return FRAMEID(node);
             }
-            else {
-                if (node->next != NULL) {
-                    node->next->prev = node->prev;
-                }
-                    node->prev->next = node->next;
-                    node->f_list = 0;
-                    return FRAMEID(node);
+            evict_for_read(frame_index);
+        }
+        // Read in from disk to physical memory
+        read_page(page, frame_index);
+    } else if (bits & PROT_READ && !(bits & PROT_WRITE)) { // Missing write bit
+        bits |= PROT_WRITE;
+        frame_index = frame;
+    } else { // Shouldn't get here?
+        printf("Warning: entered page fault handler for page with all protection bits enabled\n");
+        return;
+    }
+
+    // Update the page table entry for this page
+    page_table_set_entry(pt, page, frame_index, bits);
+    PAGE(frame_index) = page;
+    BITS(frame_index) = bits;
+
+    // Mark the frame as used and give it credit for what it now costs to evict
+    FREE(frame_index) = 1;
+    greedy_insert(frame_index);
+
+}
+
+
+/**
+ * Take an unused frame from the free frame pool, return its index if found
+ * or -1 if none available.  The calling thread's own shard is tried first.
+ */
+int find_free_frame() {
+    // Under local replacement an address space at its quota reuses its own frames
+    if (victim_space != NULL && victim_space == fault_space) return -1;
+
+    int home = (thread_id < 0 ? 0 : thread_id) % FRAME_SHARDS;
+    for (int i = 0; i < FRAME_SHARDS; ++i) {
+        struct frame_shard *shard = &frame_shards[(home + i) % FRAME_SHARDS];
+        if (shard->nfree == 0) continue;
+
+        pthread_mutex_lock(&shard->lock);
+        int frame_index = shard->nfree > 0 ? shard->frames[--shard->nfree] : -1;
+        pthread_mutex_unlock(&shard->lock);
+        if (frame_index >= 0) return frame_index;
+    }
+    // No free frames were found, return error code
+    return -1;
+}
+
+/**
+ * Return a frame to the free frame pool.
+ */
+void release_frame(int frame_index) {
+    struct frame_shard *shard = &frame_shards[frame_shard_of(frame_index)];
+    pthread_mutex_lock(&shard->lock);
+    shard->frames[shard->nfree++] = frame_index;
+    pthread_mutex_unlock(&shard->lock);
+    FREE(frame_index) = 0;
+    frame_table[frame_index].trapped = 0;
+    if (frame_table[frame_index].pending) {
+        forget_image(frame_index);
+        ++restart_dropped;
+    }
+    if (frame_table[frame_index].speculative) unspeculate(frame_index);
+}
+
+/**
+ * Each shard owns a contiguous range of frames.
+ */
+int frame_shard_of(int frame_index) {
+    return (int) ((long long) frame_index * FRAME_SHARDS / args.nframes);
+}
+
+/**
+ * Deal every frame not in use out to the free frame shards.  Lower frame numbers
+ * end up on top of each stack, so a single thread is handed frames in ascending order.
+ */
+void frame_pool_init(int nframes) {
+    for (int i = 0; i < FRAME_SHARDS; ++i) {
+        pthread_mutex_init(&frame_shards[i].lock, NULL);
+        frame_shards[i].frames = malloc((nframes / FRAME_SHARDS + 1) * sizeof(int));
+        frame_shards[i].nfree = 0;
+    }
+    for (int i = nframes - 1; i >= 0; --i) {
+        if (FREE(i)) continue;
+        struct frame_shard *shard = &frame_shards[frame_shard_of(i)];
+        shard->frames[shard->nfree++] = i;
+    }
+}
+
+void frame_pool_destroy() {
+    for (int i = 0; i < FRAME_SHARDS; ++i) {
+        pthread_mutex_destroy(&frame_shards[i].lock);
+        free(frame_shards[i].frames);
+    }
+}
+
+/**
+ * Pick a random frame that is not in the middle of being read into.
+ * Waits for a read to finish if every frame is busy.
+ */
+int find_random_frame() {
+    #define SUITABLE(x) (!BUSY(x) && !page_is_pinned(&frame_table[x]) && !frame_table[x].probation && \
+                         (victim_space == NULL || SPACE(x) == victim_space))
+    for (;;) {
+        int frame_index = (int) lrand48() % args.nframes;
+        if (SUITABLE(frame_index) && !page_is_hot(&frame_table[frame_index])) {
+            return frame_index;
+        }
+
+        // Fall back to the first suitable idle frame before giving up and
+        // waiting, passing over pages hinted hot if there is anything else
+        for (frame_index = 0; frame_index < args.nframes; ++frame_index) {
+            if (SUITABLE(frame_index) && !page_is_hot(&frame_table[frame_index])) {
+                return frame_index;
             }
-         }
-    else {
-    // No clean pages were found, return error code
-        return -1;
+        }
+        for (frame_index = 0; frame_index < args.nframes; ++frame_index) {
+            if (SUITABLE(frame_index)) {
+                return frame_index;
+            }
+        }
+        if (victim_space != NULL) {
+            victim_space = NULL;
+            continue;
+        }
+        wait_for_frame();
+    }
+    #undef SUITABLE
+}
+
+/**
+ * Reads a page in from disk.  The pager lock is dropped during the read so
+ * faults on other pages can make progress; the frame is marked busy (and is
+ * in no list) so nobody else picks it in the meantime.
+ */
+void read_page(int page, int frame_index) {
+    struct address_space *space = fault_space;
+    int frame, bits;
+
+    // A page another thread is still writing out, with the lock dropped, is
+    // only read back once the write is done
+    BUSY(frame_index) = 1;
+    ++nbusy;
+    while (copy_from < 0) {
+        page_table_get_entry(space->pt, page, &frame, &bits);
+        if (!frame_table[frame].writing || SPACE(frame) != space || PAGE(frame) != page) break;
+        pthread_cond_wait(&frame_cond, &pager_lock);
+    }
+    fault_space = space;
+    if (space->heat) heat_page_in(space->heat, page, heat_now, heat_evictions);
+    SPACE(frame_index) = space;
+    ++space->resident;
+    // A page read back with its cluster only has to be copied in
+    if (staged != NULL && staged_page(space, page) != NULL) {
+        fill_page(space, page, frame_index);
+        BUSY(frame_index) = 0;
+        --nbusy;
+        pthread_cond_broadcast(&frame_cond);
+        return;
+    }
+    pthread_mutex_unlock(&pager_lock);
+    long long start = fault_policy == GREEDY || adaptive ? now_ns() : 0;
+    int read = fill_page(space, page, frame_index);
+    pthread_mutex_lock(&pager_lock);
+    if (start && read) greedy_observe(&greedy_read_ns, now_ns() - start);
+    fault_space = space;
+    BUSY(frame_index) = 0;
+    --nbusy;
+    pthread_cond_broadcast(&frame_cond);
+}
+
+/**
+ * Fills a frame with the contents of a page, or copies them from the frame
+ * in copy_from or from the cluster it was read back with.  Under fault-around, pages that were never written out are
+ * known to be zero and are not read from disk.
+ * Returns 1 if the page was read from disk.
+ */
+int fill_page(struct address_space *space, int page, int frame_index) {
+    char *data = &physmem[(size_t)frame_index * args.page_size];
+    if (copy_from >= 0) {
+        memcpy(data, &physmem[(size_t)copy_from * args.page_size], args.page_size);
+        return 0;
+    }
+    char *read_back = staged != NULL ? staged_page(space, page) : NULL;
+    if (read_back != NULL) {
+        memcpy(data, read_back, args.page_size);
+        return 0;
+    }
+    if ((space->swapped != NULL && !space->swapped[page]) || (ADVICE(space, page) & ADVICE_DISCARDED)) {
+        memset(data, 0, args.page_size);
+        return 0;
+    }
+    disk_read(disk, space->base + page, data);
+    ++stats.disk_reads;
+    return 1;
+}
+
+/**
+ * Waits for another thread to finish reading a page in, so that its frame
+ * becomes a candidate for eviction again.  Returns 0 without waiting if no
+ * read is in progress.
+ */
+int wait_for_frame() {
+    if (nbusy == 0) return 0;
+    pthread_cond_wait(&frame_cond, &pager_lock);
+    return 1;
+}
+
+
+/**
+ * Creates the admission filter and sets the probation frames aside from
+ * the free ones.
+ */
+void admission_init() {
+    nprobation = args.nframes / PROBATION_SHARE > 1 ? args.nframes / PROBATION_SHARE : 1;
+    admission = admission_create(args.nframes - nprobation, 0);
+    probation = malloc(nprobation * sizeof(int));
+    if (admission == NULL || probation == NULL) {
+        printf("Warning: could not allocate space for the admission filter!\n");
+        exit(1);
+    }
+    for (int i = 0; i < nprobation; ++i) {
+        probation[i] = find_free_frame();
+        frame_table[probation[i]].probation = 1;
+    }
+    probation_next = 0;
+}
+
+void admission_destroy() {
+    admission_delete(admission);
+    free(probation);
+    admission = NULL;
+    probation = NULL;
+}
+
+/**
+ * Counts a fault in the admission filter, and turns the page of a demand
+ * fault away into probation if it needs a frame and is colder than the
+ * policy's victim.  Also grants write access to pages in probation, which
+ * the policies know nothing of.  Returns 1 if it handled the fault, or 0 to
+ * leave it to the policy.
+ * Must be called with the pager lock held and fault_space set.
+ */
+int admission_fault(struct page_table *pt, int page) {
+    unsigned long long key = ((unsigned long long) fault_space->id << 32) | (unsigned) page;
+    int frame, bits;
+
+    admission_record(admission, key);
+    page_table_get_entry(pt, page, &frame, &bits);
+    int here = SPACE(frame) == fault_space && PAGE(frame) == page;
+    if (bits) {
+        if (!here || !frame_table[frame].probation) return 0;
+        page_table_set_entry(pt, page, frame, bits | PROT_WRITE);
+        BITS(frame) = bits | PROT_WRITE;
+        return 1;
+    }
+    if (!filtering || (here && frame_table[frame].f_list == 2) || frames_free() > 0) return 0;
+
+    int slot = probation_slot();
+    int victim = slot >= 0 ? propose_victim() : -1;
+    if (victim < 0) return 0;
+
+    unsigned long long victim_key = ((unsigned long long) SPACE(victim)->id << 32) | (unsigned) PAGE(victim);
+    if (admission_admit(admission, key, victim_key)) {
+        // Hand the victim's frame to the policy through the free pool
+        evict(victim);
+        release_frame(victim);
+        victim_space = NULL;
+        ++admitted;
+        return 0;
+    }
+
+    relist_frame(victim);
+    if (FREE(slot)) evict_for_read(slot);
+    ++rejected;
+    read_page(page, slot);
+    page_table_set_entry(pt, page, slot, PROT_READ);
+    PAGE(slot) = page;
+    BITS(slot) = PROT_READ;
+    FREE(slot) = 1;
+    return 1;
+}
+
+/**
+ * The next probation frame in turn that is not being read into and does not
+ * hold a pinned page, or -1 if there is none.
+ */
+int probation_slot() {
+    for (int i = 0; i < nprobation; ++i) {
+        int slot = probation[(probation_next + i) % nprobation];
+        if (BUSY(slot) || (FREE(slot) && page_is_pinned(&frame_table[slot]))) continue;
+        probation_next = (probation_next + i + 1) % nprobation;
+        return slot;
     }
     return -1;
 }
 
 /**
- * Create and insert a new node with the specified frame_index into the fifo list
+ * Takes the frame the live policy would evict next off its list, or returns
+ * -1 if the list is empty.
  */
-void fifo_insert(int frame_index) {
+int propose_victim() {
+    switch (fault_policy) {
+        case RAND:     return find_random_frame();
+        case TWO_FIFO: if (sf_head == NULL && ff_head == NULL) return -1; break;
+        default:       break;
+    }
+    return policy_victim();
+}
 
+/**
+ * Puts a victim the admission filter kept back on the live policy's list,
+ * as if it had just come in.  A page taken off the 2FIFO second-chance list
+ * gets its access back.
+ */
+void relist_frame(int frame_index) {
     f_node * node = &frame_table[frame_index];
+    switch (fault_policy) {
+        case FIFO:
+        case CUSTOM:   fifo_insert(frame_index);   break;
+        case GREEDY:   greedy_insert(frame_index); break;
+        case TWO_FIFO:
+            page_table_set_entry(node->space->pt, node->page, frame_index, node->bits);
+            node->trapped = 0;
+            if (node->speculative) unspeculate(frame_index);
+            sfo_insert(node);
+            break;
+        case RAND:     break;
+    }
+}
 
-    // Insert frame_index into fifo at tail (making it the new tail)
-    if (fifo_tail == NULL) { // No nodes in list
-        fifo_head = node;
-        fifo_tail = node;
-        node->f_list = 1;
-    } else {                 // Nodes in list
-        // See if the frame_index is already in the list
-        if (node->f_list == 1) {
-            // Don't insert already inserted items
-            return;
-        }
+/**
+ * Number of frames in the free pool that this fault may take.
+ */
+int frames_free() {
+    if (victim_space != NULL && victim_space == fault_space) return 0;
+    int n = 0;
+    for (int i = 0; i < FRAME_SHARDS; ++i) n += frame_shards[i].nfree;
+    return n;
+}
+
+/**
+ * Backs a space with a snapshot of the one it clones.  The snapshot taken
+ * last is shared if that one has written nothing since.
+ */
+void clone_space(struct address_space *clone) {
+    struct address_space *parent = &spaces[clone->clone_of];
+
+    pthread_mutex_lock(&pager_lock);
+    long long start = now_ns();
+    if (parent->backing == NULL || parent->owned > 0) take_snapshot(parent);
+    clone->backing = parent->backing;
+    clone->own = calloc(args.npages, 1);
+    if (clone->own == NULL) {
+        printf("Warning: could not allocate space for a clone!\n");
+        exit(1);
+    }
+    clone_ns += now_ns() - start;
+    ++clones_taken;
+    pthread_mutex_unlock(&pager_lock);
+}
 
-        node->next = fifo_tail;
-        node->prev = NULL;
-        fifo_tail-> prev = node;
-        fifo_tail  = node;
-        node->f_list = 1;
+/**
+ * Drops the pages of a space whose program is done, without writing them
+ * back, and unmaps the snapshot frames it shares.
+ */
+void exit_space(struct address_space *space) {
+    int frame, bits;
 
+    pthread_mutex_lock(&pager_lock);
+    page_table_begin_updates();
+    for (int i = 0; i < args.nframes; ++i) {
+        if (!FREE(i) || BUSY(i) || frame_table[i].probation) continue;
+        page_table_get_entry(space->pt, PAGE(i), &frame, &bits);
+        if (SPACE(i) == space) {
+            unlist_frame(i);
+            page_table_set_entry(space->pt, PAGE(i), i, PROT_NONE);
+            BITS(i) = PROT_NONE;
+            --space->resident;
+            release_frame(i);
+        } else if (frame == i && bits && frame_table[i].refs > 0) {
+            page_table_set_entry(space->pt, PAGE(i), i, PROT_NONE);
+            --frame_table[i].refs;
+        }
     }
+    page_table_end_updates();
+    space->exited = 1;
+    pthread_mutex_unlock(&pager_lock);
 }
 
 /**
- * Remove the head node of the fifo list and return its frame_index value,
- * or -1 if the fifo list is empty
+ * Hands the pages a space has of its own over to a new snapshot backing it,
+ * and gives it a fresh disk region.  Its resident pages stay mapped, but
+ * only for reading.
+ * Must be called with the pager lock held, while the space is not faulting.
  */
-int fifo_remove() {
+void take_snapshot(struct address_space *space) {
+    struct address_space *snapshot = &snapshots[nsnapshots];
+    int frame, bits;
 
-    if (fifo_head == NULL) { // Nothing to remove
-        return -1;
-    } else if (fifo_head == fifo_tail) { // Only 1 element
-        int frame_index = FRAMEID(fifo_head);
-        fifo_head->f_list = 0;
-        fifo_head = fifo_tail = NULL;
-        return frame_index;
+    memset(snapshot, 0, sizeof(struct address_space));
+    snapshot->pt = page_table_create_shared(space->pt, args.npages, page_fault_handler);
+    if (snapshot->pt == NULL) {
+        printf("Warning: could not allocate space for a snapshot!\n");
+        exit(1);
+    }
+    snapshot->program = space->program;
+    snapshot->id = MAX_SPACES + nsnapshots++;
+    snapshot->clone_of = space->id;
+    snapshot->base = space->base;
+    snapshot->swapped = space->swapped;
+    snapshot->backing = space->backing;
+    snapshot->own = space->own;
+    snapshot->owned = space->owned;
+
+    space->base = nregions++ * args.npages;
+    space->backing = snapshot;
+    // Its clusters were evicted to the region the snapshot has now
+    if (space->evicted_at != NULL) memset(space->evicted_at, 0, args.npages * sizeof(long long));
+    space->own = calloc(args.npages, 1);
+    space->owned = 0;
+    if (space->swapped != NULL) space->swapped = calloc(args.npages, 1);
+    if (space->own == NULL || (snapshot->swapped != NULL && space->swapped == NULL)) {
+        printf("Warning: could not allocate space for a snapshot!\n");
+        exit(1);
     }
 
-    // Remove the head of the fifo
-    fifo_head->f_list = 0;
-    int frame_index = FRAMEID(fifo_head);
-    fifo_head = fifo_head->prev;
-    fifo_head->next = NULL;
+    page_table_begin_updates();
+    for (int i = 0; i < args.nframes; ++i) {
+        if (!FREE(i) || SPACE(i) != space) continue;
+        page_table_get_entry(space->pt, PAGE(i), &frame, &bits);
+        page_table_set_entry(snapshot->pt, PAGE(i), i, PROT_NONE);
+        if (frame == i && bits) {
+            page_table_set_entry(space->pt, PAGE(i), i, PROT_READ);
+            frame_table[i].refs = 1;
+        }
+        SPACE(i) = snapshot;
+        --space->resident;
+        ++snapshot->resident;
+    }
+    page_table_end_updates();
+}
 
-    return frame_index;
+/**
+ * Serves a fault on a page a space has no copy of its own of: maps the
+ * frame of the snapshot it comes from for reading, or gives the space a
+ * copy to write.  Returns 1 if it handled the fault, or 0 to leave it to
+ * the policy.
+ * Must be called with the pager lock held and fault_space set.
+ */
+int shared_fault(struct page_table *pt, int page) {
+    struct address_space *space = fault_space;
+    int frame, bits;
+
+    if (owns(space, page)) return 0;
+    struct address_space *source = source_of(space->backing, page);
+    page_table_get_entry(pt, page, &frame, &bits);
+
+    if (!bits) {
+        frame = snapshot_frame(source, page);
+        page_table_set_entry(pt, page, frame, PROT_READ);
+        ++frame_table[frame].refs;
+        ++cow_shared;
+        return 1;
+    }
+    if (SPACE(frame) != source || PAGE(frame) != page) {
+        // Not the snapshot's frame after all; fault again to find it
+        page_table_set_entry(pt, page, frame, PROT_NONE);
+        return 1;
+    }
+    own_page(space, page);
+    --frame_table[frame].refs;
+
+    if (!inherited(source, space, page)) {
+        // Nobody else sees the snapshot's page any more, so take its frame over
+        page_table_set_entry(source->pt, page, frame, PROT_NONE);
+        SPACE(frame) = space;
+        --source->resident;
+        ++space->resident;
+        ++cow_handed;
+    } else {
+        // Copy the frame into one of the space's own, keeping it off the
+        // lists and busy meanwhile so it is not evicted from under the copy
+        page_table_set_entry(pt, page, frame, PROT_NONE);
+        unlist_frame(frame);
+        BUSY(frame) = 1;
+        ++nbusy;
+        copy_from = frame;
+        handle_fault(pt, page);
+        copy_from = -1;
+        BUSY(frame) = 0;
+        --nbusy;
+        relist_frame(frame);
+        pthread_cond_broadcast(&frame_cond);
+        page_table_get_entry(pt, page, &frame, &bits);
+        ++cow_copied;
+    }
+    // The disk region of the space does not have the page yet
+    page_table_set_entry(pt, page, frame, PROT_READ | PROT_WRITE);
+    BITS(frame) = PROT_READ | PROT_WRITE;
+    return 1;
 }
 
 /**
- * Insert a node into the combined first- and second-chance lists.
- * In the event that the first list is full, this properly moves one to the second list.
- * If that is full as well, this properly evicts the oldest page of the second list.
+ * The frame holding a page of a snapshot, brought in through the policy as
+ * the snapshot's if it is not resident.  A frame on the 2FIFO second-chance
+ * list goes back on the first.
+ * Must be called with the pager lock held and fault_space set.
  */
-void sfo_insert(struct page_table *pt, f_node * node) {
-    // Insert node into the first-chance list.
-    if (ff_head == NULL) {
-        ff_head = node;
-        ff_tail = node;
-        node->next = NULL;
-        node->prev = NULL;
+int snapshot_frame(struct address_space *snapshot, int page) {
+    struct address_space *space = fault_space;
+    struct fetch *f;
+    int frame, bits;
+
+    for (;;) {
+        page_table_get_entry(snapshot->pt, page, &frame, &bits);
+        if (FREE(frame) && SPACE(frame) == snapshot && PAGE(frame) == page) {
+            if (BUSY(frame)) {
+                wait_for_frame();
+                continue;
+            }
+            if (frame_table[frame].f_list == 2) {
+                sfo_remove(&frame_table[frame], &sf_head);
+                s_entries--;
+                sfo_insert(&frame_table[frame]);
+            }
+            return frame;
+        }
+        for (f = fetching; f != NULL && !(f->space == snapshot && f->page == page); f = f->next);
+        if (f == NULL) break;
+        pthread_cond_wait(&frame_cond, &pager_lock);
     }
-    else {
-        ff_tail->next = node;
-        node->prev = ff_tail;
-        ff_tail = node;
-        node->next = NULL;
-    }
-    node->f_list = 1;
-    f_entries++;
-    if (f_entries > FIRST_L) {
-        // The first-chance list is full; we need to bump one to the second-chance list.
-        // Check if the second list is empty.
-        if (sf_head == NULL) {
-            sf_head = ff_head;
-            sf_tail = sf_head;
-            ff_head = ff_head->next;
-            ff_head->prev = NULL;
-            sf_head->next = NULL;
+
+    // The read may drop the pager lock, so let other faults on the page wait
+    struct fetch mine = { snapshot, page, fetching };
+    fetching = &mine;
+    fault_space = snapshot;
+    handle_fault(snapshot->pt, page);
+    fault_space = space;
+    for (struct fetch **p = &fetching; *p != NULL; p = &(*p)->next) {
+        if (*p == &mine) {
+            *p = mine.next;
+            break;
         }
-        else {
-            node = ff_head;
-            sfo_remove(node, &ff_head);
-            sf_tail->next = node;
-            node->prev = sf_tail;
-            node->next = NULL;
-            sf_tail = node;
-        }
-        // Update the associated list of the newly-inserted node, and invalidate the page.
-        sf_tail->f_list = 2;
-        page_table_set_entry(pt, sf_tail->page, FRAMEID(sf_tail), PROT_NONE);
-        
-        s_entries++;
-        if (s_entries > SECOND_L) {
-            // We have too many entries in the second list and must evict a page.
-            evict(pt, FRAMEID(sf_head));
-            sf_head->free = 0;
-            sf_head->f_list = 0;
-            sf_head = sf_head->next;
-            sf_head->prev = NULL;
-            s_entries--;
+    }
+    pthread_cond_broadcast(&frame_cond);
+
+    page_table_get_entry(snapshot->pt, page, &frame, &bits);
+    return frame;
+}
+
+/**
+ * Takes access to a snapshot frame away from every clone mapping it.
+ * Must be called with the pager lock held.
+ */
+void unshare_frame(int frame_index) {
+    int frame, bits;
+
+    if (frame_table[frame_index].refs == 0) return;
+    for (int i = 0; i < nspaces; ++i) {
+        if (&spaces[i] == SPACE(frame_index)) continue;
+        page_table_get_entry(spaces[i].pt, PAGE(frame_index), &frame, &bits);
+        if (frame == frame_index && bits) page_table_set_entry(spaces[i].pt, PAGE(frame_index), frame, PROT_NONE);
+    }
+    frame_table[frame_index].refs = 0;
+}
+
+/**
+ * The space or snapshot holding the page a space sees: the space itself if
+ * it has its own copy, and otherwise the first snapshot backing it that does.
+ */
+struct address_space * source_of(struct address_space *space, int page) {
+    while (!owns(space, page)) space = space->backing;
+    return space;
+}
+
+int owns(struct address_space *space, int page) {
+    return space->own == NULL || space->own[page];
+}
+
+void own_page(struct address_space *space, int page) {
+    if (space->own == NULL || space->own[page]) return;
+    space->own[page] = 1;
+    ++space->owned;
+}
+
+/**
+ * Whether any space or snapshot besides "except" still sees a page of a
+ * snapshot.
+ */
+int inherited(struct address_space *snapshot, struct address_space *except, int page) {
+    for (int i = 0; i < nspaces; ++i) {
+        if (&spaces[i] == except || spaces[i].exited || spaces[i].backing == NULL) continue;
+        if (source_of(&spaces[i], page) == snapshot) return 1;
+    }
+    for (int i = 0; i < nsnapshots; ++i) {
+        if (&snapshots[i] != snapshot && source_of(&snapshots[i], page) == snapshot) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Reads the header of the checkpoint to restart from, and checks that it
+ * was saved by a run with the same layout, of disk files that have not
+ * changed since.  Returns 0 after saying what is wrong if it cannot be
+ * restarted from.
+ */
+int open_checkpoint(const char *name) {
+    struct checkpoint_header *h = &restart_header;
+    long long size[MAX_DISKS], mtime[MAX_DISKS];
+
+    restart_file = fopen(name, "r");
+    if (restart_file == NULL) {
+        fprintf(stderr, "couldn't restart from %s: %s\n", name, strerror(errno));
+        return 0;
+    }
+    if (fread(h, sizeof(struct checkpoint_header), 1, restart_file) != 1 ||
+        memcmp(h->magic, CHECKPOINT_MAGIC, sizeof(h->magic)) != 0) {
+        fprintf(stderr, "couldn't restart from %s: not a checkpoint\n", name);
+        return 0;
+    }
+    if (h->npages != args.npages || h->nframes != args.nframes || h->page_size != args.page_size ||
+        h->nspaces != nspaces || h->policy != (int) fault_policy || h->ndisks != args.ndisks ||
+        h->stripe != args.stripe) {
+        fprintf(stderr, "couldn't restart from %s: it was saved with other pages, frames, page size,\n", name);
+        fprintf(stderr, "  number of programs, policy or disk files\n");
+        return 0;
+    }
+    if (!stat_disks(size, mtime)) {
+        fprintf(stderr, "couldn't restart from %s: %s\n", name, strerror(errno));
+        return 0;
+    }
+    for (int i = 0; i < args.ndisks; ++i) {
+        if (size[i] != h->disk_size[i] || mtime[i] != h->disk_mtime[i]) {
+            fprintf(stderr, "couldn't restart from %s: %s has changed since it was saved\n", name, args.disks[i]);
+            return 0;
         }
-        f_entries--;
     }
+    return 1;
 }
 
-/** Remove a node from our first- or second-chance list and returns its frame number.
- * This does _not_ free the node or evict it to disk, since that depends on the context it's called in.
- * Note the double-pointer is so we can use this with either list's head.
+/**
+ * Sets the frame table and the policy lists up again as they are in the
+ * checkpoint opened by open_checkpoint, with every page in a frame left
+ * without access for restore_fault to copy its image in.  Returns 0 after
+ * saying so if the checkpoint is cut short or damaged.
  */
-int sfo_remove(f_node * node, f_node ** head) {
-    //f_node * tempNode = *head;
-    if (*head == NULL) {
-    printf("Error: We're removing from an empty list!\n");
-    exit(1);
+int restore_checkpoint() {
+    struct checkpoint_header *h = &restart_header;
+    struct checkpoint_frame *frames = malloc(args.nframes * sizeof(struct checkpoint_frame));
+    int *listed = malloc(args.nframes * sizeof(int));
+    int nlisted = h->listed[0] + h->listed[1];
+    long long start = now_ns();
+    struct stat st;
+    int ok = frames != NULL && listed != NULL;
+
+    for (int i = 0; ok && i < nspaces; ++i) {
+        if (!h->swapped) {
+            // Without a record any page may have been written out
+            if (spaces[i].swapped != NULL) memset(spaces[i].swapped, 1, args.npages);
+        } else if (spaces[i].swapped != NULL) {
+            ok = fread(spaces[i].swapped, args.npages, 1, restart_file) == 1;
+        } else {
+            ok = fseeko(restart_file, args.npages, SEEK_CUR) == 0;
+        }
     }
-    if (node == *head) {
-        //special case
-        int frame = FRAMEID((*head));
-        *head = (*head)->next;
-        if ((*head) != NULL)
-        {
-        (*head)->prev = NULL;
+    ok = ok && fread(frames, sizeof(struct checkpoint_frame), args.nframes, restart_file) == (size_t) args.nframes;
+    ok = ok && h->listed[0] >= 0 && h->listed[1] >= 0 && nlisted <= args.nframes;
+    ok = ok && fread(listed, sizeof(int), nlisted, restart_file) == (size_t) nlisted;
+    restart_images = (ftello(restart_file) + args.page_size - 1) / args.page_size * args.page_size;
+    ok = ok && fstat(fileno(restart_file), &st) == 0 &&
+         st.st_size >= restart_images + (off_t) args.nframes * args.page_size;
+
+    page_table_begin_updates();
+    for (int i = 0; ok && i < args.nframes; ++i) {
+        struct checkpoint_frame *f = &frames[i];
+        if (f->space < 0) continue;
+        if (f->space >= nspaces || f->page < 0 || f->page >= args.npages) {
+            ok = 0;
+            break;
         }
-        return frame;
+        SPACE(i) = &spaces[f->space];
+        PAGE(i) = f->page;
+        BITS(i) = f->bits;
+        FREE(i) = 1;
+        frame_table[i].credit = f->credit;
+        frame_table[i].pending = 1;
+        page_table_set_entry(SPACE(i)->pt, PAGE(i), i, PROT_NONE);
+        ++SPACE(i)->resident;
+        ++nrestarted;
     }
-    else {
-        if (node == sf_tail)
-        {
-            //Special case
-            sf_tail = sf_tail->prev;
-            sf_tail->next = NULL;
+    page_table_end_updates();
+    npending = nrestarted;
+
+    // The lists are saved from the end evicted first, so appending keeps their order
+    for (int i = 0; ok && i < nlisted; ++i) {
+        int frame_index = listed[i];
+        f_node * node = &frame_table[frame_index];
+        if (frame_index < 0 || frame_index >= args.nframes || !FREE(frame_index) || node->f_list) {
+            ok = 0;
+            break;
         }
-        else if (node == ff_tail)
-        {
-            //Special case
-            ff_tail = ff_tail->prev;
-            ff_tail->next = NULL;
+        switch (fault_policy) {
+            case FIFO:
+            case CUSTOM:   fifo_insert(frame_index); break;
+            case GREEDY:
+                // Saved in heap order, with the credits it was ordered by
+                node->f_list = 1;
+                node->heap_pos = greedy_size;
+                greedy_heap[greedy_size++] = frame_index;
+                break;
+            case TWO_FIFO:
+                if (i < h->listed[0]) {
+                    sfo_insert(node);
+                    break;
+                }
+                node->prev = sf_tail;
+                node->next = NULL;
+                if (sf_tail == NULL) sf_head = node;
+                else sf_tail->next = node;
+                sf_tail = node;
+                node->f_list = 2;
+                s_entries++;
+                break;
+            case RAND:     break;
         }
-        else
-        {
-            node->prev->next = node->next;
-            node->next->prev = node->prev;
+    }
+    greedy_inflation = h->greedy_inflation;
+    greedy_read_ns = h->greedy_read_ns;
+    greedy_write_ns = h->greedy_write_ns;
+
+    // Only the frames left empty go back in the free pool
+    frame_pool_destroy();
+    frame_pool_init(args.nframes);
+
+    free(frames);
+    free(listed);
+    restart_ns = now_ns() - start;
+    if (!ok) fprintf(stderr, "couldn't restart from %s: the checkpoint is cut short or damaged\n", args.restart);
+    return ok;
+}
+
+/**
+ * Saves the state of the pager in "name".  It is written to a temporary
+ * file renamed over "name" at the end, so a run may save back to the
+ * checkpoint it restarted from.  Images still pending from the restart are
+ * copied in first.  Nothing may be faulting at the time.
+ * Returns 0 after saying what went wrong if it could not be saved.
+ */
+int save_checkpoint(const char *name) {
+    struct checkpoint_header h;
+    struct checkpoint_frame *frames = calloc(args.nframes, sizeof(struct checkpoint_frame));
+    int *listed = malloc(args.nframes * sizeof(int));
+    char *temp = malloc(strlen(name) + 5);
+    long long start = now_ns();
+    FILE *file = NULL;
+    f_node * node;
+    int nsaved = 0, n = 0;
+
+    if (frames == NULL || listed == NULL || temp == NULL) {
+        printf("Warning: could not allocate space for a checkpoint!\n");
+        exit(1);
+    }
+    sprintf(temp, "%s.tmp", name);
+
+    for (int i = 0; i < args.nframes; ++i) {
+        if (frame_table[i].pending) {
+            restore_image(i);
+            ++restart_written;
         }
-        return FRAMEID(node);
-   }
+    }
+
+    memset(&h, 0, sizeof(struct checkpoint_header));
+    memcpy(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic));
+    h.npages = args.npages;
+    h.nframes = args.nframes;
+    h.page_size = args.page_size;
+    h.nspaces = nspaces;
+    h.policy = fault_policy;
+    h.ndisks = args.ndisks;
+    h.stripe = args.stripe;
+    h.swapped = spaces[0].swapped != NULL;
+    h.greedy_inflation = greedy_inflation;
+    h.greedy_read_ns = greedy_read_ns;
+    h.greedy_write_ns = greedy_write_ns;
+
+    for (int i = 0; i < args.nframes; ++i) {
+        frames[i].space = FREE(i) ? SPACE(i)->id : -1;
+        frames[i].page = PAGE(i);
+        frames[i].bits = BITS(i);
+        frames[i].f_list = frame_table[i].f_list;
+        frames[i].credit = frame_table[i].credit;
+        if (FREE(i)) ++nsaved;
+    }
+    switch (fault_policy) {
+        case FIFO:
+        case CUSTOM:
+            for (node = fifo_head; node != NULL; node = node->prev) listed[n++] = FRAMEID(node);
+            h.listed[0] = n;
+            break;
+        case TWO_FIFO:
+            for (node = ff_head; node != NULL; node = node->next) listed[n++] = FRAMEID(node);
+            h.listed[0] = n;
+            for (node = sf_head; node != NULL; node = node->next) listed[n++] = FRAMEID(node);
+            h.listed[1] = n - h.listed[0];
+            break;
+        case GREEDY:
+            for (int i = 0; i < greedy_size; ++i) listed[n++] = greedy_heap[i];
+            h.listed[0] = n;
+            break;
+        case RAND:
+            break;
+    }
+
+    // The disk is done with, so it stays as it is recorded here
+    int ok = stat_disks(h.disk_size, h.disk_mtime) && (file = fopen(temp, "w")) != NULL;
+    ok = ok && fwrite(&h, sizeof(struct checkpoint_header), 1, file) == 1;
+    for (int i = 0; ok && h.swapped && i < nspaces; ++i) {
+        ok = fwrite(spaces[i].swapped, args.npages, 1, file) == 1;
+    }
+    ok = ok && fwrite(frames, sizeof(struct checkpoint_frame), args.nframes, file) == (size_t) args.nframes;
+    ok = ok && fwrite(listed, sizeof(int), n, file) == (size_t) n;
+    ok = ok && fflush(file) == 0;
+
+    off_t images = ok ? (ftello(file) + args.page_size - 1) / args.page_size * args.page_size : 0;
+    for (int i = 0; ok && i < args.nframes; ++i) {
+        if (!FREE(i)) continue;
+        ok = pwrite(fileno(file), &physmem[(size_t)i * args.page_size], args.page_size,
+                    images + (off_t) i * args.page_size) == args.page_size;
+    }
+    ok = ok && ftruncate(fileno(file), images + (off_t) args.nframes * args.page_size) == 0;
+    if (file != NULL && fclose(file) != 0) ok = 0;
+    ok = ok && rename(temp, name) == 0;
+
+    if (ok) {
+        printf("checkpoint: saved %d frames to %s in %.1f ms\n", nsaved, name, (now_ns() - start) / 1e6);
+    } else {
+        fprintf(stderr, "couldn't save checkpoint %s: %s\n", name, strerror(errno));
+        if (file != NULL) unlink(temp);
+    }
+    free(frames);
+    free(listed);
+    free(temp);
+    return ok;
+}
+
+/**
+ * Serves the first access to a page that was in a frame when the
+ * checkpoint restarted from was saved, by copying its image in and giving
+ * back the access it had.  Returns 1 if it handled the fault, or 0 to
+ * leave it to the policy, which is also what becomes of pages on the
+ * 2FIFO second-chance list once their image is in.
+ * Must be called with the pager lock held and fault_space set.
+ */
+int restore_fault(struct page_table *pt, int page) {
+    int frame, bits;
+
+    page_table_get_entry(pt, page, &frame, &bits);
+    if (!frame_table[frame].pending || SPACE(frame) != fault_space || PAGE(frame) != page) return 0;
+    restore_image(frame);
+    ++stats.restores;
+    if (frame_table[frame].f_list == 2) return 0;
+    page_table_set_entry(pt, page, frame, BITS(frame));
+    return 1;
+}
+
+/**
+ * Copies the image of a frame in from the checkpoint restarted from.  This
+ * reads the checkpoint file, not the disk, so it counts as no disk read.
+ */
+void restore_image(int frame_index) {
+    off_t offset = restart_images + (off_t) frame_index * args.page_size;
+    if (pread(fileno(restart_file), &physmem[(size_t)frame_index * args.page_size], args.page_size, offset) !=
+        args.page_size) {
+        fprintf(stderr, "couldn't read frame %d back from %s: %s\n", frame_index, args.restart, strerror(errno));
+        exit(1);
+    }
+    forget_image(frame_index);
+}
+
+/**
+ * Forgets the image of a frame whose page is dropped, or evicted clean.
+ */
+void forget_image(int frame_index) {
+    frame_table[frame_index].pending = 0;
+    --npending;
+}
+
+/**
+ * Gets the size and last modification time of every disk file.
+ * Returns 0 with errno set if one cannot be looked at.
+ */
+int stat_disks(long long *size, long long *mtime) {
+    struct stat st;
+    for (int i = 0; i < args.ndisks; ++i) {
+        if (stat(args.disks[i], &st) < 0) return 0;
+        size[i] = st.st_size;
+        mtime[i] = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    }
+    return 1;
 }
 
 /**
  * Evicts the page that is in the frame indexed by f_num, writing to disk first if needed
  */
-void evict(struct page_table * pt, int f_num) {
+void evict(int f_num) {
     //NOTE: We assume that write bit set implies a modification was made.
-    
+
+    // Revoke access before writing back, so another thread cannot
+    // modify the page after its contents have been copied out.  A deferred
+    // revoke has to be applied first too, and when other threads run it
+    // must be before the frame is refilled even if the page is clean.
+    page_table_set_entry(SPACE(f_num)->pt, PAGE(f_num), f_num, PROT_NONE);
+    unshare_frame(f_num);
+    if ((BITS(f_num) & PROT_WRITE) || args.nthreads > 0 || nspaces > 1) {
+        page_table_flush_updates();
+    }
+    // A dirty page never touched since the restart is written back from its image
+    if (frame_table[f_num].pending) {
+        if (BITS(f_num) & PROT_WRITE) {
+            restore_image(f_num);
+            ++restart_written;
+        } else {
+            forget_image(f_num);
+            ++restart_dropped;
+        }
+    }
     if (BITS(f_num) & PROT_WRITE) {
-        disk_write(disk, PAGE(f_num), &physmem[f_num * PAGE_SIZE]);
+        if (deferred_blocks != NULL) {
+            deferred_blocks[ndeferred] = BLOCK(f_num);
+            deferred_data[ndeferred++] = &physmem[(size_t)f_num * args.page_size];
+        } else {
+            struct address_space *space = fault_space;
+            if (unlocked_writeback) {
+                BUSY(f_num) = 1;
+                ++nbusy;
+                frame_table[f_num].writing = 1;
+                pthread_mutex_unlock(&pager_lock);
+            }
+            long long start = fault_policy == GREEDY || adaptive ? now_ns() : 0;
+            disk_write(disk, BLOCK(f_num), &physmem[(size_t)f_num * args.page_size]);
+            if (start) greedy_observe(&greedy_write_ns, now_ns() - start);
+            if (unlocked_writeback) {
+                pthread_mutex_lock(&pager_lock);
+                fault_space = space;
+                BUSY(f_num) = 0;
+                --nbusy;
+                frame_table[f_num].writing = 0;
+                pthread_cond_broadcast(&frame_cond);
+            }
+        }
         ++stats.disk_writes;
+        ++SPACE(f_num)->writebacks;
+        if (staged != NULL) staged_writeback(SPACE(f_num), PAGE(f_num));
+        if (SPACE(f_num)->swapped != NULL) SPACE(f_num)->swapped[PAGE(f_num)] = 1;
+        if (SPACE(f_num)->advice != NULL) SPACE(f_num)->advice[PAGE(f_num)] &= ~ADVICE_DISCARDED;
     }
-    page_table_set_entry(pt, PAGE(f_num), f_num, PROT_NONE);
     BITS(f_num) = PROT_NONE;
+    frame_table[f_num].trapped = 0;
+    if (frame_table[f_num].speculative) {
+        unspeculate(f_num);
+        cluster_outcome(0);
+    }
+    if (evict_log != NULL) log_eviction(SPACE(f_num), PAGE(f_num));
+    if (SPACE(f_num)->heat) heat_page_out(SPACE(f_num)->heat, PAGE(f_num), heat_now, ++heat_evictions, 1);
+    --SPACE(f_num)->resident;
     ++stats.evictions;
 }
 
 /**
- * Prints some statistics in a slightly understandable manner.
+ * Evicts the page in a frame a fault handler has taken off the lists to
+ * read a page into.  A dirty page is written out with the pager lock
+ * dropped and the frame busy, as read_page does for the read; reads of the
+ * page wait in read_page until the write is done.
  */
-void print_stats() {
-    printf("\nStatistics:  flt(%d) rd(%d) wr(%d) ev(%d)\n",
-        stats.page_faults, stats.disk_reads, stats.disk_writes, stats.evictions);
+void evict_for_read(int f_num) {
+    unlocked_writeback = 1;
+    evict(f_num);
+    unlocked_writeback = 0;
+}
+
+/**
+ * Holds back the writebacks of the next max evictions, so that
+ * flush_writebacks can write them out in one batch.  The frames evicted
+ * meanwhile must not be refilled until then.
+ */
+void defer_writebacks(int max) {
+    deferred_blocks = malloc(max * sizeof(int));
+    deferred_data = malloc(max * sizeof(char *));
+    if (deferred_blocks == NULL || deferred_data == NULL) {
+        printf("Warning: could not allocate space for writebacks!\n");
+        exit(1);
+    }
+    ndeferred = 0;
+}
+
+/**
+ * Writes out the pages evicted since defer_writebacks, and goes back to
+ * writing every one out as it is evicted.
+ */
+void flush_writebacks() {
+    if (ndeferred > 0) disk_write_batch(disk, deferred_blocks, (const char **) deferred_data, ndeferred);
+    free(deferred_blocks);
+    free(deferred_data);
+    deferred_blocks = NULL;
+    deferred_data = NULL;
+    ndeferred = 0;
+}
+
+/**
+ * Remove a frame from whichever policy list holds it.
+ */
+void unlist_frame(int frame_index) {
+    f_node * node = &frame_table[frame_index];
+    if (fault_policy == TWO_FIFO) {
+        if (node->f_list == 1) {
+            sfo_remove(node, &ff_head);
+            f_entries--;
+        } else if (node->f_list == 2) {
+            sfo_remove(node, &sf_head);
+            s_entries--;
+        }
+        node->f_list = 0;
+    } else if (node->f_list == 1 && fault_policy == GREEDY) {
+        greedy_unlink(node);
+    } else if (node->f_list == 1) {
+        fifo_unlink(node);
+    }
+}
+
+int page_is_hot(f_node * node) {
+    return node->space != NULL && (ADVICE(node->space, node->page) & ADVICE_HOT);
+}
+
+int page_is_pinned(f_node * node) {
+    return node->space != NULL && (ADVICE(node->space, node->page) & ADVICE_PINNED);
+}
+
+/**
+ * A page bumped to the 2FIFO second-chance list loses its access, so that
+ * its next reference brings it back to the first.
+ */
+void demote_frame(f_node * node) {
+    page_table_set_entry(node->space->pt, node->page, FRAMEID(node), PROT_NONE);
+    unshare_frame(FRAMEID(node));
+}
+
+/**
+ * A page falling off the 2FIFO second-chance list is evicted and its frame freed.
+ */
+void drop_frame(f_node * node) {
+    evict(FRAMEID(node));
+    release_frame(FRAMEID(node));
+}
+
+/**
+ * Acts on a hint given through page_table_advise for a range of pages.
+ */
+void page_advice_handler( struct page_table *pt, int page, int npages, int advice ) {
+    struct address_space *space = space_of(pt);
+
+    register_thread();
+    pthread_mutex_lock(&pager_lock);
+    if (advice == PAGE_ADVICE_WILLNEED) {
+        // Never bring in more than half of the space's frames ahead of time
+        int most = args.nframes / nspaces / 2;
+        fault_space = space;
+        prefetch_range(pt, page, npages < most ? npages : most);
+    }
+    for (int i = page; i < page + npages; ++i) {
+        fault_space = space;
+        switch (advice) {
+            case PAGE_ADVICE_NORMAL:
+            case PAGE_ADVICE_SEQUENTIAL:
+            case PAGE_ADVICE_RANDOM:
+                space->advice[i] = (space->advice[i] & ~ADVICE_PATTERN) | advice;
+                break;
+            case PAGE_ADVICE_WILLNEED:                                      break;
+            case PAGE_ADVICE_DONTNEED: drop_page(pt, i);                    break;
+            case PAGE_ADVICE_HOT:      space->advice[i] |= ADVICE_HOT;      break;
+            case PAGE_ADVICE_COLD:     space->advice[i] &= ~ADVICE_HOT;     break;
+            case PAGE_ADVICE_PIN:      pin_page(pt, i);                     break;
+            case PAGE_ADVICE_UNPIN:    unpin_page(pt, i);                   break;
+        }
+    }
+    if (stats_export != NULL) export_stats(0);
+    pthread_mutex_unlock(&pager_lock);
+}
+
+/**
+ * Number of pages read ahead of a fault in a sequential range.  Like a
+ * fault-around group, it never takes more than half of a stream's share of
+ * the unpinned frames, each thread of each space running its own stream.
+ */
+int readahead_window() {
+    int streams = nspaces * (args.nthreads > 0 ? args.nthreads : 1);
+    int window = (args.nframes - npinned) / streams / 2 - 1;
+    return window < 8 ? window : 8;
+}
+
+/**
+ * Brings in the pages following a fault in a sequential range.  The faulting
+ * page is treated as hot meanwhile, so that the pages read ahead never push
+ * it back out before the access that faulted on it is retried.
+ */
+void read_ahead(struct page_table *pt, int page) {
+    struct address_space *space = fault_space;
+    unsigned char hot = space->advice[page] & ADVICE_HOT;
+    int window = readahead_window();
+    int n = 0;
+
+    while (n < window && page + 1 + n < args.npages &&
+           (ADVICE(space, page + 1 + n) & ADVICE_PATTERN) == PAGE_ADVICE_SEQUENTIAL) {
+        ++n;
+    }
+    space->advice[page] |= ADVICE_HOT;
+    prefetch_range(pt, page + 1, n);
+    space->advice[page] = (space->advice[page] & ~ADVICE_HOT) | hot;
+}
+
+/**
+ * Brings in n pages from first on ahead of their first access, reading the
+ * ones that have to come from disk CLUSTER_PAGES at a time in one batch.
+ * Must be called with the pager lock held and fault_space set.
+ */
+void prefetch_range(struct page_table *pt, int first, int n) {
+    struct address_space *space = fault_space;
+
+    for (int from = first; from < first + n; from += CLUSTER_PAGES) {
+        int count = first + n - from < CLUSTER_PAGES ? first + n - from : CLUSTER_PAGES;
+        stage_pages(space, from, count);
+        for (int i = from; i < from + count; ++i) {
+            fault_space = space;
+            prefetch_page(pt, i);
+        }
+        if (staged != NULL) unstage();
+    }
+    fault_space = space;
+}
+
+/**
+ * Reads the pages among n from first that would have to come from disk in
+ * one batch, if there are at least two, and leaves them staged for
+ * prefetch_page to copy in.  The pager lock is dropped during the read.
+ * Must be called with the pager lock held.
+ */
+void stage_pages(struct address_space *space, int first, int n) {
+    int pages[CLUSTER_PAGES], blocks[CLUSTER_PAGES];
+    char *data[CLUSTER_PAGES];
+    int count = 0;
+
+    if (staged != NULL) return;
+    for (int i = first; i < first + n; ++i) {
+        if (needs_read(space, i)) pages[count++] = i;
+    }
+    if (count < 2) return;
+
+    struct cluster *c = malloc(sizeof(struct cluster));
+    char *buffer = c != NULL ? malloc((size_t) count * args.page_size) : NULL;
+    if (buffer == NULL) {
+        printf("Warning: could not allocate space for pages read ahead!\n");
+        exit(1);
+    }
+    c->space = space;
+    c->n = count;
+    c->writebacks = space->writebacks;
+    c->data = buffer;
+    memcpy(c->pages, pages, count * sizeof(int));
+    for (int i = 0; i < count; ++i) {
+        blocks[i] = space->base + pages[i];
+        data[i] = &c->data[(size_t) i * args.page_size];
+    }
+
+    pthread_mutex_unlock(&pager_lock);
+    disk_read_batch(disk, blocks, data, count);
+    pthread_mutex_lock(&pager_lock);
+    stats.disk_reads += count;
+    staged = c;
+}
+
+/**
+ * Brings a page in ahead of its first access, unless it is already mapped.
+ */
+void prefetch_page(struct page_table *pt, int page) {
+    int frame, bits;
+    if (adaptive && untrap(pt, page)) return;
+    page_table_get_entry(pt, page, &frame, &bits);
+    if (bits) return;
+    ++stats.readaheads;
+    map_page(pt, page);
+}
+
+/**
+ * Drops a page without writing it back.  Until it is written out again it
+ * reads back as zeros.
+ */
+void drop_page(struct page_table *pt, int page) {
+    struct address_space *space = fault_space;
+    int frame, bits;
+
+    page_table_get_entry(pt, page, &frame, &bits);
+    space->advice[page] |= ADVICE_DISCARDED;
+    if (!FREE(frame) || BUSY(frame) || SPACE(frame) != space || PAGE(frame) != page) return;
+
+    if (space->advice[page] & ADVICE_PINNED) {
+        space->advice[page] &= ~ADVICE_PINNED;
+        --npinned;
+    }
+    unlist_frame(frame);
+    page_table_set_entry(pt, page, frame, PROT_NONE);
+    page_table_flush_updates();
+    BITS(frame) = PROT_NONE;
+    if (space->heat) heat_page_out(space->heat, page, heat_now, heat_evictions, 0);
+    --space->resident;
+    // Probation frames stay set aside, empty until the next page turned away
+    if (frame_table[frame].probation) FREE(frame) = 0;
+    else release_frame(frame);
+    ++stats.discards;
+}
+
+/**
+ * Brings a page in and takes its frame off the policy lists.  At most half
+ * of the frames may be pinned, so the policies always have some to work with.
+ */
+void pin_page(struct page_table *pt, int page) {
+    struct address_space *space = fault_space;
+    int frame, bits;
+
+    if ((space->advice[page] & ADVICE_PINNED) || npinned >= args.nframes / 2) return;
+
+    if (adaptive) untrap(pt, page);
+    page_table_get_entry(pt, page, &frame, &bits);
+    if (!bits) {
+        map_page(pt, page);
+        page_table_get_entry(pt, page, &frame, &bits);
+    }
+    space->advice[page] |= ADVICE_PINNED;
+    ++npinned;
+    unlist_frame(frame);
+}
+
+/**
+ * Puts a pinned page's frame back on the policy lists.
+ */
+void unpin_page(struct page_table *pt, int page) {
+    struct address_space *space = fault_space;
+    int frame, bits;
+
+    if (!(space->advice[page] & ADVICE_PINNED)) return;
+    space->advice[page] &= ~ADVICE_PINNED;
+    --npinned;
+
+    page_table_get_entry(pt, page, &frame, &bits);
+    if (!bits || SPACE(frame) != space || PAGE(frame) != page || frame_table[frame].probation) return;
+    switch (fault_policy) {
+        case FIFO:
+        case CUSTOM:   fifo_insert(frame);             break;
+        case TWO_FIFO: sfo_insert(&frame_table[frame]); break;
+        case GREEDY:   greedy_insert(frame);           break;
+        default:       break;
+    }
+}
+
+/**
+ * Sets up the eviction log, which remembers as many evictions as would
+ * turn the frames over eight times; a page evicted before that has no
+ * cluster any more.
+ */
+void cluster_init() {
+    evict_log_size = (args.nframes * 8 + CLUSTER_PAGES - 1) / CLUSTER_PAGES * CLUSTER_PAGES;
+    evict_log = calloc(evict_log_size, sizeof(struct evicted_page));
+    ghosts = calloc(evict_log_size / CLUSTER_PAGES, sizeof(struct ghost_cluster));
+    if (evict_log == NULL || ghosts == NULL) {
+        printf("Warning: could not allocate space for the eviction log!\n");
+        exit(1);
+    }
+    for (int i = 0; i < nspaces; ++i) {
+        spaces[i].evicted_at = calloc(args.npages, sizeof(long long));
+        if (spaces[i].evicted_at == NULL) {
+            printf("Warning: could not allocate space for the eviction log!\n");
+            exit(1);
+        }
+    }
+    evict_seq = 0;
+    clustering = 1;
+    nspeculative = 0;
+    cluster_reads = cluster_pages = cluster_hits = cluster_wasted = 0;
+    cluster_offs = cluster_ons = 0;
+    window_hits = window_wasted = ghost_reads = ghost_hits = 0;
+}
+
+void cluster_destroy() {
+    free(evict_log);
+    free(ghosts);
+    evict_log = NULL;
+    ghosts = NULL;
+    for (int i = 0; i < nspaces; ++i) {
+        free(spaces[i].evicted_at);
+        spaces[i].evicted_at = NULL;
+    }
+}
+
+/**
+ * Logs the eviction of a page.  Snapshots have no clusters, as their
+ * pages are never refaulted through them.
+ * Must be called with the pager lock held.
+ */
+void log_eviction(struct address_space *space, int page) {
+    if (space->evicted_at == NULL) return;
+    struct evicted_page *e = &evict_log[evict_seq % evict_log_size];
+    e->space = space;
+    e->page = page;
+    space->evicted_at[page] = ++evict_seq;
+}
+
+/**
+ * Reads the cluster of a refaulted page back, if it is still in the log and
+ * any of its other pages are still out, in one batch with the page itself.
+ * The others are brought into frames without access, and the page is left
+ * staged for the caller to map, after which it has to call unstage.  The
+ * pager lock is dropped during the read.  While clusters are not being read
+ * back, only watches which pages would have been.
+ * Must be called with the pager lock held and fault_space set.
+ */
+void read_cluster(struct page_table *pt, int page) {
+    struct address_space *space = fault_space;
+    int mates[CLUSTER_PAGES], blocks[CLUSTER_PAGES];
+    long long evicted[CLUSTER_PAGES];
+    char *data[CLUSTER_PAGES];
+    int frame, bits;
+
+    if (space->evicted_at == NULL || space->evicted_at[page] == 0) return;
+    long long seq = space->evicted_at[page] - 1;
+    long long first = seq - seq % CLUSTER_PAGES;
+    if (evict_seq - first > evict_log_size || !needs_read(space, page)) return;
+
+    int n = cluster_mates(space, page, first, mates, evicted);
+    if (!clustering) {
+        watch_cluster(first, n);
+        return;
+    }
+    if (n == 0) return;
+
+    struct cluster *c = malloc(sizeof(struct cluster));
+    char *buffer = c != NULL ? malloc((size_t) (n + 1) * args.page_size) : NULL;
+    if (buffer == NULL) {
+        printf("Warning: could not allocate space for a cluster!\n");
+        exit(1);
+    }
+    c->space = space;
+    c->n = n + 1;
+    c->writebacks = -1;
+    c->data = buffer;
+    c->pages[0] = page;
+    c->evicted[0] = seq;
+    memcpy(&c->pages[1], mates, n * sizeof(int));
+    memcpy(&c->evicted[1], evicted, n * sizeof(long long));
+    for (int i = 0; i < c->n; ++i) {
+        blocks[i] = space->base + c->pages[i];
+        data[i] = &c->data[(size_t) i * args.page_size];
+    }
+
+    // Nothing holds a frame for the pages meanwhile; staged_page sees
+    // whether any of them were evicted again before they are copied in
+    pthread_mutex_unlock(&pager_lock);
+    disk_read_batch(disk, blocks, data, c->n);
+    pthread_mutex_lock(&pager_lock);
+    stats.disk_reads += c->n;
+    ++cluster_reads;
+
+    staged = c;
+    for (int i = 1; i < c->n; ++i) {
+        int mate = c->pages[i];
+        if (!needs_read(space, mate) || staged_page(space, mate) == NULL) continue;
+        fault_space = space;
+        map_page(pt, mate);
+        page_table_get_entry(pt, mate, &frame, &bits);
+        if (!bits || SPACE(frame) != space || PAGE(frame) != mate) continue;
+        page_table_set_entry(pt, mate, frame, PROT_NONE);
+        frame_table[frame].speculative = 1;
+        ++nspeculative;
+        ++cluster_pages;
+    }
+    fault_space = space;
+}
+
+/**
+ * Collects the pages of a space other than page that were evicted in the
+ * cluster starting at eviction first, are still out since and would have to
+ * be read from disk, as many as may be read ahead.  Returns how many.
+ * Must be called with the pager lock held.
+ */
+int cluster_mates(struct address_space *space, int page, long long first, int *mates, long long *evicted) {
+    int window = readahead_window();
+    int n = 0;
+
+    for (long long seq = first; seq < first + CLUSTER_PAGES && seq < evict_seq && n < window; ++seq) {
+        struct evicted_page *e = &evict_log[seq % evict_log_size];
+        if (e->space != space || e->page == page || space->evicted_at[e->page] != seq + 1) continue;
+        if (!needs_read(space, e->page)) continue;
+        mates[n] = e->page;
+        evicted[n++] = seq;
+    }
+    return n;
+}
+
+/**
+ * Whether bringing a page of a space in would take a disk read: it is in
+ * no frame, its copy is the space's own, and it was written out to disk.
+ * Must be called with the pager lock held.
+ */
+int needs_read(struct address_space *space, int page) {
+    int frame, bits;
+    page_table_get_entry(space->pt, page, &frame, &bits);
+    if (bits || (FREE(frame) && SPACE(frame) == space && PAGE(frame) == page)) return 0;
+    return owns(space, page) && !(ADVICE(space, page) & ADVICE_DISCARDED) &&
+           (space->swapped == NULL || space->swapped[page]);
+}
+
+/**
+ * Counts the pages a refault would have read back, and the refault as a hit
+ * if it is of one of the pages another refault of the same cluster would
+ * have, soon enough that it would likely still have been in its frame.
+ * Reading clusters back is switched on again at the end of a window in which
+ * half of them would have been hits, the window growing by CLUSTER_WINDOW
+ * pages every time it was switched off.
+ * Must be called with the pager lock held.
+ */
+void watch_cluster(long long first, int n) {
+    struct ghost_cluster *g = &ghosts[first / CLUSTER_PAGES % (evict_log_size / CLUSTER_PAGES)];
+
+    if (g->first == first + 1) {
+        if (g->left > 0 && evict_seq - g->opened < args.nframes) {
+            --g->left;
+            ++ghost_hits;
+        }
+        return;
+    }
+    if (n == 0) return;
+    g->first = first + 1;
+    g->opened = evict_seq;
+    g->left = n;
+    ghost_reads += n;
+    // Each time reading them back had to be switched off, it takes longer to come back
+    if (ghost_reads < CLUSTER_WINDOW * cluster_offs) return;
+
+    if (ghost_hits * 2 >= ghost_reads) {
+        printf("Clusters: on after %d faults, %d of %d pages would have been hits\n", total_faults(),
+            ghost_hits, ghost_reads);
+        clustering = 1;
+        ++cluster_ons;
+    }
+    ghost_reads = ghost_hits = 0;
+}
+
+/**
+ * The data a page was read back with in the cluster being brought in, or
+ * NULL if it is not in it, or was brought in and evicted or dropped again
+ * since the cluster was read.  Pages read ahead are only trusted while none
+ * of their space has been written out since.
+ * Must be called with the pager lock held.
+ */
+char * staged_page(struct address_space *space, int page) {
+    if (staged->space != space || (ADVICE(space, page) & ADVICE_DISCARDED)) return NULL;
+    if (staged->writebacks >= 0 && staged->writebacks != space->writebacks) return NULL;
+    for (int i = 0; i < staged->n; ++i) {
+        if (staged->pages[i] == page) {
+            if (staged->writebacks < 0 && space->evicted_at[page] != staged->evicted[i] + 1) return NULL;
+            return &staged->data[(size_t) i * args.page_size];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Keeps the pages read ahead by this thread trusted across its own
+ * writebacks, which are never of a page it is still to copy in, unless
+ * another thread brought that one in meanwhile; so that one is dropped.
+ * Must be called with the pager lock held.
+ */
+void staged_writeback(struct address_space *space, int page) {
+    if (staged->writebacks < 0 || staged->space != space) return;
+    ++staged->writebacks;
+    for (int i = 0; i < staged->n; ++i) {
+        if (staged->pages[i] == page) staged->pages[i] = -1;
+    }
+}
+
+/**
+ * Frees the cluster or the pages read ahead brought in by this thread.
+ */
+void unstage() {
+    free(staged->data);
+    free(staged);
+    staged = NULL;
+}
+
+/**
+ * Gives a page read back with a cluster its access.  A reference to it
+ * counts as a hit, while mapping it for any other reason, like fault-around
+ * or a hint, only settles it.  Returns 1 if it handled the fault, or 0 to
+ * leave it to the policy, which is also what becomes of pages on the 2FIFO
+ * second-chance list.
+ * Must be called with the pager lock held and fault_space set.
+ */
+int claim_speculative(struct page_table *pt, int page, int referenced) {
+    int frame, bits;
+
+    page_table_get_entry(pt, page, &frame, &bits);
+    if (bits || !FREE(frame) || BUSY(frame) || SPACE(frame) != fault_space || PAGE(frame) != page ||
+        !frame_table[frame].speculative) {
+        return 0;
+    }
+    unspeculate(frame);
+    if (referenced) cluster_outcome(1);
+    if (frame_table[frame].f_list == 2) return 0;
+    page_table_set_entry(pt, page, frame, BITS(frame));
+    return 1;
+}
+
+void unspeculate(int frame_index) {
+    frame_table[frame_index].speculative = 0;
+    --nspeculative;
+}
+
+/**
+ * Counts a page read back with a cluster as a hit or as wasted, and switches
+ * reading clusters back off at the end of a window with fewer hits than
+ * pages wasted.
+ * Must be called with the pager lock held.
+ */
+void cluster_outcome(int hit) {
+    if (hit) {
+        ++cluster_hits;
+        ++window_hits;
+    } else {
+        ++cluster_wasted;
+        ++window_wasted;
+    }
+    if (window_hits + window_wasted < CLUSTER_WINDOW) return;
+
+    if (clustering && window_hits < window_wasted) {
+        printf("Clusters: off after %d faults, %d of %d pages were hits\n", total_faults(),
+            window_hits, window_hits + window_wasted);
+        clustering = 0;
+        ++cluster_offs;
+        ghost_reads = ghost_hits = 0;
+    }
+    window_hits = window_wasted = 0;
+}
+
+/**
+ * Grows or shrinks the frame pool to nframes frames while the programs run.
+ * Returns 0, or -1 if there would be fewer frames than address spaces or
+ * not enough to keep the pinned pages under half of them.
+ */
+int resize_frames(int nframes, int *evicted, int *moved) {
+    struct page_table *pt = spaces[0].pt;
+    int old = args.nframes;
+
+    *evicted = *moved = 0;
+    pthread_mutex_lock(&pager_lock);
+
+    // Pages being read in hold frames that may have to move, and the physical
+    // memory must stay put while they are
+    while (wait_for_frame()) ;
+
+    if (nframes < nspaces || npinned > nframes / 2) {
+        pthread_mutex_unlock(&pager_lock);
+        return -1;
+    }
+
+    if (nframes < old) {
+        int used = 0;
+        for (int i = 0; i < old; ++i) {
+            if (FREE(i)) ++used;
+        }
+
+        // Evict through the active policy until the pages in frames fit,
+        // writing the dirty ones out together before any frame is reused
+        victim_space = NULL;
+        defer_writebacks(used - nframes);
+        for (; used > nframes; --used, ++*evicted) {
+            int frame_index = policy_victim();
+            evict(frame_index);
+            release_frame(frame_index);
+        }
+        page_table_flush_updates();
+        flush_writebacks();
+
+        // Move the pages left beyond the new size down into free frames
+        for (int from = nframes, to = 0; from < old; ++from) {
+            if (!FREE(from)) continue;
+            while (FREE(to)) ++to;
+            move_frame(from, to);
+            ++*moved;
+        }
+    }
+
+    if (page_table_resize(pt, nframes) < 0) {
+        fprintf(stderr, "couldn't resize physical memory: %s\n", strerror(errno));
+        exit(1);
+    }
+    physmem = page_table_get_physmem(pt);
+    rebuild_frame_table(nframes);
+
+    args.nframes = nframes;
+    frame_pool_destroy();
+    frame_pool_init(nframes);
+    split_lists(args.nframes);
+    if (fault_policy == TWO_FIFO) sfo_trim();
+    if (adaptive) {
+        // The shadows start over at the new size
+        adaptive_destroy();
+        adaptive_init();
+    }
+
+    for (int i = 0; i < nspaces; ++i) {
+        if (args.fault_around > 1) {
+            page_table_set_fault_around(spaces[i].pt, fault_around_group(), page_fault_around_handler);
+        }
+    }
+    if (nspaces > 1) rebalance_quotas();
+    if (stats_export != NULL) export_stats(0);
+
+    pthread_cond_broadcast(&frame_cond);
+    pthread_mutex_unlock(&pager_lock);
+    return 0;
+}
+
+/**
+ * Picks the frame the active policy would evict next and takes it off the
+ * policy lists.  There must be a page in a frame that is not pinned.
+ */
+int policy_victim() {
+    int frame_index = -1;
+    switch (fault_policy) {
+        case RAND:
+            // Unlike on a fault, some frames may be free
+            do {
+                frame_index = (int) lrand48() % args.nframes;
+            } while (!FREE(frame_index) || page_is_pinned(&frame_table[frame_index]) ||
+                     frame_table[frame_index].probation);
+            break;
+        case FIFO:
+            frame_index = fifo_remove();
+            break;
+        case TWO_FIFO:
+            frame_index = FRAMEID(sfo_victim());
+            unlist_frame(frame_index);
+            break;
+        case CUSTOM:
+            if ((frame_index = find_clean_frame(args.nframes)) < 0) frame_index = fifo_remove();
+            break;
+        case GREEDY:
+            frame_index = greedy_remove();
+            break;
+    }
+    return frame_index;
+}
+
+/**
+ * Moves the page in one frame into another, free one.  The page keeps its
+ * access bits and its place in whichever policy list held it.
+ */
+void move_frame(int from, int to) {
+    f_node * src = &frame_table[from];
+    f_node * dst = &frame_table[to];
+    struct page_table *pt = src->space->pt;
+    int frame, bits;
+
+    // Take access away first so the page cannot change while it is copied
+    page_table_get_entry(pt, src->page, &frame, &bits);
+    page_table_set_entry(pt, src->page, from, PROT_NONE);
+    page_table_flush_updates();
+    memcpy(&physmem[(size_t)to * args.page_size], &physmem[(size_t)from * args.page_size], args.page_size);
+
+    *dst = *src;
+    if (dst->f_list) {
+        if (dst->prev != NULL) dst->prev->next = dst;
+        if (dst->next != NULL) dst->next->prev = dst;
+        if (fifo_head == src) fifo_head = dst;
+        if (fifo_tail == src) fifo_tail = dst;
+        if (ff_head == src) ff_head = dst;
+        if (ff_tail == src) ff_tail = dst;
+        if (sf_head == src) sf_head = dst;
+        if (sf_tail == src) sf_tail = dst;
+        if (fault_policy == GREEDY) greedy_heap[dst->heap_pos] = to;
+    }
+    memset(src, 0, sizeof(f_node));
+
+    page_table_set_entry(pt, dst->page, to, bits);
+    page_table_flush_updates();
+}
+
+/**
+ * Reallocates the frame table for nframes frames, keeping the nodes of the
+ * frames that remain and pointing the policy lists at their new place.
+ */
+void rebuild_frame_table(int nframes) {
+    f_node * table = calloc(nframes, sizeof(f_node));
+    int keep = nframes < args.nframes ? nframes : args.nframes;
+
+    if (table == NULL) {
+        printf("Warning: could not allocate space for frame database!\n");
+        exit(1);
+    }
+    #define REBASE(p) ((p) != NULL ? table + ((p) - frame_table) : NULL)
+    memcpy(table, frame_table, keep * sizeof(f_node));
+    for (int i = 0; i < keep; ++i) {
+        if (table[i].f_list) {
+            table[i].next = REBASE(table[i].next);
+            table[i].prev = REBASE(table[i].prev);
+        } else {
+            table[i].next = table[i].prev = NULL;
+        }
+    }
+    fifo_head = REBASE(fifo_head);
+    fifo_tail = REBASE(fifo_tail);
+    ff_head = REBASE(ff_head);
+    ff_tail = ff_head != NULL ? REBASE(ff_tail) : NULL;
+    sf_head = REBASE(sf_head);
+    sf_tail = sf_head != NULL ? REBASE(sf_tail) : NULL;
+    #undef REBASE
+
+    free(frame_table);
+    frame_table = table;
+    if (greedy_heap != NULL) greedy_heap = realloc(greedy_heap, nframes * sizeof(int));
+}
+
+/**
+ * Driver thread taking the steps of the resize schedule as their time comes,
+ * until the programs end.
+ */
+void * balloon_driver(void *arg) {
+    struct timespec start;
+    (void) arg;
+
+    register_thread();
+    clock_gettime(CLOCK_REALTIME, &start);
+    pthread_mutex_lock(&balloon_lock);
+    for (int i = 1; i <= nresizes; ++i) {
+        struct timespec deadline = start;
+        deadline.tv_sec += schedule[i].at_ms / 1000;
+        deadline.tv_nsec += (long) (schedule[i].at_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (!balloon_stop && pthread_cond_timedwait(&balloon_cond, &balloon_lock, &deadline) != ETIMEDOUT) ;
+        if (balloon_stop) break;
+
+        pthread_mutex_unlock(&balloon_lock);
+        take_step(i);
+        pthread_mutex_lock(&balloon_lock);
+    }
+    pthread_mutex_unlock(&balloon_lock);
+    return NULL;
+}
+
+/**
+ * Resizes to the frames of a step of the schedule, noting when it was taken
+ * and how many faults came before it.
+ */
+void take_step(int i) {
+    struct resize_step *step = &schedule[i];
+
+    if (i == 0) {
+        step->nframes = args.nframes;
+    } else if (resize_frames(step->nframes, &step->evicted, &step->moved) < 0) {
+        step->failed = 1;
+    }
+    pthread_mutex_lock(&pager_lock);
+    step->reached = 1;
+    step->started = balloon_clock();
+    step->faults_at = total_faults();
+    pthread_mutex_unlock(&pager_lock);
+}
+
+/**
+ * Faults taken by all address spaces so far.  Must be called with the pager lock held.
+ */
+int total_faults() {
+    int faults = 0;
+    for (int i = 0; i < nspaces; ++i) {
+        faults += spaces[i].total_faults;
+    }
+    return faults;
+}
+
+/**
+ * Seconds since the programs started.
+ */
+double balloon_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - balloon_start.tv_sec) + (now.tv_nsec - balloon_start.tv_nsec) / 1e9;
+}
+
+/**
+ * Prints the fault rate over every step of the resize schedule that was taken.
+ */
+void print_balloon() {
+    printf("\n%8s %8s %8s %10s %8s %8s\n", "at (ms)", "frames", "flt", "flt/ms", "evicted", "moved");
+    for (int i = 0; i <= nresizes; ++i) {
+        struct resize_step *step = &schedule[i];
+        if (!step->reached) {
+            printf("%8d %8d %8s\n", step->at_ms, step->nframes, "-");
+            continue;
+        }
+
+        // A step lasts until the next one that was taken, or the end
+        double until = balloon_ended;
+        int faults = balloon_faults;
+        if (i < nresizes && schedule[i + 1].reached) {
+            until = schedule[i + 1].started;
+            faults = schedule[i + 1].faults_at;
+        }
+        faults -= step->faults_at;
+        double ms = (until - step->started) * 1000;
+        if (step->failed) {
+            printf("%8d %8s %8d %10.2f %8s %8s\n", step->at_ms, "failed", faults,
+                ms > 0 ? faults / ms : 0.0, "-", "-");
+        } else {
+            printf("%8d %8d %8d %10.2f %8d %8d\n", step->at_ms, step->nframes, faults,
+                ms > 0 ? faults / ms : 0.0, step->evicted, step->moved);
+        }
+    }
+}
+
+/**
+ * Sets up a shadow of every candidate policy.  Pages are sampled more
+ * sparsely as long as each shadow still simulates no fewer than
+ * ADAPTIVE_SHADOW_FRAMES frames.
+ */
+void adaptive_init() {
+    shadow_sample = ADAPTIVE_MIN_SAMPLE;
+    while (shadow_sample < ADAPTIVE_MAX_SAMPLE && args.nframes / (shadow_sample * 2) >= ADAPTIVE_SHADOW_FRAMES) {
+        shadow_sample *= 2;
+    }
+    int shadow_frames = args.nframes / shadow_sample > 0 ? args.nframes / shadow_sample : 1;
+    int streams = nspaces * (args.nthreads > 0 ? args.nthreads : 1);
+    ntracked = shadow_frames + ADAPTIVE_TRACKED * streams;
+    tracked = calloc(ntracked, sizeof(struct tracked_page));
+    if (tracked == NULL) {
+        printf("Warning: could not allocate space for policy shadows!\n");
+        exit(1);
+    }
+    for (int i = 0; i < SHADOW_POLICIES; ++i) {
+        shadows[i] = shadow_create(i, shadow_frames, 4856 + i);
+        shadow_rates[i] = -1;
+        if (shadows[i] == NULL) {
+            printf("Warning: could not allocate space for policy shadows!\n");
+            exit(1);
+        }
+    }
+    shadow_refs = 0;
+    tracked_next = 0;
+}
+
+void adaptive_destroy() {
+    for (int i = 0; i < SHADOW_POLICIES; ++i) {
+        shadow_delete(shadows[i]);
+        shadows[i] = NULL;
+    }
+    free(tracked);
+    tracked = NULL;
+    ntracked = 0;
+}
+
+/**
+ * Whether a page of the faulting address space is in the sample.
+ */
+int adaptive_sampled(int page) {
+    unsigned long long key = ((unsigned long long) fault_space->id << 32) | (unsigned) page;
+    return (unsigned) ((key * 0x9e3779b97f4a7c15ULL) >> 40) % shadow_sample == 0;
+}
+
+/**
+ * Sees a fault on a sampled page as a reference, then takes access away from
+ * the sampled page it pushes out of the ones referenced last.  Returns 1 if
+ * the fault was only a trap set by that, or the page got its access back
+ * from a switch of policy, and has been dealt with.
+ * Must be called with the pager lock held and fault_space set.
+ */
+int adaptive_trap(struct page_table *pt, int page) {
+    int frame, bits, i;
+
+    // Pages trapped before a resize changed the sample may have left it
+    int trapped = untrap(pt, page);
+    if (!trapped) {
+        // A switch of policy in another thread may have given it its access back
+        page_table_get_entry(pt, page, &frame, &bits);
+        if (bits == (PROT_READ | PROT_WRITE)) return 1;
+    }
+    if (!adaptive_sampled(page)) return trapped;
+    if (trapped) {
+        ++stats.traps;
+        bits = 0;
+    } else {
+        page_table_get_entry(pt, page, &frame, &bits);
+    }
+    adaptive_access(page, bits & PROT_READ);
+    // Switching policies waits for other faults, which may have trapped it again
+    trapped |= untrap(pt, page);
+    if (!bits) {
+        // and gives the pages on the 2FIFO second-chance list their access back
+        page_table_get_entry(pt, page, &frame, &bits);
+        if (bits) trapped = 1;
+    }
+
+    for (i = 0; i < ntracked; i++) {
+        if (tracked[i].space == fault_space && tracked[i].page == page) return trapped;
+    }
+
+    struct tracked_page *old = &tracked[tracked_next];
+    tracked_next = (tracked_next + 1) % ntracked;
+    if (old->space != NULL) {
+        page_table_get_entry(old->space->pt, old->page, &frame, &bits);
+        if (bits && FREE(frame) && !BUSY(frame) && SPACE(frame) == old->space &&
+            PAGE(frame) == old->page && frame_table[frame].f_list != 2) {
+            page_table_set_entry(old->space->pt, old->page, frame, PROT_NONE);
+            frame_table[frame].trapped = 1;
+        }
+    }
+    old->space = fault_space;
+    old->page = page;
+    return trapped;
+}
+
+/**
+ * Gives a page whose access was only taken away to see its next reference
+ * its access back.  Returns 0 if the page was not trapped.
+ * Must be called with the pager lock held and fault_space set.
+ */
+int untrap(struct page_table *pt, int page) {
+    int frame, bits;
+    page_table_get_entry(pt, page, &frame, &bits);
+    if (bits || !FREE(frame) || BUSY(frame) || SPACE(frame) != fault_space || PAGE(frame) != page ||
+        !frame_table[frame].trapped || frame_table[frame].f_list == 2) {
+        return 0;
+    }
+    frame_table[frame].trapped = 0;
+    page_table_set_entry(pt, page, frame, BITS(frame));
+    return 1;
+}
+
+/**
+ * Feeds a reference to a sampled page to the shadows, and decides on the
+ * live policy at the end of each window.
+ * Must be called with the pager lock held and fault_space set.
+ */
+void adaptive_access(int page, int write) {
+    unsigned long long key = ((unsigned long long) fault_space->id << 32) | (unsigned) page;
+
+    for (int i = 0; i < SHADOW_POLICIES; ++i) {
+        shadow_access(shadows[i], key, write);
+    }
+    int window = args.nframes / shadow_sample;
+    if (++shadow_refs >= (window > ADAPTIVE_WINDOW ? window : ADAPTIVE_WINDOW) && !switching) {
+        shadow_refs = 0;
+        adaptive_decide();
+    }
+}
+
+/**
+ * Folds the window just ended into the miss rates, switches the live policy
+ * to the one whose shadow misses least, and logs the rates if it does.
+ */
+void adaptive_decide() {
+    double rates[SHADOW_POLICIES];
+    int best = shadow_of[fault_policy];
+    int live = best;
+
+    // The GreedyDual shadow weighs the pages it takes in from now on by the latencies seen so far
+    shadow_set_costs(shadows[SHADOW_GREEDY], greedy_read_ns, greedy_write_ns);
+
+    for (int i = 0; i < SHADOW_POLICIES; ++i) {
+        long long accesses, misses;
+        shadow_get_counts(shadows[i], &accesses, &misses, 1);
+        shadow_accesses[i] += accesses;
+        shadow_misses[i] += misses;
+        rates[i] = accesses > 0 ? (double) misses / accesses : 0.0;
+        if (shadow_rates[i] >= 0) rates[i] = (rates[i] + shadow_rates[i]) / 2;
+        shadow_rates[i] = rates[i];
+    }
+    for (int i = 0; i < SHADOW_POLICIES; ++i) {
+        if (rates[i] < rates[best]) best = i;
+    }
+    if (best == live || rates[best] >= rates[live] * (1 - ADAPTIVE_MARGIN)) return;
+
+    printf("Adaptive: %s -> %s after %d faults, miss rates", shadow_policy_name(live),
+        shadow_policy_name(best), total_faults());
+    for (int i = 0; i < SHADOW_POLICIES; ++i) {
+        printf(" %s(%.3f)", shadow_policy_name(i), rates[i]);
+    }
+    printf("\n");
+    switch_policy(policy_of[best]);
+}
+
+/**
+ * Hands every page in a frame over from the live policy to another one,
+ * oldest first so that the new policy sees them in the same order.
+ * Must be called with the pager lock held and fault_space set.
+ */
+void switch_policy(enum policy_e to) {
+    struct address_space *space = fault_space;
+    int *frames = malloc(args.nframes * sizeof(int));
+    int n = 0;
+    f_node * node;
+
+    // Handlers that dropped the lock to read a page in finish under the old policy
+    switching = 1;
+    while (wait_for_frame()) ;
+    switching = 0;
+    fault_space = space;
+
+    switch (fault_policy) {
+        case FIFO:
+        case CUSTOM:
+            for (node = fifo_head; node != NULL; node = node->prev) frames[n++] = FRAMEID(node);
+            break;
+        case TWO_FIFO:
+            for (node = sf_head; node != NULL; node = node->next) frames[n++] = FRAMEID(node);
+            for (node = ff_head; node != NULL; node = node->next) frames[n++] = FRAMEID(node);
+            break;
+        case RAND:
+            for (int i = 0; i < args.nframes; ++i) {
+                if (FREE(i) && !page_is_pinned(&frame_table[i]) && !frame_table[i].probation) frames[n++] = i;
+            }
+            break;
+        case GREEDY:
+            for (int i = 0; i < greedy_size; ++i) frames[n++] = greedy_heap[i];
+            break;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        node = &frame_table[frames[i]];
+        // Pages on the second-chance list get their access back
+        if (node->f_list == 2) {
+            page_table_set_entry(node->space->pt, node->page, frames[i], node->bits);
+            node->trapped = 0;
+            if (node->speculative) unspeculate(frames[i]);
+        }
+        node->f_list = 0;
+        node->next = node->prev = NULL;
+    }
+    fifo_head = fifo_tail = NULL;
+    ff_head = ff_tail = sf_head = sf_tail = NULL;
+    f_entries = s_entries = 0;
+    greedy_size = 0;
+
+    fault_policy = to;
+    for (int i = 0; i < n; ++i) {
+        switch (to) {
+            case FIFO:
+            case CUSTOM:   fifo_insert(frames[i]);             break;
+            case TWO_FIFO: sfo_insert(&frame_table[frames[i]]); break;
+            case GREEDY:   greedy_insert(frames[i]);           break;
+            case RAND:     break;
+        }
+    }
+    ++policy_switches;
+    free(frames);
+}
+
+/**
+ * Find the address space a page table belongs to.
+ */
+struct address_space * space_of(struct page_table *pt) {
+    for (int i = 0; i < nspaces; ++i) {
+        if (spaces[i].pt == pt) return &spaces[i];
+    }
+    printf("unknown page table %p\n", (void *) pt);
+    exit(1);
+}
+
+/**
+ * Count a fault against the faulting address space, and redistribute the
+ * quotas once per window of nframes faults.
+ */
+void account_fault(int page) {
+    ++fault_space->faults;
+    ++fault_space->total_faults;
+    if (fault_space->touched && !fault_space->touched[page]) {
+        fault_space->touched[page] = 1;
+        ++fault_space->wss;
+    }
+    if (++window_faults >= args.nframes && nspaces > 1) {
+        rebalance_quotas();
+    }
+}
+
+/**
+ * Decide which address space gives up a frame if this fault needs one.
+ * Global replacement does not care.  Under local replacement a space that
+ * is at its quota replaces its own pages; otherwise the frame comes from
+ * whichever space is furthest over its quota.
+ */
+struct address_space * choose_victim_space() {
+    if (replacement_scope == GLOBAL || nspaces == 1) return NULL;
+    if (fault_space->resident >= fault_space->quota) return fault_space;
+
+    struct address_space *victim = NULL;
+    for (int i = 0; i < nspaces; ++i) {
+        struct address_space *space = &spaces[i];
+        if (space->resident > space->quota &&
+            (victim == NULL || space->resident - space->quota > victim->resident - victim->quota)) {
+            victim = space;
+        }
+    }
+    return victim;
+}
+
+/**
+ * Share the frames out between the address spaces according to the
+ * allocation policy, and start a new window.  Every space gets at least one
+ * frame; frames move lazily, as spaces under their quota take frames from
+ * the ones over it.
+ *   equal: the same share for everyone
+ *   wss:   in proportion to the distinct pages touched in the last window
+ *   pff:   in proportion to the page fault rate over the last window
+ */
+void rebalance_quotas() {
+    long long demand[MAX_SPACES];
+    long long total = 0;
+    int i, given = 0;
+
+    for (i = 0; i < nspaces; ++i) {
+        switch (alloc_policy) {
+            case ALLOC_EQUAL: demand[i] = 1; break;
+            case ALLOC_WSS:   demand[i] = spaces[i].wss + 1; break;
+            case ALLOC_PFF:   demand[i] = spaces[i].faults + 1; break;
+        }
+        total += demand[i];
+    }
+
+    int spare = args.nframes - nspaces;
+    for (i = 0; i < nspaces; ++i) {
+        spaces[i].quota = 1 + (int) (spare * demand[i] / total);
+        given += spaces[i].quota;
+    }
+    // Rounding leftovers go round-robin
+    for (i = 0; given < args.nframes; i = (i + 1) % nspaces, ++given) {
+        ++spaces[i].quota;
+    }
+
+    for (i = 0; i < nspaces; ++i) {
+        spaces[i].faults = 0;
+        spaces[i].wss = 0;
+        if (spaces[i].touched) memset(spaces[i].touched, 0, args.npages);
+    }
+    window_faults = 0;
+}
+
+/**
+ * Prints per address space fault counts and frame usage.
+ */
+void print_spaces() {
+    for (int i = 0; i < nspaces; ++i) {
+        printf("space %d (%s): flt(%d) resident(%d) quota(%d)", spaces[i].id,
+            spaces[i].program, spaces[i].total_faults, spaces[i].resident, spaces[i].quota);
+        if (spaces[i].clone_of >= 0) printf(" clone of %d", spaces[i].clone_of);
+        printf("\n");
+    }
+    for (int i = 0; i < nsnapshots; ++i) {
+        printf("snapshot %d of space %d: resident(%d)\n", i, snapshots[i].clone_of, snapshots[i].resident);
+    }
+}
+
+/**
+ * Advances the heat clock by a fault, sampling a row of every heatmap when
+ * an interval is up.
+ * Must be called with the pager lock held.
+ */
+void heat_tick() {
+    if (++heat_now % args.heat_interval != 0) return;
+    for (int i = 0; i < nspaces; ++i) heat_sample(spaces[i].heat);
+}
+
+/**
+ * Prints the heat report of every address space.
+ */
+void print_heat() {
+    for (int i = 0; i < nspaces; ++i) {
+        printf("\nHeat of space %d (%s), %u faults:\n", spaces[i].id, spaces[i].program, heat_now);
+        heat_print(spaces[i].heat, heat_now);
+    }
+}
+
+/**
+ * Adds the calling thread's statistics into total_stats and clears them.
+ * Also runs automatically when a thread that took page faults exits.
+ */
+void merge_stats() {
+    pthread_mutex_lock(&stats_lock);
+    total_stats.page_faults += stats.page_faults;
+    total_stats.disk_reads  += stats.disk_reads;
+    total_stats.disk_writes += stats.disk_writes;
+    total_stats.evictions   += stats.evictions;
+    total_stats.fault_arounds += stats.fault_arounds;
+    total_stats.readaheads  += stats.readaheads;
+    total_stats.discards    += stats.discards;
+    total_stats.traps       += stats.traps;
+    total_stats.restores    += stats.restores;
+    pthread_mutex_unlock(&stats_lock);
+    if (stats_export != NULL) export_counters();
+    memset(&stats, 0, sizeof(struct stats));
+    memset(&published, 0, sizeof(struct stats));
+}
+
+/**
+ * Nanoseconds on the monotonic clock.
+ */
+long long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Publishes what the calling thread has counted since it last did, and how
+ * long the fault that started at start took unless start is 0.  Rescans the
+ * frames if the last scan is old enough.
+ * Must be called with the pager lock held.
+ */
+void export_stats(long long start) {
+    long long now = now_ns();
+    stats_shm_begin(stats_export);
+    export_counters_locked();
+    if (start != 0) ++stats_export->latency[stats_shm_bucket(now - start)];
+    if (now - export_scanned >= EXPORT_SCAN_NS) export_scan(now);
+    stats_export->updated_ns = now;
+    stats_shm_end(stats_export);
+}
+
+/**
+ * Publishes what the calling thread has counted since it last did.  Needs no
+ * lock, as merging the stats of an exiting thread does not take one.
+ */
+void export_counters() {
+    stats_shm_begin(stats_export);
+    export_counters_locked();
+    stats_shm_end(stats_export);
+}
+
+/**
+ * Adds the calling thread's counts since it last published into the segment.
+ * Must be called inside an update of the segment.
+ */
+void export_counters_locked() {
+    #define PUBLISH(field) stats_export->field += stats.field - published.field
+    PUBLISH(page_faults);
+    PUBLISH(disk_reads);
+    PUBLISH(disk_writes);
+    PUBLISH(evictions);
+    PUBLISH(fault_arounds);
+    PUBLISH(readaheads);
+    PUBLISH(discards);
+    PUBLISH(traps);
+    #undef PUBLISH
+    published = stats;
+}
+
+/**
+ * Records the state of the frames and of the live policy's lists.
+ * Must be called with the pager lock held, inside an update of the segment.
+ */
+void export_scan(long long now) {
+    int used = 0, dirty = 0, listed = 0;
+
+    for (int i = 0; i < args.nframes; ++i) {
+        if (!FREE(i)) continue;
+        ++used;
+        if (BITS(i) & PROT_WRITE) ++dirty;
+    }
+    for (f_node * node = fifo_head; node != NULL; node = node->prev) ++listed;
+    if (fault_policy == GREEDY) listed = greedy_size;
+
+    snprintf(stats_export->policy, sizeof(stats_export->policy), "%s",
+        adaptive ? shadow_policy_name(shadow_of[fault_policy]) : args.policy);
+    stats_export->adaptive = adaptive;
+    stats_export->nframes = args.nframes;
+    stats_export->nthreads = nthreads_seen;
+    stats_export->free_frames = args.nframes - used;
+    stats_export->busy_frames = nbusy;
+    stats_export->pinned_frames = npinned;
+    stats_export->dirty_frames = dirty;
+    stats_export->first_list = fault_policy == TWO_FIFO ? f_entries : listed;
+    stats_export->second_list = fault_policy == TWO_FIFO ? s_entries : 0;
+    stats_export->scanned_ns = now;
+    export_scanned = now;
+}
+
+/**
+ * Publishes the final counts and state, and marks the run as over.
+ */
+void export_finish() {
+    pthread_mutex_lock(&pager_lock);
+    export_scanned = 0;
+    export_stats(0);
+    stats_shm_begin(stats_export);
+    stats_export->running = 0;
+    stats_shm_end(stats_export);
+    pthread_mutex_unlock(&pager_lock);
+}
+
+/**
+ * Prints some statistics in a slightly understandable manner.
+ */
+void print_stats() {
+    printf("\nStatistics:  flt(%d) rd(%d) wr(%d) ev(%d)\n",
+        total_stats.page_faults, total_stats.disk_reads, total_stats.disk_writes, total_stats.evictions);
+    if (args.fault_around > 1) printf("Fault-around: mapped(%d)\n", total_stats.fault_arounds);
+    if (args.hints) printf("Hints:       readahead(%d) dropped(%d)\n", total_stats.readaheads, total_stats.discards);
+    if (adaptive) {
+        printf("Adaptive:    live(%s) switches(%d) traps(%d) miss rates", shadow_policy_name(shadow_of[fault_policy]),
+            policy_switches, total_stats.traps);
+        for (int i = 0; i < SHADOW_POLICIES; ++i) {
+            // Including the window still open
+            long long accesses, misses;
+            shadow_get_counts(shadows[i], &accesses, &misses, 0);
+            accesses += shadow_accesses[i];
+            misses += shadow_misses[i];
+            printf(" %s(%.3f)", shadow_policy_name(i), accesses > 0 ? (double) misses / accesses : 0.0);
+        }
+        printf("\n");
+    }
+    if (admission != NULL) {
+        printf("Admission:   admitted(%d) rejected(%d) probation frames(%d)\n", admitted, rejected, nprobation);
+    }
+    if (nclones > 0) {
+        printf("Clones:      taken(%d) in(%.1f us) snapshots(%d) shared(%d) copied(%d) handed over(%d)\n",
+            clones_taken, clone_ns / 1000.0, nsnapshots, cow_shared, cow_copied, cow_handed);
+    }
+    if (args.restart != NULL) {
+        printf("Restart:     frames(%d) in(%.1f us) copied in on access(%d) to write back(%d) dropped(%d) "
+            "untouched(%d)\n", nrestarted, restart_ns / 1000.0, total_stats.restores, restart_written,
+            restart_dropped, npending);
+    }
+    if (args.cluster) {
+        printf("Clusters:    read(%d) pages(%d) hits(%d) wasted(%d) switched off(%d) on(%d)\n", cluster_reads,
+            cluster_pages, cluster_hits, cluster_wasted, cluster_offs, cluster_ons);
+    }
+    if (fault_policy == GREEDY) {
+        printf("GreedyDual:  read(%.1f us) write(%.1f us) inflation(%.1f us)\n", greedy_read_ns / 1000,
+            greedy_write_ns / 1000, greedy_inflation / 1000);
+    }
+
+    long long remaps, mprotects;
+    page_table_get_syscalls(&remaps, &mprotects);
+    printf("Syscalls:    remap(%lld) mprotect(%lld) per fault(%.2f)\n", remaps, mprotects,
+        total_stats.page_faults > 0 ? (double) (remaps + mprotects) / total_stats.page_faults : 0.0);
 }
 
 /**
@@ -672,6 +4000,6 @@ void print_stats() {
  */
 void graph_stats() {
     //NUMPAGES NUMFRAMES FAULTS READS WRITES EVICTIONS
-    printf("%i %i %i %i %i %i\n", args.npages, args.nframes, stats.page_faults, stats.disk_reads, stats.disk_writes, stats.evictions);
+    printf("%i %i %i %i %i %i\n", args.npages, args.nframes, total_stats.page_faults, total_stats.disk_reads, total_stats.disk_writes, total_stats.evictions);
 }
 
@@ -0,0 +1,41 @@
+
+#ifndef MEMSERVER_H
+#define MEMSERVER_H
+
+/*
+The protocol between a remote-memory disk (see disk_open_remote) and the
+memory server holding its blocks, virtmem-memserver, over a Unix stream
+socket.  The client opens with a hello giving the size of the disk, which
+the server answers with a reply.  From then on it sends requests back to
+back without waiting, a write followed by its block, and the server
+answers every request in the order they came, the reply to a read followed
+by its block.  So any number of requests may be outstanding, and a batch
+of them can go out in one write and come back in one.  Everything is in
+native byte order, as both ends run on one machine.
+*/
+
+#define MEMSERVER_MAGIC   0x766d6d73
+#define MEMSERVER_VERSION 1
+
+#define MEMSERVER_READ  0
+#define MEMSERVER_WRITE 1
+
+struct memserver_hello {
+	unsigned magic;
+	unsigned version;
+	int block_size;
+	int nblocks;
+};
+
+struct memserver_request {
+	int op;
+	int block;
+	unsigned tag;		/* Echoed in the reply, as a check on the order */
+};
+
+struct memserver_reply {
+	unsigned tag;
+	int status;		/* 0, or an errno value saying why the request failed */
+};
+
+#endif
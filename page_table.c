@@ -1,31 +1,231 @@
 /*
-Do not modify this file.
-Make all of your changes to main.c instead.
+The page tables: virtual memory backed by a shared pool of frames, with
+faults delivered through SIGSEGV or the software access path, and the
+updates to the mapping batched.  See page_table.h.
 */
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <limits.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <ucontext.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
 
 #include "page_table.h"
 
+/*
+Faults are serialized per page through a fixed table of locks, hashed by page
+number, so that concurrent faults on the same page are handled only once.
+*/
+
+#define PAGE_TABLE_FAULT_LOCKS 1024
+
+/*
+Several page tables may share one physical memory.  The first one created
+owns it ("pool" points to itself); the others point at the owner.  Faults
+are dispatched to whichever page table covers the faulting address.
+*/
+
+#define PAGE_TABLE_MAX 64
+
+/*
+Entries are packed into 32 bits, the access bits and flags in the low byte
+and the frame number above them.  They are kept in a three level radix tree indexed
+by page number: a directory allocated along with the page table, and interior
+and leaf nodes allocated only when an entry in their range is first set.
+Entries that were never set read as frame 0 with no access, so the cost of
+a page table is proportional to the pages actually touched.
+*/
+
+typedef uint32_t pte_t;
+
+#define PTE_BITS_MASK   0x07
+#define PTE_MAPPED      0x80    // The page is remapped to the frame in its entry
+#define PTE_FRAME_SHIFT 8
+#define PTE_MAX_FRAMES  (1<<(32-PTE_FRAME_SHIFT))
+
+#define PT_LEAF_SHIFT 9
+#define PT_LEAF_SIZE  (1<<PT_LEAF_SHIFT)
+#define PT_NODE_SHIFT 9
+#define PT_NODE_SIZE  (1<<PT_NODE_SHIFT)
+#define PT_DIR_SHIFT  (PT_LEAF_SHIFT+PT_NODE_SHIFT)
+
+struct pt_leaf {
+	pte_t entries[PT_LEAF_SIZE];
+};
+
+struct pt_node {
+	struct pt_leaf *leaves[PT_NODE_SIZE];
+};
+
 struct page_table {
 	int fd;
+	int page_size;
 	char *virtmem;
 	int npages;
 	char *physmem;
 	int nframes;
-	int *page_mapping;
-	int *page_bits;
+	struct pt_node **dir;
+	int ndir;
 	page_fault_handler_t handler;
+	int around;
+	page_fault_handler_t around_handler;
+	page_advice_handler_t advice_handler;
+	struct page_table *pool;
+	int nmapped;		/* Distinct frames with access, counted in the pool */
+	int *frame_maps;	/* Pages with access to each frame, in the pool */
+	unsigned tlb_gen;
+	pthread_mutex_t fault_locks[PAGE_TABLE_FAULT_LOCKS];
 };
 
-struct page_table *the_page_table = 0;
+static struct page_table *page_tables[PAGE_TABLE_MAX];
+
+/*
+Updates to entries may be deferred and applied together, so that runs of
+neighbouring pages cost one remap_file_pages and one mprotect between them.
+Each thread keeps its own list of pending updates.  An update that takes
+access away is visible in the entry right away; one that only grants
+access is published once the mapping has been changed.
+*/
+
+#define PAGE_TABLE_BATCH 64
+
+struct pt_update {
+	struct page_table *pt;
+	int page;
+	pte_t entry;
+};
+
+struct pt_batch {
+	int depth;
+	int n;
+	struct pt_update updates[PAGE_TABLE_BATCH];
+};
+
+static __thread struct pt_batch batch;
+
+static long long nremaps;
+static long long nmprotects;
+
+static struct page_table * page_table_lookup( char *addr )
+{
+	int i;
+	for(i=0;i<PAGE_TABLE_MAX;i++) {
+		struct page_table *pt = __atomic_load_n(&page_tables[i],__ATOMIC_ACQUIRE);
+		if(pt && addr>=pt->virtmem && addr<pt->virtmem+(size_t)pt->npages*pt->page_size) return pt;
+	}
+	return 0;
+}
+
+/*
+Return the entry of a page, or an empty entry if it was never set.
+Safe to call without holding any lock.
+*/
+
+static pte_t pte_load( struct page_table *pt, int page )
+{
+	struct pt_node *node = __atomic_load_n(&pt->dir[page>>PT_DIR_SHIFT],__ATOMIC_ACQUIRE);
+	if(!node) return 0;
+
+	struct pt_leaf *leaf = __atomic_load_n(&node->leaves[(page>>PT_LEAF_SHIFT)&(PT_NODE_SIZE-1)],__ATOMIC_ACQUIRE);
+	if(!leaf) return 0;
+
+	return __atomic_load_n(&leaf->entries[page&(PT_LEAF_SIZE-1)],__ATOMIC_ACQUIRE);
+}
+
+/*
+Allocate a zeroed radix tree node and publish it in "slot", unless another
+thread got there first.  Returns whichever node ends up in the slot.
+*/
+
+static void * pt_node_install( void **slot, size_t size )
+{
+	void *node = calloc(1,size);
+	void *expected = 0;
+
+	if(!node) {
+		fprintf(stderr,"page_table: out of memory for page table nodes\n");
+		abort();
+	}
+
+	if(!__atomic_compare_exchange_n(slot,&expected,node,0,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE)) {
+		free(node);
+		return expected;
+	}
+	return node;
+}
+
+/*
+Return a pointer to the entry of a page, allocating the nodes on the way to it.
+*/
+
+static pte_t * pte_slot( struct page_table *pt, int page )
+{
+	struct pt_node *node = __atomic_load_n(&pt->dir[page>>PT_DIR_SHIFT],__ATOMIC_ACQUIRE);
+	if(!node) node = pt_node_install((void **)&pt->dir[page>>PT_DIR_SHIFT],sizeof(struct pt_node));
+
+	struct pt_leaf **lslot = &node->leaves[(page>>PT_LEAF_SHIFT)&(PT_NODE_SIZE-1)];
+	struct pt_leaf *leaf = __atomic_load_n(lslot,__ATOMIC_ACQUIRE);
+	if(!leaf) leaf = pt_node_install((void **)lslot,sizeof(struct pt_leaf));
+
+	return &leaf->entries[page&(PT_LEAF_SIZE-1)];
+}
+
+/*
+Offer the other pages of the naturally aligned group around "page" to the
+fault-around handler.  Pages that already have access, or whose fault lock
+is taken, are skipped rather than waited for.
+*/
+
+static void page_table_fault_around( struct page_table *pt, int page )
+{
+	int first = page - page%pt->around;
+	int i;
+
+	for(i=first;i<first+pt->around && i<pt->npages;i++) {
+		pthread_mutex_t *lock = &pt->fault_locks[i%PAGE_TABLE_FAULT_LOCKS];
+
+		if(i==page || pte_load(pt,i)&PTE_BITS_MASK) continue;
+		if(pthread_mutex_trylock(lock)) continue;
+		if(!(pte_load(pt,i)&PTE_BITS_MASK)) {
+			pt->around_handler(pt,i);
+		}
+		pthread_mutex_unlock(lock);
+	}
+}
+
+/*
+Handle a fault on a page whose entry was seen as "entry".  If another thread
+changed the entry while we waited for the lock, it already handled this fault
+and the access is just retried.
+*/
+
+static void page_table_fault( struct page_table *pt, int page, pte_t entry )
+{
+	pthread_mutex_t *lock = &pt->fault_locks[page%PAGE_TABLE_FAULT_LOCKS];
+	int handled;
+
+	pthread_mutex_lock(lock);
+	handled = pte_load(pt,page)==entry;
+	if(handled) {
+		pt->handler(pt,page);
+	}
+	pthread_mutex_unlock(lock);
+
+	if(handled && pt->around>1 && !(entry&PTE_BITS_MASK)) {
+		page_table_fault_around(pt,page);
+	}
+}
 
 static void internal_fault_handler( int signum, siginfo_t *info, void *context )
 {
@@ -36,13 +236,13 @@ static void internal_fault_handler( int signum, siginfo_t *info, void *context )
 	char *addr = info->si_addr;
 #endif
 
-	struct page_table *pt = the_page_table;
+	struct page_table *pt = page_table_lookup(addr);
 
 	if(pt) {
-		int page = (addr-pt->virtmem) / PAGE_SIZE;
+		int page = (addr-pt->virtmem) / pt->page_size;
 
 		if(page>=0 && page<pt->npages) {
-			pt->handler(pt,page);
+			page_table_fault(pt,page,pte_load(pt,page));
 			return;
 		}
 	}
@@ -51,39 +251,238 @@ static void internal_fault_handler( int signum, siginfo_t *info, void *context )
 	abort();
 }
 
-struct page_table * page_table_create( int npages, int nframes, page_fault_handler_t handler )
+/*
+Software access path.  Each thread caches recent translations in a small
+direct-mapped TLB, tagged with the page table and the access that was found
+in its entry.  A miss looks at the page table entry and calls the fault
+handler directly, without going through a signal.  Whenever an entry loses
+access or moves to another frame, its page table takes a new generation
+number, which invalidates every cached translation of it.  The data itself
+is still accessed through the virtual memory, so a translation that goes
+stale in the meantime is caught by the signal handler as usual.
+*/
+
+#define PAGE_TABLE_TLB_SIZE 64
+
+struct tlb_entry {
+	struct page_table *pt;
+	size_t page;
+	int bits;
+	unsigned gen;
+};
+
+static __thread struct tlb_entry tlb[PAGE_TABLE_TLB_SIZE];
+static __thread long long tlb_hits;
+static __thread long long tlb_misses;
+static __thread int tlb_registered;
+
+static unsigned tlb_clock;
+static long long total_tlb_hits;
+static long long total_tlb_misses;
+static pthread_key_t tlb_key;
+static pthread_once_t tlb_once = PTHREAD_ONCE_INIT;
+
+static void tlb_merge_stats( void *unused )
+{
+	__atomic_add_fetch(&total_tlb_hits,tlb_hits,__ATOMIC_RELAXED);
+	__atomic_add_fetch(&total_tlb_misses,tlb_misses,__ATOMIC_RELAXED);
+	tlb_hits = tlb_misses = 0;
+}
+
+static void tlb_key_create()
+{
+	pthread_key_create(&tlb_key,tlb_merge_stats);
+}
+
+static void tlb_fill( struct page_table *pt, size_t addr, int bits )
+{
+	size_t page = addr / pt->page_size;
+	struct tlb_entry *e = &tlb[page%PAGE_TABLE_TLB_SIZE];
+
+	if(page>=pt->npages) {
+		fprintf(stderr,"page_table: illegal address %zu\n",addr);
+		abort();
+	}
+
+	// The counters of a thread are merged when it exits
+	if(!tlb_registered) {
+		pthread_once(&tlb_once,tlb_key_create);
+		pthread_setspecific(tlb_key,&tlb_registered);
+		tlb_registered = 1;
+	}
+	tlb_misses++;
+
+	for(;;) {
+		unsigned gen = __atomic_load_n(&pt->tlb_gen,__ATOMIC_ACQUIRE);
+		pte_t entry = pte_load(pt,page);
+
+		if((entry&bits)==bits) {
+			e->pt = pt;
+			e->page = page;
+			e->bits = entry & PTE_BITS_MASK;
+			e->gen = gen;
+			return;
+		}
+
+		page_table_fault(pt,(int)page,entry);
+	}
+}
+
+static inline char * tlb_translate( struct page_table *pt, size_t addr, int bits )
+{
+	size_t page = addr / pt->page_size;
+	struct tlb_entry *e = &tlb[page%PAGE_TABLE_TLB_SIZE];
+
+	if(e->pt==pt && e->page==page && (e->bits&bits)==bits && e->gen==__atomic_load_n(&pt->tlb_gen,__ATOMIC_RELAXED)) {
+		tlb_hits++;
+	} else {
+		tlb_fill(pt,addr,bits);
+	}
+	return pt->virtmem + addr;
+}
+
+char page_table_load( struct page_table *pt, size_t addr )
+{
+	return *tlb_translate(pt,addr,PROT_READ);
+}
+
+void page_table_store( struct page_table *pt, size_t addr, char value )
+{
+	*tlb_translate(pt,addr,PROT_READ|PROT_WRITE) = value;
+}
+
+void page_table_read( struct page_table *pt, size_t addr, void *data, size_t length )
+{
+	char *out = data;
+
+	while(length>0) {
+		size_t n = pt->page_size - addr%pt->page_size;
+		if(n>length) n = length;
+		memcpy(out,tlb_translate(pt,addr,PROT_READ),n);
+		out += n;
+		addr += n;
+		length -= n;
+	}
+}
+
+void page_table_write( struct page_table *pt, size_t addr, const void *data, size_t length )
+{
+	const char *in = data;
+
+	while(length>0) {
+		size_t n = pt->page_size - addr%pt->page_size;
+		if(n>length) n = length;
+		memcpy(tlb_translate(pt,addr,PROT_READ|PROT_WRITE),in,n);
+		in += n;
+		addr += n;
+		length -= n;
+	}
+}
+
+char * page_table_pin_range( struct page_table *pt, size_t addr, size_t length, int bits )
+{
+	size_t end = addr + length;
+	size_t a;
+
+	for(a=addr-addr%pt->page_size;a<end;a+=pt->page_size) {
+		tlb_translate(pt,a,bits);
+	}
+	return pt->virtmem + addr;
+}
+
+void page_table_get_tlb_stats( long long *hits, long long *misses )
+{
+	tlb_merge_stats(0);
+	*hits = __atomic_load_n(&total_tlb_hits,__ATOMIC_RELAXED);
+	*misses = __atomic_load_n(&total_tlb_misses,__ATOMIC_RELAXED);
+}
+
+/*
+Set up the virtual memory and the empty page table of "pt", and make it
+visible to the fault handler.  pt->fd, pt->page_size and pt->pool must already be set.
+*/
+
+static struct page_table * page_table_init( struct page_table *pt, int npages, page_fault_handler_t handler )
 {
 	int i;
+
+	pt->virtmem = mmap(0,(size_t)npages*pt->page_size,PROT_NONE,MAP_SHARED|MAP_NORESERVE,pt->fd,0);
+	pt->npages = npages;
+
+	// Only the directory is allocated up front; calloc hands back untouched zero pages
+	pt->ndir = ((long long)npages + (1<<PT_DIR_SHIFT) - 1) >> PT_DIR_SHIFT;
+	pt->dir = calloc(pt->ndir,sizeof(struct pt_node *));
+
+	pt->handler = handler;
+	pt->around = 1;
+	pt->around_handler = 0;
+	pt->advice_handler = 0;
+	pt->nmapped = 0;
+	pt->tlb_gen = __atomic_add_fetch(&tlb_clock,1,__ATOMIC_RELAXED);
+
+	if(pt->virtmem==MAP_FAILED || !pt->dir) {
+		fprintf(stderr,"page_table_create: couldn't allocate %d pages\n",npages);
+		abort();
+	}
+
+	for(i=0;i<PAGE_TABLE_FAULT_LOCKS;i++) pthread_mutex_init(&pt->fault_locks[i],0);
+
+	for(i=0;i<PAGE_TABLE_MAX;i++) {
+		struct page_table *empty = 0;
+		if(__atomic_compare_exchange_n(&page_tables[i],&empty,pt,0,__ATOMIC_RELEASE,__ATOMIC_RELAXED)) break;
+	}
+	if(i==PAGE_TABLE_MAX) {
+		fprintf(stderr,"page_table_create: too many page tables\n");
+		abort();
+	}
+
+	return pt;
+}
+
+struct page_table * page_table_create( int npages, int nframes, page_fault_handler_t handler )
+{
+	return page_table_create_sized(npages,nframes,PAGE_SIZE,handler);
+}
+
+struct page_table * page_table_create_sized( int npages, int nframes, int page_size, page_fault_handler_t handler )
+{
 	struct sigaction sa;
 	struct page_table *pt;
 	char filename[256];
 
+	if(page_size<=0 || page_size%getpagesize()) {
+		fprintf(stderr,"page_table_create: page size must be a multiple of %d\n",getpagesize());
+		return 0;
+	}
+
+	if(nframes>PTE_MAX_FRAMES) {
+		fprintf(stderr,"page_table_create: at most %d frames are supported\n",PTE_MAX_FRAMES);
+		return 0;
+	}
+
 	pt = malloc(sizeof(struct page_table));
 	if(!pt) return 0;
 
-	the_page_table = pt;
-
 	sprintf(filename,"/tmp/pmem.%d.%d",getpid(),getuid());
 
 	pt->fd = open(filename,O_CREAT|O_TRUNC|O_RDWR,0777);
 	if(!pt->fd) return 0;
 
-	ftruncate(pt->fd,PAGE_SIZE*npages);
+	ftruncate(pt->fd,(off_t)page_size*(npages>nframes ? npages : nframes));
 
 	unlink(filename);
 
-	pt->physmem = mmap(0,nframes*PAGE_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED,pt->fd,0);
+	pt->physmem = mmap(0,(size_t)nframes*page_size,PROT_READ|PROT_WRITE,MAP_SHARED,pt->fd,0);
 	pt->nframes = nframes;
+	pt->page_size = page_size;
+	pt->pool = pt;
+	pt->frame_maps = calloc(nframes,sizeof(int));
+	if(!pt->frame_maps) {
+		fprintf(stderr,"page_table_create: couldn't allocate %d frames\n",nframes);
+		abort();
+	}
 
-	pt->virtmem = mmap(0,npages*PAGE_SIZE,PROT_NONE,MAP_SHARED|MAP_NORESERVE,pt->fd,0);
-	pt->npages = npages;
-
-	pt->page_bits = malloc(sizeof(int)*npages);
-	pt->page_mapping = malloc(sizeof(int)*npages);
-
-	pt->handler = handler;
-
-	for(i=0;i<pt->npages;i++) pt->page_bits[i] = 0;
+	page_table_init(pt,npages,handler);
 
 	sa.sa_sigaction = internal_fault_handler;
 	sa.sa_flags = SA_SIGINFO;
@@ -94,16 +493,208 @@ struct page_table * page_table_create( int npages, int nframes, page_fault_handl
 	return pt;
 }
 
+struct page_table * page_table_create_shared( struct page_table *pool, int npages, page_fault_handler_t handler )
+{
+	struct page_table *pt;
+
+	pt = malloc(sizeof(struct page_table));
+	if(!pt) return 0;
+
+	pool = pool->pool;
+	pt->fd = pool->fd;
+	pt->physmem = pool->physmem;
+	pt->nframes = pool->nframes;
+	pt->page_size = pool->page_size;
+	pt->pool = pool;
+	pt->frame_maps = 0;
+
+	return page_table_init(pt,npages,handler);
+}
+
 void page_table_delete( struct page_table *pt )
 {
-	munmap(pt->virtmem,pt->npages*PAGE_SIZE);
-	munmap(pt->physmem,pt->nframes*PAGE_SIZE);
-	free(pt->page_bits);
-	free(pt->page_mapping);
-	close(pt->fd);
+	int i;
+
+	for(i=0;i<PAGE_TABLE_MAX;i++) {
+		if(page_tables[i]==pt) __atomic_store_n(&page_tables[i],0,__ATOMIC_RELEASE);
+	}
+
+	munmap(pt->virtmem,(size_t)pt->npages*pt->page_size);
+	for(i=0;i<pt->ndir;i++) {
+		struct pt_node *node = pt->dir[i];
+		int j;
+		if(!node) continue;
+		for(j=0;j<PT_NODE_SIZE;j++) free(node->leaves[j]);
+		free(node);
+	}
+	free(pt->dir);
+	for(i=0;i<PAGE_TABLE_FAULT_LOCKS;i++) pthread_mutex_destroy(&pt->fault_locks[i]);
+
+	// Only the owner of the physical memory releases it
+	if(pt->pool==pt) {
+		munmap(pt->physmem,(size_t)pt->nframes*pt->page_size);
+		close(pt->fd);
+		free(pt->frame_maps);
+	}
 	free(pt);
 }
 
+/*
+Check that no page of the pool still has access to a frame at or beyond
+"nframes", and if "forget" is set, reset the entries of the pages that
+merely still name one to the empty entry.  Returns 0 if a page has access.
+*/
+
+static int page_table_forget_frames( struct page_table *pool, int nframes, int forget )
+{
+	int i, d, l, e;
+
+	for(i=0;i<PAGE_TABLE_MAX;i++) {
+		struct page_table *pt = page_tables[i];
+		if(!pt || pt->pool!=pool) continue;
+		for(d=0;d<pt->ndir;d++) {
+			struct pt_node *node = pt->dir[d];
+			if(!node) continue;
+			for(l=0;l<PT_NODE_SIZE;l++) {
+				struct pt_leaf *leaf = node->leaves[l];
+				if(!leaf) continue;
+				for(e=0;e<PT_LEAF_SIZE;e++) {
+					pte_t entry = leaf->entries[e];
+					if((int)(entry>>PTE_FRAME_SHIFT)<nframes) continue;
+					if(entry&PTE_BITS_MASK) return 0;
+					if(forget) __atomic_store_n(&leaf->entries[e],0,__ATOMIC_RELEASE);
+				}
+			}
+		}
+	}
+	return 1;
+}
+
+int page_table_resize( struct page_table *pt, int nframes )
+{
+	struct page_table *pool = pt->pool;
+	size_t old_size = (size_t)pool->nframes*pool->page_size;
+	size_t new_size = (size_t)nframes*pool->page_size;
+	struct stat st;
+	char *physmem;
+	int i;
+
+	if(nframes<1 || nframes>PTE_MAX_FRAMES) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if(nframes<pool->nframes && !page_table_forget_frames(pool,nframes,0)) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	// Neither does the count of mappings of each frame, so a failure leaves nothing to undo
+	if(nframes>pool->nframes) {
+		int *maps = realloc(pool->frame_maps,nframes*sizeof(int));
+		if(!maps) return -1;
+		memset(maps+pool->nframes,0,(nframes-pool->nframes)*sizeof(int));
+		pool->frame_maps = maps;
+	}
+
+	// The file only ever grows; it also backs pages that were never mapped
+	if(fstat(pool->fd,&st)<0) return -1;
+	if((size_t)st.st_size<new_size && ftruncate(pool->fd,(off_t)new_size)<0) return -1;
+
+	physmem = mremap(pool->physmem,old_size,new_size,MREMAP_MAYMOVE);
+	if(physmem==MAP_FAILED) return -1;
+
+	// Pages that lost their frame must not be taken for still holding it
+	if(nframes<pool->nframes) page_table_forget_frames(pool,nframes,1);
+
+	for(i=0;i<PAGE_TABLE_MAX;i++) {
+		struct page_table *other = page_tables[i];
+		if(!other || other->pool!=pool) continue;
+		other->physmem = physmem;
+		other->nframes = nframes;
+	}
+	return 0;
+}
+
+static int compare_updates( const void *pa, const void *pb )
+{
+	const struct pt_update *a = pa;
+	const struct pt_update *b = pb;
+
+	if(a->pt!=b->pt) return a->pt<b->pt ? -1 : 1;
+	return a->page - b->page;
+}
+
+static char * page_address( struct page_table *pt, int page )
+{
+	return pt->virtmem+(size_t)page*pt->page_size;
+}
+
+/*
+Apply every pending update of the calling thread: sort them by page, remap
+runs of neighbouring pages onto runs of neighbouring frames with one call,
+skipping pages that already map their frame, then change the protection of
+runs with the same access bits with one call.
+*/
+
+static void page_table_apply( void )
+{
+	struct pt_update *u = batch.updates;
+	int n = batch.n;
+	int i, j, k;
+	int remap[PAGE_TABLE_BATCH];
+
+	qsort(u,n,sizeof(*u),compare_updates);
+
+	for(i=0;i<n;i++) {
+		pte_t cur = pte_load(u[i].pt,u[i].page);
+		remap[i] = !(cur&PTE_MAPPED) || (cur>>PTE_FRAME_SHIFT)!=(u[i].entry>>PTE_FRAME_SHIFT);
+	}
+
+	// remap_file_pages counts file offsets in system pages, and a single call
+	// must stay within one mapping; fall back to page by page if it does not
+	for(i=0;i<n;i=j) {
+		for(j=i+1;j<n && remap[i] && remap[j] && u[j].pt==u[i].pt && u[j].page==u[j-1].page+1 &&
+			(u[j].entry>>PTE_FRAME_SHIFT)==(u[j-1].entry>>PTE_FRAME_SHIFT)+1;j++);
+		if(!remap[i]) continue;
+
+		struct page_table *pt = u[i].pt;
+		size_t scale = pt->page_size/getpagesize();
+		__atomic_add_fetch(&nremaps,1,__ATOMIC_RELAXED);
+		if(remap_file_pages(page_address(pt,u[i].page),(size_t)(j-i)*pt->page_size,0,(u[i].entry>>PTE_FRAME_SHIFT)*scale,0)<0 && j-i>1) {
+			for(k=i;k<j;k++) {
+				__atomic_add_fetch(&nremaps,1,__ATOMIC_RELAXED);
+				remap_file_pages(page_address(pt,u[k].page),pt->page_size,0,(u[k].entry>>PTE_FRAME_SHIFT)*scale,0);
+			}
+		}
+	}
+
+	for(i=0;i<n;i=j) {
+		int bits = u[i].entry & PTE_BITS_MASK;
+		for(j=i+1;j<n && u[j].pt==u[i].pt && u[j].page==u[j-1].page+1 && (int)(u[j].entry&PTE_BITS_MASK)==bits;j++);
+
+		__atomic_add_fetch(&nmprotects,1,__ATOMIC_RELAXED);
+		mprotect(page_address(u[i].pt,u[i].page),(size_t)(j-i)*u[i].pt->page_size,bits);
+	}
+
+	for(i=0;i<n;i++) {
+		__atomic_store_n(pte_slot(u[i].pt,u[i].page),u[i].entry|PTE_MAPPED,__ATOMIC_RELEASE);
+	}
+
+	batch.n = 0;
+}
+
+/*
+Add "delta" to the pages mapping "frame", and to the frames mapped when that
+is the first mapping or the last one gone.
+*/
+
+static void page_table_count_frame( struct page_table *pool, int frame, int delta )
+{
+	int maps = __atomic_add_fetch(&pool->frame_maps[frame],delta,__ATOMIC_RELAXED);
+	if(maps==(delta>0 ? 1 : 0)) __atomic_add_fetch(&pool->nmapped,delta,__ATOMIC_RELAXED);
+}
+
 void page_table_set_entry( struct page_table *pt, int page, int frame, int bits )
 {
 	if( page<0 || page>=pt->npages ) {
@@ -116,23 +707,54 @@ void page_table_set_entry( struct page_table *pt, int page, int frame, int bits
 		abort();
 	}
 
-	pt->page_mapping[page] = frame;
-	pt->page_bits[page] = bits;
+	pte_t *slot = pte_slot(pt,page);
+	pte_t old = *slot;
+	pte_t entry = ((pte_t)frame<<PTE_FRAME_SHIFT)|(bits&PTE_BITS_MASK);
+	int old_bits = old & PTE_BITS_MASK;
+	struct pt_update *u = 0;
+	int i;
 
-	remap_file_pages(pt->virtmem+page*PAGE_SIZE,PAGE_SIZE,0,frame,0);
-	mprotect(pt->virtmem+page*PAGE_SIZE,PAGE_SIZE,bits);
+	// A pending update of the same page is superseded by this one
+	for(i=0;i<batch.n;i++) {
+		if(batch.updates[i].pt==pt && batch.updates[i].page==page) {
+			u = &batch.updates[i];
+			old = u->entry;
+			old_bits = old & PTE_BITS_MASK;
+			break;
+		}
+	}
+	if(!u) {
+		if(batch.n==PAGE_TABLE_BATCH) page_table_apply();
+		u = &batch.updates[batch.n++];
+		u->pt = pt;
+		u->page = page;
+	}
 
-	// Check to make sure too many frames aren't mapped
-	int numMapped = 0;
-	int i;
-	for(i = 0; i < pt->npages; i++)
-	{
-		if(pt->page_bits[i] != 0)
-			numMapped++;
+	// Track how many frames are mapped across everything sharing the physical
+	// memory.  A frame shared copy-on-write counts once, however many pages map it
+	int old_frame = (int)(old>>PTE_FRAME_SHIFT);
+	if(!old_bits != !bits || (old_bits && old_frame!=frame)) {
+		if(bits) page_table_count_frame(pt->pool,frame,1);
+		if(old_bits) page_table_count_frame(pt->pool,old_frame,-1);
+	}
+
+	// An entry never claims more access than the mapping has: one that only
+	// gains access is published after the mapping changes, and one that loses
+	// access or moves is published (and cached translations dropped) before.
+	int grows = !old_bits || ((int)(old>>PTE_FRAME_SHIFT)==frame && (bits&old_bits)==old_bits);
+
+	u->entry = entry;
+	if(!grows) {
+		pte_t cur = *slot;
+		pte_t keep = (cur&PTE_MAPPED) && (int)(cur>>PTE_FRAME_SHIFT)==frame ? PTE_MAPPED : 0;
+		__atomic_store_n(slot,entry|keep,__ATOMIC_RELEASE);
+		__atomic_store_n(&pt->tlb_gen,__atomic_add_fetch(&tlb_clock,1,__ATOMIC_RELAXED),__ATOMIC_RELEASE);
 	}
 
-	// If there are, alert user and stop execution
-	if(numMapped > pt->nframes)
+	if(!batch.depth) page_table_apply();
+
+	// If too many frames are mapped, alert user and stop execution
+	if(pt->pool->nmapped > pt->nframes)
 	{
 		fprintf(stderr,"page_table_set_entry: cannot have more than %d frames mapped at a time!\n",pt->nframes);
 		abort();
@@ -140,6 +762,38 @@ void page_table_set_entry( struct page_table *pt, int page, int frame, int bits
 	}
 }
 
+void page_table_set_range( struct page_table *pt, int page, int npages, int frame, int bits )
+{
+	int i;
+
+	page_table_begin_updates();
+	for(i=0;i<npages;i++) {
+		page_table_set_entry(pt,page+i,frame+i,bits);
+	}
+	page_table_end_updates();
+}
+
+void page_table_begin_updates( void )
+{
+	batch.depth++;
+}
+
+void page_table_flush_updates( void )
+{
+	if(batch.n) page_table_apply();
+}
+
+void page_table_end_updates( void )
+{
+	if(--batch.depth==0) page_table_flush_updates();
+}
+
+void page_table_get_syscalls( long long *remaps, long long *mprotects )
+{
+	*remaps = __atomic_load_n(&nremaps,__ATOMIC_RELAXED);
+	*mprotects = __atomic_load_n(&nmprotects,__ATOMIC_RELAXED);
+}
+
 void page_table_get_entry( struct page_table *pt, int page, int *frame, int *bits )
 {
 	if( page<0 || page>=pt->npages ) {
@@ -147,8 +801,16 @@ void page_table_get_entry( struct page_table *pt, int page, int *frame, int *bit
 		abort();
 	}
 
-	*frame = pt->page_mapping[page];
-	*bits = pt->page_bits[page];
+	pte_t entry = pte_load(pt,page);
+	int i;
+
+	// The calling thread sees its own pending updates
+	for(i=0;i<batch.n;i++) {
+		if(batch.updates[i].pt==pt && batch.updates[i].page==page) entry = batch.updates[i].entry;
+	}
+
+	*frame = entry >> PTE_FRAME_SHIFT;
+	*bits = entry & PTE_BITS_MASK;
 }
 
 void page_table_print_entry( struct page_table *pt, int page )
@@ -158,11 +820,12 @@ void page_table_print_entry( struct page_table *pt, int page )
 		abort();
 	}
 
-	int b = pt->page_bits[page];
+	pte_t entry = pte_load(pt,page);
+	int b = entry & PTE_BITS_MASK;
 
 	printf("page %06d: frame %06d bits %c%c%c\n",
 		page,
-		pt->page_mapping[page],
+		entry >> PTE_FRAME_SHIFT,
 		b&PROT_READ  ? 'r' : '-',
 		b&PROT_WRITE ? 'w' : '-',
 		b&PROT_EXEC  ? 'x' : '-'
@@ -188,6 +851,56 @@ int page_table_get_npages( struct page_table *pt )
 	return pt->npages;
 }
 
+int page_table_get_page_size( struct page_table *pt )
+{
+	return pt->page_size;
+}
+
+int page_table_advise( void *addr, size_t length, int advice )
+{
+	struct page_table *pt = page_table_lookup(addr);
+	char *start = addr;
+	char *end = start + length;
+
+	if(!pt || length==0 || advice<PAGE_ADVICE_NORMAL || advice>PAGE_ADVICE_UNPIN) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	size_t size = (size_t)pt->npages*pt->page_size;
+	size_t first = start - pt->virtmem;
+	size_t last = end - pt->virtmem;
+	if(last>size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	// Dropping contents must not spill over onto data outside the range
+	if(advice==PAGE_ADVICE_DONTNEED) {
+		first = (first + pt->page_size - 1) / pt->page_size;
+		last = last / pt->page_size;
+	} else {
+		first = first / pt->page_size;
+		last = (last + pt->page_size - 1) / pt->page_size;
+	}
+
+	if(pt->advice_handler && last>first) {
+		pt->advice_handler(pt,(int)first,(int)(last-first),advice);
+	}
+	return 0;
+}
+
+void page_table_set_advice_handler( struct page_table *pt, page_advice_handler_t handler )
+{
+	pt->advice_handler = handler;
+}
+
+void page_table_set_fault_around( struct page_table *pt, int npages, page_fault_handler_t handler )
+{
+	pt->around_handler = handler;
+	pt->around = handler && npages>1 ? npages : 1;
+}
+
 char * page_table_get_virtmem( struct page_table *pt )
 {
 	return pt->virtmem;
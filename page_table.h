@@ -2,6 +2,7 @@
 #define PAGE_TABLE_H
 
 #include <sys/mman.h>
+#include <stddef.h>
 
 #ifndef PAGE_SIZE
 #define PAGE_SIZE 4096
@@ -11,16 +12,63 @@ struct page_table;
 
 typedef void (*page_fault_handler_t) ( struct page_table *pt, int page );
 
+/*
+Hints about how a range of virtual memory is going to be used, in the
+spirit of madvise.  The first three describe the access pattern of the
+range from now on; the rest act on the range once.
+*/
+
+#define PAGE_ADVICE_NORMAL     0 /* No particular pattern */
+#define PAGE_ADVICE_SEQUENTIAL 1 /* Accessed in order; read ahead of faults */
+#define PAGE_ADVICE_RANDOM     2 /* Accessed at random; never read ahead */
+#define PAGE_ADVICE_WILLNEED   3 /* Will be accessed soon; bring it in now */
+#define PAGE_ADVICE_DONTNEED   4 /* Contents no longer needed; drop without writing back */
+#define PAGE_ADVICE_HOT        5 /* Evict other pages first */
+#define PAGE_ADVICE_COLD       6 /* Undo PAGE_ADVICE_HOT */
+#define PAGE_ADVICE_PIN        7 /* Bring in and never evict */
+#define PAGE_ADVICE_UNPIN      8 /* Undo PAGE_ADVICE_PIN */
+
+typedef void (*page_advice_handler_t) ( struct page_table *pt, int page, int npages, int advice );
+
 /* Create a new page table, along with a corresponding virtual memory
 that is "npages" big and a physical memory that is "nframes" bit
  When a page fault occurs, the routine pointed to by "handler" will be called. */
 
 struct page_table * page_table_create( int npages, int nframes, page_fault_handler_t handler );
 
+/* Like page_table_create, but with pages of "page_size" bytes instead of PAGE_SIZE.
+The page size must be a multiple of the system page size.
+Page tables created from this one with page_table_create_shared use the same page size. */
+
+struct page_table * page_table_create_sized( int npages, int nframes, int page_size, page_fault_handler_t handler );
+
+/* Create another page table, with its own virtual memory that is "npages" big,
+that maps into the physical memory of "pool" and shares its frames.
+Faults are dispatched to the page table whose virtual memory contains the address.
+A frame may be mapped by pages of several of these page tables at once, as when
+they share it copy-on-write; it counts once towards the limit of as many frames
+mapped at a time as there are.
+The physical memory is released when "pool" itself is deleted. */
+
+struct page_table * page_table_create_shared( struct page_table *pool, int npages, page_fault_handler_t handler );
+
 /* Delete a page table and the corresponding virtual and physical memories. */
 
 void page_table_delete( struct page_table *pt );
 
+/*
+Grow or shrink the physical memory that "pt" shares with the other page
+tables of its pool to "nframes" frames.  When shrinking, no page may still
+have access to a frame beyond the new size; pages without access that still
+name one are reset to frame 0.  The physical memory may move, so get it
+again with page_table_get_physmem afterwards.  Nothing may be faulting or
+touching the physical memory meanwhile, and no updates may be pending.
+Returns 0 on success, or -1 with errno set to EBUSY if a page still has
+access to a frame beyond the new size.
+*/
+
+int page_table_resize( struct page_table *pt, int nframes );
+
 /*
 Set the frame number and access bits associated with a page.
 The bits may be any of PROT_READ, PROT_WRITE, or PROT_EXEC logical-ored together.
@@ -28,6 +76,31 @@ The bits may be any of PROT_READ, PROT_WRITE, or PROT_EXEC logical-ored together
 
 void page_table_set_entry( struct page_table *pt, int page, int frame, int bits );
 
+/*
+Map "npages" consecutive pages starting at "page" onto as many consecutive
+frames starting at "frame", all with the same access bits.
+*/
+
+void page_table_set_range( struct page_table *pt, int page, int npages, int frame, int bits );
+
+/*
+Defer the updates made by the calling thread until page_table_end_updates,
+or until page_table_flush_updates is called in between.  The pending updates
+are then applied together, merging neighbouring pages into single system calls.
+The calling thread sees its own pending updates in page_table_get_entry.
+Updates must be flushed before anyone else may change the same pages, and
+before a frame whose page lost access is reused or written out.
+Calls may be nested; only the outermost end applies the updates.
+*/
+
+void page_table_begin_updates( void );
+void page_table_flush_updates( void );
+void page_table_end_updates( void );
+
+/* Get the number of remap_file_pages and mprotect calls made so far. */
+
+void page_table_get_syscalls( long long *remaps, long long *mprotects );
+
 /*
 Get the frame number and access bits associated with a page.
 "frame" and "bits" must be pointers to integers which will be filled with the current values.
@@ -52,6 +125,58 @@ int page_table_get_nframes( struct page_table *pt );
 
 int page_table_get_npages( struct page_table *pt );
 
+/* Return the size of a page in bytes. */
+
+int page_table_get_page_size( struct page_table *pt );
+
+/*
+Enable fault-around.  After a fault on a page that had no access at all,
+"handler" is also called for each other page without access in the naturally
+aligned group of "npages" pages around it.  It may map the page or leave it
+alone.  An "npages" of 1 or a null handler turns fault-around off again.
+*/
+
+void page_table_set_fault_around( struct page_table *pt, int npages, page_fault_handler_t handler );
+
+/*
+Access the virtual memory of a page table in software, by offset from its start.
+Translations are cached in a small per-thread TLB, and a miss calls the fault
+handler directly instead of taking a signal.  page_table_read and
+page_table_write copy "length" bytes out of or into the virtual memory.
+*/
+
+char page_table_load( struct page_table *pt, size_t addr );
+void page_table_store( struct page_table *pt, size_t addr, char value );
+void page_table_read( struct page_table *pt, size_t addr, void *data, size_t length );
+void page_table_write( struct page_table *pt, size_t addr, const void *data, size_t length );
+
+/*
+Fault in every page of a range with at least the access "bits", and return a
+pointer to the range in the virtual memory for direct use.  The pages are not
+locked in memory: if one is evicted later, touching it faults as usual.
+*/
+
+char * page_table_pin_range( struct page_table *pt, size_t addr, size_t length, int bits );
+
+/*
+Give a hint about the range of "length" bytes at "addr", which must lie in
+the virtual memory of a page table.  The hint covers every page the range
+touches, except for PAGE_ADVICE_DONTNEED which only covers whole pages.
+It is passed to the advice handler of the page table, if it has one.
+Returns 0 on success, or -1 with errno set to EINVAL if the range is not
+in any virtual memory or the advice is unknown.
+*/
+
+int page_table_advise( void *addr, size_t length, int advice );
+
+/* Set the handler that acts on the hints given to page_table_advise. */
+
+void page_table_set_advice_handler( struct page_table *pt, page_advice_handler_t handler );
+
+/* Get the TLB hits and misses of the software accesses made so far by all threads. */
+
+void page_table_get_tlb_stats( long long *hits, long long *misses );
+
 /* Print out the page table entry for a single page. */
 
 void page_table_print_entry( struct page_table *pt, int page );
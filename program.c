@@ -1,12 +1,15 @@
 /*
-Do not modify this file.
-Make all of your changes to main.c instead.
+The test programs run over the virtual memory: sort, scan and focus, in
+serial, parallel and software access versions.  See program.h.
 */
 
 #include "program.h"
+#include "page_table.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 static int compare_bytes( const void *pa, const void *pb )
 {
@@ -23,27 +26,31 @@ static int compare_bytes( const void *pa, const void *pb )
 
 }
 
-void focus_program( char *data, int length )
+void focus_program( char *data, size_t length )
 {
 	int total=0;
-	int i,j;
+	size_t i;
+	int j;
 
 	srand(38290);
 
+	page_table_advise(data,length,PAGE_ADVICE_SEQUENTIAL);
 	for(i=0;i<length;i++) {
 		data[i] = 0;
 	}
 
+	page_table_advise(data,length,PAGE_ADVICE_RANDOM);
 	for(j=0;j<100;j++) {
-		int start = rand()%length;
+		size_t start = rand()%length;
 		int size = 25;
 		for(i=0;i<100;i++) {
-		    int index = (start+rand()%size)%length;
+		    size_t index = (start+rand()%size)%length;
 			//printf("Accessing data at index %i, which is page %i\n", index, index/4096);
 			data[ index ] = rand();
 		}
 	}
 
+	page_table_advise(data,length,PAGE_ADVICE_SEQUENTIAL);
 	for(i=0;i<length;i++) {
 		total += data[i];
 	}
@@ -51,19 +58,22 @@ void focus_program( char *data, int length )
 	printf("focus result is %d\n",total);
 }
 
-void sort_program( char *data, int length )
+void sort_program( char *data, size_t length )
 {
 	int total = 0;
-	int i;
+	size_t i;
 
 	srand(4856);
 
+	page_table_advise(data,length,PAGE_ADVICE_SEQUENTIAL);
 	for(i=0;i<length;i++) {
 		data[i] = rand();
 	}
 
+	page_table_advise(data,length,PAGE_ADVICE_RANDOM);
 	qsort(data,length,1,compare_bytes);
 
+	page_table_advise(data,length,PAGE_ADVICE_SEQUENTIAL);
 	for(i=0;i<length;i++) {
 		total += data[i];
 	}
@@ -72,12 +82,14 @@ void sort_program( char *data, int length )
 
 }
 
-void scan_program( char *cdata, int length )
+void scan_program( char *cdata, size_t length )
 {
-	unsigned i, j;
+	size_t i;
+	unsigned j;
 	unsigned char *data = (unsigned char *) cdata;
 	unsigned total = 0;
 
+	page_table_advise(data,length,PAGE_ADVICE_SEQUENTIAL);
 	for(i=0;i<length;i++) {
 		data[i] = i%256;
 	}
@@ -90,3 +102,300 @@ void scan_program( char *cdata, int length )
 
 	printf("scan result is %d\n",total);
 }
+
+/*
+Parallel programs.  Each thread gets one contiguous chunk of the data
+and its own random seed, and adds its result into the shared total.
+*/
+
+struct program_chunk {
+	char *data;
+	size_t start;
+	size_t length;
+	int total;
+	unsigned seed;
+};
+
+static void run_chunks( char *data, size_t length, int nthreads, void *(*body)(void *), struct program_chunk *chunks, unsigned seed )
+{
+	pthread_t *threads = malloc(sizeof(pthread_t)*nthreads);
+	int i;
+
+	for(i=0;i<nthreads;i++) {
+		chunks[i].data = data;
+		chunks[i].start = length*i/nthreads;
+		chunks[i].length = length*(i+1)/nthreads - chunks[i].start;
+		chunks[i].total = 0;
+		chunks[i].seed = seed+i;
+		pthread_create(&threads[i],0,body,&chunks[i]);
+	}
+
+	for(i=0;i<nthreads;i++) {
+		pthread_join(threads[i],0);
+	}
+
+	free(threads);
+}
+
+static void * focus_chunk( void *arg )
+{
+	struct program_chunk *c = arg;
+	char *data = c->data + c->start;
+	size_t i;
+	int j;
+
+	page_table_advise(data,c->length,PAGE_ADVICE_SEQUENTIAL);
+	for(i=0;i<c->length;i++) {
+		data[i] = 0;
+	}
+
+	// Each thread focuses on regions of its own chunk only
+	page_table_advise(data,c->length,PAGE_ADVICE_RANDOM);
+	for(j=0;j<100;j++) {
+		size_t start = rand_r(&c->seed)%c->length;
+		int size = 25;
+		for(i=0;i<100;i++) {
+			size_t index = (start+rand_r(&c->seed)%size)%c->length;
+			data[ index ] = rand_r(&c->seed);
+		}
+	}
+
+	page_table_advise(data,c->length,PAGE_ADVICE_SEQUENTIAL);
+	for(i=0;i<c->length;i++) {
+		c->total += data[i];
+	}
+
+	return 0;
+}
+
+void parallel_focus_program( char *data, size_t length, int nthreads )
+{
+	struct program_chunk *chunks = malloc(sizeof(struct program_chunk)*nthreads);
+	int total = 0;
+	int i;
+
+	run_chunks(data,length,nthreads,focus_chunk,chunks,38290);
+	for(i=0;i<nthreads;i++) total += chunks[i].total;
+	free(chunks);
+
+	printf("focus result is %d\n",total);
+}
+
+static void * sort_chunk( void *arg )
+{
+	struct program_chunk *c = arg;
+	char *data = c->data + c->start;
+	size_t i;
+
+	page_table_advise(data,c->length,PAGE_ADVICE_SEQUENTIAL);
+	for(i=0;i<c->length;i++) {
+		data[i] = rand_r(&c->seed);
+	}
+
+	page_table_advise(data,c->length,PAGE_ADVICE_RANDOM);
+	qsort(data,c->length,1,compare_bytes);
+
+	return 0;
+}
+
+void parallel_sort_program( char *data, size_t length, int nthreads )
+{
+	struct program_chunk *chunks = malloc(sizeof(struct program_chunk)*nthreads);
+	size_t *next = malloc(sizeof(size_t)*nthreads);
+	char *merged = malloc(length);
+	int total = 0;
+	size_t i;
+	int j;
+
+	run_chunks(data,length,nthreads,sort_chunk,chunks,4856);
+
+	// The merge interleaves its reads over all of the chunks
+	page_table_advise(data,length,PAGE_ADVICE_NORMAL);
+	// Merge the sorted chunks back together
+	for(j=0;j<nthreads;j++) next[j] = 0;
+	for(i=0;i<length;i++) {
+		int best = -1;
+		for(j=0;j<nthreads;j++) {
+			if(next[j]==chunks[j].length) continue;
+			if(best<0 || compare_bytes(&data[chunks[j].start+next[j]],&data[chunks[best].start+next[best]])<0) {
+				best = j;
+			}
+		}
+		merged[i] = data[chunks[best].start+next[best]++];
+	}
+	memcpy(data,merged,length);
+
+	for(i=0;i<length;i++) {
+		total += data[i];
+	}
+
+	free(merged);
+	free(next);
+	free(chunks);
+
+	printf("sort result is %d\n",total);
+}
+
+static void * scan_chunk( void *arg )
+{
+	struct program_chunk *c = arg;
+	unsigned char *data = (unsigned char *) c->data;
+	size_t i;
+	unsigned j;
+	unsigned total = 0;
+
+	page_table_advise(data+c->start,c->length,PAGE_ADVICE_SEQUENTIAL);
+	for(i=c->start;i<c->start+c->length;i++) {
+		data[i] = i%256;
+	}
+
+	for(j=0;j<10;j++) {
+		for(i=c->start;i<c->start+c->length;i++) {
+			total += data[i];
+		}
+	}
+
+	c->total = total;
+	return 0;
+}
+
+void parallel_scan_program( char *data, size_t length, int nthreads )
+{
+	struct program_chunk *chunks = malloc(sizeof(struct program_chunk)*nthreads);
+	unsigned total = 0;
+	int i;
+
+	run_chunks(data,length,nthreads,scan_chunk,chunks,0);
+	for(i=0;i<nthreads;i++) total += chunks[i].total;
+	free(chunks);
+
+	printf("scan result is %d\n",total);
+}
+
+/*
+Software access programs.
+*/
+
+void soft_focus_program( struct page_table *pt, size_t length )
+{
+	int total=0;
+	size_t i;
+	int j;
+
+	srand(38290);
+
+	page_table_advise(page_table_get_virtmem(pt),length,PAGE_ADVICE_SEQUENTIAL);
+	for(i=0;i<length;i++) {
+		page_table_store(pt,i,0);
+	}
+
+	page_table_advise(page_table_get_virtmem(pt),length,PAGE_ADVICE_RANDOM);
+	for(j=0;j<100;j++) {
+		size_t start = rand()%length;
+		int size = 25;
+		for(i=0;i<100;i++) {
+			size_t index = (start+rand()%size)%length;
+			page_table_store(pt,index,rand());
+		}
+	}
+
+	page_table_advise(page_table_get_virtmem(pt),length,PAGE_ADVICE_SEQUENTIAL);
+	for(i=0;i<length;i++) {
+		total += page_table_load(pt,i);
+	}
+
+	printf("focus result is %d\n",total);
+}
+
+/*
+Sort the "n" bytes at "addr" with a merge sort of the halves through "tmp",
+outside the virtual memory, copying back only as much as has moved.  This is
+a sort of its own, not the qsort of sort_program, so its page accesses are
+only roughly like that one's and its fault counts differ a little.
+*/
+
+static void soft_merge_sort( struct page_table *pt, size_t addr, size_t n, char *tmp )
+{
+	size_t n1, n2, b1, b2;
+	char *t = tmp;
+
+	if(n<=1) return;
+
+	n1 = n/2;
+	n2 = n-n1;
+	b1 = addr;
+	b2 = addr+n1;
+	soft_merge_sort(pt,b1,n1,tmp);
+	soft_merge_sort(pt,b2,n2,tmp);
+
+	while(n1>0 && n2>0) {
+		char c1 = page_table_load(pt,b1);
+		char c2 = page_table_load(pt,b2);
+		if(compare_bytes(&c1,&c2)<=0) {
+			*t++ = c1;
+			b1++;
+			n1--;
+		} else {
+			*t++ = c2;
+			b2++;
+			n2--;
+		}
+	}
+	if(n1>0) page_table_read(pt,b1,t,n1);
+	page_table_write(pt,addr,tmp,n-n2);
+}
+
+void soft_sort_program( struct page_table *pt, size_t length )
+{
+	char *tmp = malloc(length);
+	char page[PAGE_SIZE];
+	int total = 0;
+	size_t i, n;
+
+	if(!tmp) {
+		printf("couldn't allocate %zu bytes to sort through\n",length);
+		exit(1);
+	}
+
+	srand(4856);
+
+	page_table_advise(page_table_get_virtmem(pt),length,PAGE_ADVICE_SEQUENTIAL);
+	for(i=0;i<length;i+=n) {
+		n = length-i < PAGE_SIZE ? length-i : PAGE_SIZE;
+		size_t k;
+		for(k=0;k<n;k++) page[k] = rand();
+		page_table_write(pt,i,page,n);
+	}
+
+	page_table_advise(page_table_get_virtmem(pt),length,PAGE_ADVICE_RANDOM);
+	soft_merge_sort(pt,0,length,tmp);
+
+	page_table_advise(page_table_get_virtmem(pt),length,PAGE_ADVICE_SEQUENTIAL);
+	for(i=0;i<length;i++) {
+		total += page_table_load(pt,i);
+	}
+
+	free(tmp);
+
+	printf("sort result is %d\n",total);
+}
+
+void soft_scan_program( struct page_table *pt, size_t length )
+{
+	size_t i;
+	unsigned j;
+	unsigned total = 0;
+
+	page_table_advise(page_table_get_virtmem(pt),length,PAGE_ADVICE_SEQUENTIAL);
+	for(i=0;i<length;i++) {
+		page_table_store(pt,i,i%256);
+	}
+
+	for(j=0;j<10;j++) {
+		for(i=0;i<length;i++) {
+			total += (unsigned char) page_table_load(pt,i);
+		}
+	}
+
+	printf("scan result is %d\n",total);
+}
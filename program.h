@@ -1,13 +1,43 @@
 /*
-Do not modify this file.
-Make all of your changes to main.c instead.
+The test programs the pager runs over its virtual memory.
 */
 
 #ifndef PROGRAM_H
 #define PROGRAM_H
 
-void scan_program( char *data, int length );
-void sort_program( char *data, int length );
-void focus_program( char *data, int length );
+#include <stddef.h>
+
+void scan_program( char *data, size_t length );
+void sort_program( char *data, size_t length );
+void focus_program( char *data, size_t length );
+
+/*
+All of the programs describe how they are about to walk their data with
+page_table_advise.  The hints have no effect unless the pager acts on them.
+*/
+
+/*
+Parallel versions of the programs above.  The data is split into "nthreads"
+contiguous chunks, each worked on by its own thread, so that page faults
+are taken concurrently.
+*/
+
+void parallel_scan_program( char *data, size_t length, int nthreads );
+void parallel_sort_program( char *data, size_t length, int nthreads );
+void parallel_focus_program( char *data, size_t length, int nthreads );
+
+/*
+Versions of the programs above that run on the virtual memory of "pt" through
+the software access functions of page_table.h instead of plain loads and stores.
+Scan and focus make exactly the same accesses as their plain versions; sort
+uses a merge sort of its own through a buffer outside the virtual memory, so
+its accesses only approximate those of the qsort in sort_program.
+*/
+
+struct page_table;
+
+void soft_scan_program( struct page_table *pt, size_t length );
+void soft_sort_program( struct page_table *pt, size_t length );
+void soft_focus_program( struct page_table *pt, size_t length );
 
 #endif
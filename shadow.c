@@ -0,0 +1,320 @@
+
+#include "shadow.h"
+
+#include <stdlib.h>
+
+/*
+Every page held by a shadow has a node, linked into the fifo list (which
+is the first-chance list under SHADOW_2FIFO) or the second-chance list,
+oldest at the head, and into a hash chain by key.  Nodes are referred to
+by index; -1 ends a list.  Under SHADOW_GREEDY the nodes are also kept in
+a binary min-heap on their credit, like the pager's GreedyDual frames.
+*/
+
+#define SHADOW_FIRST  0
+#define SHADOW_SECOND 1
+
+struct shadow_node {
+	unsigned long long key;
+	int list;
+	int dirty;
+	int prev;
+	int next;
+	int hnext;
+	double credit;
+	int heap_pos;
+};
+
+struct shadow {
+	int policy;
+	int nframes;
+	int first_size;
+	int second_size;
+	struct shadow_node *nodes;
+	int free;
+	int *buckets;
+	int nbuckets;
+	int head[2];
+	int tail[2];
+	int count[2];
+	unsigned seed;
+	int *heap;
+	int heap_size;
+	double inflation;
+	double read_cost;
+	double write_cost;
+	long long accesses;
+	long long misses;
+};
+
+static const char *policy_names[SHADOW_POLICIES] = { "rand", "fifo", "2fifo", "custom", "greedy" };
+
+static unsigned shadow_hash( struct shadow *s, unsigned long long key )
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	return (unsigned) key & (s->nbuckets-1);
+}
+
+static int shadow_lookup( struct shadow *s, unsigned long long key )
+{
+	int n;
+	for(n=s->buckets[shadow_hash(s,key)];n>=0;n=s->nodes[n].hnext) {
+		if(s->nodes[n].key==key) return n;
+	}
+	return -1;
+}
+
+static void shadow_append( struct shadow *s, int n, int list )
+{
+	struct shadow_node *node = &s->nodes[n];
+	node->list = list;
+	node->next = -1;
+	node->prev = s->tail[list];
+	if(s->tail[list]>=0) s->nodes[s->tail[list]].next = n;
+	else s->head[list] = n;
+	s->tail[list] = n;
+	s->count[list]++;
+}
+
+static void shadow_unlink( struct shadow *s, int n )
+{
+	struct shadow_node *node = &s->nodes[n];
+	if(node->prev>=0) s->nodes[node->prev].next = node->next;
+	else s->head[node->list] = node->next;
+	if(node->next>=0) s->nodes[node->next].prev = node->prev;
+	else s->tail[node->list] = node->prev;
+	s->count[node->list]--;
+}
+
+/* Restore the heap order around a node whose credit has changed. */
+
+static void shadow_sift( struct shadow *s, int pos )
+{
+	int n = s->heap[pos];
+	double credit = s->nodes[n].credit;
+
+	while(pos>0 && s->nodes[s->heap[(pos-1)/2]].credit>credit) {
+		s->heap[pos] = s->heap[(pos-1)/2];
+		s->nodes[s->heap[pos]].heap_pos = pos;
+		pos = (pos-1)/2;
+	}
+	for(;;) {
+		int child = 2*pos+1;
+		if(child>=s->heap_size) break;
+		if(child+1<s->heap_size && s->nodes[s->heap[child+1]].credit<s->nodes[s->heap[child]].credit) child++;
+		if(s->nodes[s->heap[child]].credit>=credit) break;
+		s->heap[pos] = s->heap[child];
+		s->nodes[s->heap[pos]].heap_pos = pos;
+		pos = child;
+	}
+	s->heap[pos] = n;
+	s->nodes[n].heap_pos = pos;
+}
+
+/*
+Give a node the inflation value plus what evicting it costs as its credit,
+putting it on the heap if it is not there yet.
+*/
+
+static void shadow_credit( struct shadow *s, int n, int insert )
+{
+	struct shadow_node *node = &s->nodes[n];
+	node->credit = s->inflation + s->read_cost + (node->dirty ? s->write_cost : 0);
+	if(insert) {
+		node->heap_pos = s->heap_size;
+		s->heap[s->heap_size++] = n;
+	}
+	shadow_sift(s,node->heap_pos);
+}
+
+/* Drop a page from the shadow altogether, returning its node to the free list. */
+
+static void shadow_drop( struct shadow *s, int n )
+{
+	int *link = &s->buckets[shadow_hash(s,s->nodes[n].key)];
+	while(*link!=n) link = &s->nodes[*link].hnext;
+	*link = s->nodes[n].hnext;
+
+	if(s->policy==SHADOW_GREEDY) {
+		int pos = s->nodes[n].heap_pos;
+		int last = s->heap[--s->heap_size];
+		if(pos<s->heap_size) {
+			s->heap[pos] = last;
+			s->nodes[last].heap_pos = pos;
+			shadow_sift(s,pos);
+		}
+	}
+
+	shadow_unlink(s,n);
+	s->nodes[n].next = s->free;
+	s->free = n;
+}
+
+/*
+Pick the page the policy would evict when every frame is full.
+*/
+
+static int shadow_victim( struct shadow *s )
+{
+	int n, i;
+
+	switch(s->policy) {
+		case SHADOW_RAND:
+			return rand_r(&s->seed) % s->nframes;
+		case SHADOW_2FIFO:
+			if(s->head[SHADOW_SECOND]>=0) return s->head[SHADOW_SECOND];
+			return s->head[SHADOW_FIRST];
+		case SHADOW_CUSTOM:
+			// Like the pager's custom policy, the page "chance" places back
+			// from the one before the newest, or the oldest if there are fewer
+			n = s->head[SHADOW_FIRST];
+			if(s->tail[SHADOW_FIRST]>=0) {
+				int chance = s->nframes*5/6;
+				int node = s->nodes[s->tail[SHADOW_FIRST]].prev;
+				for(i=0;node>=0 && i<chance;i++) {
+					n = node;
+					node = s->nodes[node].prev;
+				}
+			}
+			return n;
+		case SHADOW_GREEDY:
+			// The least credit, which the inflation value then rises to
+			n = s->heap[0];
+			if(s->nodes[n].credit>s->inflation) s->inflation = s->nodes[n].credit;
+			return n;
+		default:
+			return s->head[SHADOW_FIRST];
+	}
+}
+
+/*
+Under SHADOW_2FIFO, bump pages from the first-chance list to the second while
+the first is over its size, and drop them from the second while that one is.
+*/
+
+static void shadow_trim( struct shadow *s )
+{
+	while(s->count[SHADOW_FIRST]>s->first_size) {
+		int n = s->head[SHADOW_FIRST];
+		shadow_unlink(s,n);
+		shadow_append(s,n,SHADOW_SECOND);
+	}
+	while(s->count[SHADOW_SECOND]>s->second_size) {
+		shadow_drop(s,s->head[SHADOW_SECOND]);
+	}
+}
+
+struct shadow * shadow_create( int policy, int nframes, unsigned seed )
+{
+	struct shadow *s;
+	int i;
+
+	if(policy<0 || policy>=SHADOW_POLICIES || nframes<1) return 0;
+
+	s = malloc(sizeof(struct shadow));
+	if(!s) return 0;
+
+	s->policy = policy;
+	s->nframes = nframes;
+	s->seed = seed;
+	s->accesses = s->misses = 0;
+	s->heap_size = 0;
+	s->inflation = 0;
+	s->read_cost = s->write_cost = 1;
+
+	// The same split as the pager's 2FIFO lists
+	if(nframes<5) {
+		s->first_size = nframes-1;
+		s->second_size = 1;
+	} else {
+		s->first_size = nframes*3/4 + (nframes%4!=0);
+		s->second_size = nframes/4;
+	}
+
+	for(s->nbuckets=1;s->nbuckets<2*nframes;s->nbuckets*=2) {}
+	s->nodes = malloc(sizeof(struct shadow_node)*nframes);
+	s->buckets = malloc(sizeof(int)*s->nbuckets);
+	s->heap = policy==SHADOW_GREEDY ? malloc(sizeof(int)*nframes) : 0;
+	if(!s->nodes || !s->buckets || (policy==SHADOW_GREEDY && !s->heap)) {
+		shadow_delete(s);
+		return 0;
+	}
+
+	for(i=0;i<s->nbuckets;i++) s->buckets[i] = -1;
+	for(i=0;i<nframes;i++) s->nodes[i].next = i+1<nframes ? i+1 : -1;
+	s->free = 0;
+	for(i=0;i<2;i++) {
+		s->head[i] = s->tail[i] = -1;
+		s->count[i] = 0;
+	}
+
+	return s;
+}
+
+int shadow_access( struct shadow *s, unsigned long long key, int write )
+{
+	int n = shadow_lookup(s,key);
+
+	s->accesses++;
+	if(n>=0) {
+		// Under SHADOW_GREEDY a page first written costs a write as well from then on
+		if(s->policy==SHADOW_GREEDY && write && !s->nodes[n].dirty) {
+			s->nodes[n].dirty = 1;
+			shadow_credit(s,n,0);
+		}
+		s->nodes[n].dirty |= write;
+		// A page on the second-chance list gets another go without a read
+		if(s->policy==SHADOW_2FIFO && s->nodes[n].list==SHADOW_SECOND) {
+			shadow_unlink(s,n);
+			shadow_append(s,n,SHADOW_FIRST);
+			shadow_trim(s);
+		}
+		return 0;
+	}
+
+	s->misses++;
+	if(s->free<0) shadow_drop(s,shadow_victim(s));
+
+	n = s->free;
+	s->free = s->nodes[n].next;
+	s->nodes[n].key = key;
+	s->nodes[n].dirty = write;
+
+	unsigned h = shadow_hash(s,key);
+	s->nodes[n].hnext = s->buckets[h];
+	s->buckets[h] = n;
+
+	shadow_append(s,n,SHADOW_FIRST);
+	if(s->policy==SHADOW_2FIFO) shadow_trim(s);
+	if(s->policy==SHADOW_GREEDY) shadow_credit(s,n,1);
+
+	return 1;
+}
+
+void shadow_set_costs( struct shadow *s, double read, double write )
+{
+	s->read_cost = read>0 ? read : 1;
+	s->write_cost = write>0 ? write : 1;
+}
+
+void shadow_get_counts( struct shadow *s, long long *accesses, long long *misses, int clear )
+{
+	*accesses = s->accesses;
+	*misses = s->misses;
+	if(clear) s->accesses = s->misses = 0;
+}
+
+const char * shadow_policy_name( int policy )
+{
+	return policy>=0 && policy<SHADOW_POLICIES ? policy_names[policy] : "unknown";
+}
+
+void shadow_delete( struct shadow *s )
+{
+	free(s->nodes);
+	free(s->buckets);
+	free(s->heap);
+	free(s);
+}
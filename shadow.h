@@ -0,0 +1,61 @@
+
+#ifndef SHADOW_H
+#define SHADOW_H
+
+/*
+Shadow simulations of the replacement policies.  A shadow keeps no page
+contents, only the keys of the pages it would hold in "nframes" frames,
+and counts how often the references fed to it would have missed.
+A key can be any number identifying a page, such as its address space and
+page number packed together.
+*/
+
+#define SHADOW_RAND   0
+#define SHADOW_FIFO   1
+#define SHADOW_2FIFO  2
+#define SHADOW_CUSTOM 3
+#define SHADOW_GREEDY 4
+#define SHADOW_POLICIES 5
+
+struct shadow;
+
+/*
+Create a shadow of "policy" holding up to "nframes" pages.
+"seed" drives the random choices of SHADOW_RAND.
+Returns a pointer to a new shadow, or null on failure.
+*/
+
+struct shadow * shadow_create( int policy, int nframes, unsigned seed );
+
+/*
+Feed one reference to the page "key" to the shadow, "write" set if the page
+is being modified.  Returns 1 if the shadow would have had to read the page
+in, 0 if it still held it.
+*/
+
+int shadow_access( struct shadow *s, unsigned long long key, int write );
+
+/*
+Set what reading a page in and writing one out cost, such as the disk
+latencies measured so far, for SHADOW_GREEDY to weigh its pages by.
+Both are one until set, and a cost not above zero counts as one.
+*/
+
+void shadow_set_costs( struct shadow *s, double read, double write );
+
+/*
+Get the references and misses counted since the shadow was created or the
+counts were last cleared, and optionally clear them.
+*/
+
+void shadow_get_counts( struct shadow *s, long long *accesses, long long *misses, int clear );
+
+/* Return the name of a shadow policy. */
+
+const char * shadow_policy_name( int policy );
+
+/* Delete a shadow. */
+
+void shadow_delete( struct shadow *s );
+
+#endif
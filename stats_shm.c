@@ -0,0 +1,134 @@
+
+#include "stats_shm.h"
+
+#include <unistd.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#define STATS_SHM_TRIES 1000
+
+/* Names given to shm_open have to start with a slash. */
+
+static void shm_name( const char *name, char *buf, size_t len )
+{
+	snprintf(buf,len,"%s%s",name[0]=='/' ? "" : "/",name);
+}
+
+struct stats_shm * stats_shm_create( const char *name )
+{
+	char path[256];
+	struct stats_shm *s;
+	int fd;
+
+	shm_name(name,path,sizeof(path));
+	fd = shm_open(path,O_CREAT|O_RDWR,0644);
+	if(fd<0) return 0;
+
+	if(ftruncate(fd,sizeof(struct stats_shm))<0) {
+		close(fd);
+		return 0;
+	}
+
+	s = mmap(0,sizeof(struct stats_shm),PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	close(fd);
+	if(s==MAP_FAILED) return 0;
+
+	// Readers of a stale segment see an update in progress until it is set up
+	__atomic_store_n(&s->seq,1,__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memset((char *)s+offsetof(struct stats_shm,pid),0,sizeof(struct stats_shm)-offsetof(struct stats_shm,pid));
+	s->magic = STATS_SHM_MAGIC;
+	s->version = STATS_SHM_VERSION;
+	s->size = sizeof(struct stats_shm);
+	s->pid = getpid();
+	s->running = 1;
+	__atomic_store_n(&s->seq,2,__ATOMIC_RELEASE);
+
+	return s;
+}
+
+void stats_shm_begin( struct stats_shm *s )
+{
+	unsigned seq = __atomic_load_n(&s->seq,__ATOMIC_RELAXED);
+
+	// Take the sequence number from even to odd, waiting out other writers
+	for(;;) {
+		if(!(seq&1) && __atomic_compare_exchange_n(&s->seq,&seq,seq+1,0,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED)) break;
+		if(seq&1) {
+			sched_yield();
+			seq = __atomic_load_n(&s->seq,__ATOMIC_RELAXED);
+		}
+	}
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void stats_shm_end( struct stats_shm *s )
+{
+	__atomic_add_fetch(&s->seq,1,__ATOMIC_RELEASE);
+}
+
+int stats_shm_bucket( long long ns )
+{
+	int b;
+	if(ns<1) return 0;
+	b = 63-__builtin_clzll((unsigned long long)ns);
+	return b<STATS_SHM_BUCKETS ? b : STATS_SHM_BUCKETS-1;
+}
+
+struct stats_shm * stats_shm_open( const char *name )
+{
+	char path[256];
+	struct stats_shm *s;
+	int fd;
+
+	shm_name(name,path,sizeof(path));
+	fd = shm_open(path,O_RDONLY,0);
+	if(fd<0) return 0;
+
+	s = mmap(0,sizeof(struct stats_shm),PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if(s==MAP_FAILED) return 0;
+
+	if(s->magic!=STATS_SHM_MAGIC || s->version!=STATS_SHM_VERSION || s->size<sizeof(struct stats_shm)) {
+		munmap(s,sizeof(struct stats_shm));
+		errno = EPROTO;
+		return 0;
+	}
+	return s;
+}
+
+int stats_shm_read( struct stats_shm *s, struct stats_shm *copy )
+{
+	unsigned before, after;
+	int i;
+
+	for(i=0;i<STATS_SHM_TRIES;i++) {
+		before = __atomic_load_n(&s->seq,__ATOMIC_ACQUIRE);
+		if(before&1) {
+			sched_yield();
+			continue;
+		}
+		memcpy(copy,s,sizeof(struct stats_shm));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&s->seq,__ATOMIC_RELAXED);
+		if(before==after) return 0;
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+void stats_shm_close( struct stats_shm *s, const char *name )
+{
+	char path[256];
+
+	munmap(s,sizeof(struct stats_shm));
+	if(name) {
+		shm_name(name,path,sizeof(path));
+		shm_unlink(path);
+	}
+}
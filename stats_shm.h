@@ -0,0 +1,94 @@
+
+#ifndef STATS_SHM_H
+#define STATS_SHM_H
+
+/*
+A shared memory segment through which a running pager publishes its
+statistics, for tools such as virtmem-top to read while it runs.
+Updates are guarded by a sequence lock: the sequence number is odd while
+an update is in progress, so readers never block the pager, they just
+retry when a copy raced with an update.  Any number of threads may update
+the segment; they take turns on the sequence number itself.
+*/
+
+#define STATS_SHM_MAGIC   0x766d7374
+#define STATS_SHM_VERSION 1
+#define STATS_SHM_BUCKETS 32
+
+struct stats_shm {
+	unsigned magic;
+	unsigned version;
+	unsigned size;		/* Of the whole segment, so newer fields can be added */
+	unsigned seq;		/* Odd while an update is in progress */
+
+	int pid;
+	int running;		/* Cleared when the pager is done */
+	char policy[16];	/* The live replacement policy */
+	int adaptive;		/* Set if the live policy is picked by the pager */
+	int npages;
+	int nframes;
+	int nspaces;
+	int nthreads;
+	long long updated_ns;	/* CLOCK_MONOTONIC time of the last update */
+
+	long long page_faults;
+	long long disk_reads;
+	long long disk_writes;
+	long long evictions;
+	long long fault_arounds;
+	long long readaheads;
+	long long discards;
+	long long traps;
+
+	/* Faults that took from 2^i up to 2^(i+1) nanoseconds to handle */
+	long long latency[STATS_SHM_BUCKETS];
+
+	/* State of the frames and policy lists at the last scan */
+	long long scanned_ns;
+	int free_frames;
+	int busy_frames;
+	int pinned_frames;
+	int dirty_frames;
+	int first_list;		/* The FIFO list, or the 2FIFO first-chance list */
+	int second_list;	/* The 2FIFO second-chance list */
+};
+
+/*
+Create (or take over) the segment "name", which is given to shm_open with
+a leading slash added if it has none.  The segment is zeroed apart from
+its header and the pid.  Returns a pointer to it, or null on failure.
+*/
+
+struct stats_shm * stats_shm_create( const char *name );
+
+/*
+Begin and end an update of the segment.  Between the two the fields may
+be changed freely; readers see either all of the changes or none.
+*/
+
+void stats_shm_begin( struct stats_shm *s );
+void stats_shm_end( struct stats_shm *s );
+
+/* Return the latency bucket of a fault that took "ns" nanoseconds. */
+
+int stats_shm_bucket( long long ns );
+
+/*
+Map the segment "name" read-only.  Returns null with errno set if it does
+not exist, or to EPROTO if it was written by an incompatible pager.
+*/
+
+struct stats_shm * stats_shm_open( const char *name );
+
+/*
+Copy a consistent snapshot of the segment into "copy".  Returns 0, or -1
+if an update was still in progress after many tries.
+*/
+
+int stats_shm_read( struct stats_shm *s, struct stats_shm *copy );
+
+/* Unmap a segment, and remove it by name if "name" is not null. */
+
+void stats_shm_close( struct stats_shm *s, const char *name );
+
+#endif
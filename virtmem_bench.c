@@ -0,0 +1,743 @@
+/*
+Microbenchmarks of the primitives a page fault is made of, so that a change
+in the cost of faults can be traced to signal delivery, the system calls
+behind page_table_set_entry, victim selection or disk I/O.  Every benchmark
+first finds how many operations take about MEASURE_NS, runs that many a few
+times to warm up, and then times as many repetitions of them, reporting the
+mean time per operation with its spread over the repetitions.  Results can
+be saved as a baseline for later runs to be compared against.
+*/
+
+#define _GNU_SOURCE
+
+#include "page_table.h"
+#include "disk.h"
+#include "shadow.h"
+#include "frames.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define MEASURE_NS 20000000LL // Aim for repetitions about this long
+#define MAX_BENCHES 64
+#define NAME_LENGTH 48
+#define FAULT_PAGES 64        // Pages, and frames, of the fault benchmarks
+#define FRAMES 64             // Frames of the set_entry benchmarks
+#define DISK_BLOCKS 4096      // Blocks of the scratch disk
+#define BATCH_BLOCKS 8        // Blocks of the batched disk benchmarks
+
+// Policies of the victim selection benchmarks, run on the lists of frames.h
+enum victim_e { VICTIM_FIFO, VICTIM_2FIFO, VICTIM_CUSTOM, VICTIM_GREEDY, VICTIMS };
+const char *victim_names[VICTIMS] = { "fifo", "2fifo", "custom", "greedy" };
+
+struct bench {
+    char name[NAME_LENGTH];
+    int (*setup)(struct bench *b);
+    void (*run)(long long ops);
+    void (*teardown)();
+    int size;   // Pages, frames or blocks a batch, for the benchmarks measured against them
+    int policy; // Policy of the victim selection and shadow benchmarks
+};
+struct bench benches[MAX_BENCHES];
+int nbenches = 0;
+
+struct result {
+    char name[NAME_LENGTH];
+    double mean;   // Nanoseconds per operation
+    double stddev; // Over the repetitions
+    double min;
+    long long ops;  // Operations per repetition
+};
+
+struct args {
+    int warmup;             // Repetitions run before timing
+    int reps;               // Repetitions timed
+    long long ops;          // Operations per repetition, 0 to find out
+    const char *baseline;   // Results to compare against
+    const char *save;       // File to save the results in as a baseline
+    double threshold;       // Percent change below which a difference is not reported
+    char **only;            // Prefixes of the benchmarks to run, all if none
+    int nonly;
+    const char *memserver;  // Socket of a memory server to also time the remote disk against
+};
+struct args args;
+
+// State of the benchmark being run
+struct page_table *pt = NULL;
+struct disk *disk = NULL;
+struct shadow *shadow = NULL;
+char *mapping = NULL;
+size_t mapping_size = 0;
+int scratch_fd = -1;
+char scratch[64];                    // Name of the scratch file or disk
+char block[BLOCK_SIZE];
+char batch[BATCH_BLOCKS][BLOCK_SIZE];
+int batch_size = 1;                  // Blocks a request of the disk benchmarks
+int major = 0;                       // The fault handler reads the page from disk
+int victim_policy = 0;               // Policy and frames of the victim selection benchmarks
+int victim_frames = 0;
+unsigned long long next_key = 0;     // Next page never fed to the shadow or the lists
+unsigned long long random_state = 1;
+volatile sig_atomic_t signals = 0;
+int saved_stdout = -1;               // Standard output while it is silenced
+
+void usage();
+void add_bench(const char *name, int (*setup)(struct bench *), void (*run)(long long),
+               void (*teardown)(), int size, int policy);
+int selected(struct bench *b);
+int measure(struct bench *b, struct result *r);
+long long time_ops(struct bench *b, long long ops);
+void silence(int on);
+int load_baseline(const char *name, struct result *results, int max);
+int save_baseline(const char *name, struct result *results, int n);
+struct result * find_result(struct result *results, int n, const char *name);
+long long now_ns();
+int next_random(int n);
+
+void signal_handler(int sig);
+void fault_handler(struct page_table *pt, int page);
+int setup_signal(struct bench *b);
+void run_signal(long long ops);
+void teardown_signal();
+int setup_mprotect(struct bench *b);
+void run_mprotect(long long ops);
+int setup_remap(struct bench *b);
+void run_remap(long long ops);
+void teardown_mapping();
+int setup_page_table(struct bench *b);
+void run_set_entry(long long ops);
+void run_fault(long long ops);
+void teardown_page_table();
+int setup_victim(struct bench *b);
+void run_victim(long long ops);
+void teardown_victim();
+int setup_shadow(struct bench *b);
+void run_shadow(long long ops);
+void teardown_shadow();
+int setup_disk(struct bench *b);
+int setup_remote(struct bench *b);
+int fill_disk(struct bench *b);
+void run_disk_read(long long ops);
+void run_disk_write(long long ops);
+void run_disk_read_batch(long long ops);
+void teardown_disk();
+int setup_file(struct bench *b);
+void run_pread(long long ops);
+void run_pwrite(long long ops);
+void teardown_file();
+
+
+/**
+ * Main function.  Parses arguments, runs the benchmarks and compares them
+ * with the baseline if there is one.
+ */
+int main( int argc, char *argv[] ) {
+    args.warmup = 2;
+    args.reps = 10;
+    args.threshold = 5;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "w:r:n:b:o:t:M:")) != -1) {
+        switch (opt) {
+            case 'w': args.warmup = atoi(optarg); break;
+            case 'r': args.reps = atoi(optarg); break;
+            case 'n': args.ops = atoll(optarg); break;
+            case 'b': args.baseline = optarg; break;
+            case 'o': args.save = optarg; break;
+            case 't': args.threshold = atof(optarg); break;
+            case 'M': args.memserver = optarg; break;
+            default:  usage(); return 1;
+        }
+    }
+    if (args.warmup < 0 || args.reps < 2 || args.ops < 0 || args.threshold < 0) {
+        usage();
+        return 1;
+    }
+    args.only = &argv[optind];
+    args.nonly = argc - optind;
+
+    add_bench("signal", setup_signal, run_signal, teardown_signal, 0, 0);
+    add_bench("mprotect", setup_mprotect, run_mprotect, teardown_mapping, 0, 0);
+    add_bench("remap", setup_remap, run_remap, teardown_mapping, 0, 0);
+    add_bench("set-entry/npages=1k", setup_page_table, run_set_entry, teardown_page_table, 1 << 10, 0);
+    add_bench("set-entry/npages=64k", setup_page_table, run_set_entry, teardown_page_table, 1 << 16, 0);
+    add_bench("set-entry/npages=1m", setup_page_table, run_set_entry, teardown_page_table, 1 << 20, 0);
+    add_bench("minor-fault", setup_page_table, run_fault, teardown_page_table, FAULT_PAGES, 0);
+    add_bench("major-fault", setup_page_table, run_fault, teardown_page_table, FAULT_PAGES, 1);
+    const char *sizes[] = { "64", "4k", "256k" };
+    for (int p = 0; p < VICTIMS; ++p) {
+        char name[NAME_LENGTH];
+        for (int i = 0; i < 3; ++i) {
+            snprintf(name, sizeof(name), "victim/%s/nframes=%s", victim_names[p], sizes[i]);
+            add_bench(name, setup_victim, run_victim, teardown_victim, 64 << (6 * i), p);
+        }
+    }
+    for (int p = 0; p < SHADOW_POLICIES; ++p) {
+        char name[NAME_LENGTH];
+        for (int i = 0; i < 3; ++i) {
+            snprintf(name, sizeof(name), "shadow/%s/nframes=%s", shadow_policy_name(p), sizes[i]);
+            add_bench(name, setup_shadow, run_shadow, teardown_shadow, 64 << (6 * i), p);
+        }
+    }
+    add_bench("disk-read", setup_disk, run_disk_read, teardown_disk, 0, 0);
+    add_bench("disk-write", setup_disk, run_disk_write, teardown_disk, 0, 0);
+    add_bench("disk-read-batch/8", setup_disk, run_disk_read_batch, teardown_disk, BATCH_BLOCKS, 0);
+    if (args.memserver != NULL) {
+        add_bench("remote-read", setup_remote, run_disk_read, teardown_disk, 0, 0);
+        add_bench("remote-write", setup_remote, run_disk_write, teardown_disk, 0, 0);
+        add_bench("remote-read-batch/8", setup_remote, run_disk_read_batch, teardown_disk, BATCH_BLOCKS, 0);
+    }
+    add_bench("pread", setup_file, run_pread, teardown_file, 0, 0);
+    add_bench("pwrite", setup_file, run_pwrite, teardown_file, 0, 0);
+
+    struct result base[MAX_BENCHES], results[MAX_BENCHES];
+    int nbase = 0, nresults = 0, slower = 0;
+    char shape[32];
+    if (args.baseline != NULL && (nbase = load_baseline(args.baseline, base, MAX_BENCHES)) < 0) {
+        fprintf(stderr, "couldn't read baseline %s: %s\n", args.baseline, strerror(errno));
+        return 1;
+    }
+
+    printf("%-28s %10s %7s %10s %12s", "benchmark", "ns/op", "stddev", "min", "reps x ops");
+    if (args.baseline != NULL) printf(" %10s %8s", "baseline", "change");
+    printf("\n");
+
+    for (int i = 0; i < nbenches; ++i) {
+        struct result *r = &results[nresults];
+        if (!selected(&benches[i])) continue;
+        if (!measure(&benches[i], r)) {
+            fprintf(stderr, "couldn't run %s: %s\n", benches[i].name, strerror(errno));
+            continue;
+        }
+        ++nresults;
+        snprintf(shape, sizeof(shape), "%d x %lld", args.reps, r->ops);
+        printf("%-28s %10.1f %6.1f%% %10.1f %12s", r->name, r->mean, r->mean > 0 ? 100 * r->stddev / r->mean : 0.0, r->min, shape);
+
+        struct result *b = find_result(base, nbase, r->name);
+        if (b != NULL) {
+            // A change counts once it is beyond the threshold and the noise of both runs
+            double change = 100 * (r->mean - b->mean) / b->mean;
+            double noise = 2 * sqrt(r->stddev * r->stddev + b->stddev * b->stddev);
+            int real = fabs(change) > args.threshold && fabs(r->mean - b->mean) > noise;
+            printf(" %10.1f %+7.1f%%%s", b->mean, change, !real ? "" : change > 0 ? " slower" : " faster");
+            if (real && change > 0) ++slower;
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    if (args.save != NULL && !save_baseline(args.save, results, nresults)) {
+        fprintf(stderr, "couldn't save baseline %s: %s\n", args.save, strerror(errno));
+        return 1;
+    }
+    if (slower > 0) {
+        printf("%d benchmarks slower than the baseline\n", slower);
+        return 2;
+    }
+    return 0;
+}
+
+/**
+ * Prints the command line usage.
+ */
+void usage() {
+    printf("use: virtmem-bench [options] [benchmark...]\n");
+    printf("  time the primitives of the fault path, only the benchmarks starting with the\n");
+    printf("  names given if there are any, e.g. victim/2fifo or set-entry\n");
+    printf("  -w reps   untimed repetitions to warm up with (default 2)\n");
+    printf("  -r reps   timed repetitions, at least 2 (default 10)\n");
+    printf("  -n ops    operations per repetition (default as many as take about %lld ms)\n",
+        MEASURE_NS / 1000000);
+    printf("  -o file   save the results in file, as a baseline\n");
+    printf("  -b file   compare the results with the baseline in file, and exit with 2 if any\n");
+    printf("            is slower by more than the threshold and the spread of both runs\n");
+    printf("  -t pct    threshold for a change to count (default 5)\n");
+    printf("  -M socket also time the disk kept by virtmem-memserver listening on socket\n");
+}
+
+/**
+ * Adds a benchmark to the list.
+ */
+void add_bench(const char *name, int (*setup)(struct bench *), void (*run)(long long),
+               void (*teardown)(), int size, int policy) {
+    struct bench *b = &benches[nbenches++];
+    snprintf(b->name, sizeof(b->name), "%s", name);
+    b->setup = setup;
+    b->run = run;
+    b->teardown = teardown;
+    b->size = size;
+    b->policy = policy;
+}
+
+/**
+ * Whether a benchmark was asked for.
+ */
+int selected(struct bench *b) {
+    if (args.nonly == 0) return 1;
+    for (int i = 0; i < args.nonly; ++i) {
+        if (!strncmp(b->name, args.only[i], strlen(args.only[i]))) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Runs a benchmark: finds how many operations a repetition takes unless
+ * told, warms up, and times the repetitions.
+ * Returns 0 with errno set if it could not be set up.
+ */
+int measure(struct bench *b, struct result *r) {
+    long long ops = args.ops;
+    double sum = 0, squares = 0;
+
+    silence(1);
+    if (!b->setup(b)) {
+        int error = errno;
+        b->teardown();
+        silence(0);
+        errno = error;
+        return 0;
+    }
+
+    // Doubling until a repetition is long enough doubles as warming up
+    if (ops == 0) {
+        for (ops = 16; time_ops(b, ops) < MEASURE_NS / 2; ops *= 2) ;
+    }
+    for (int i = 0; i < args.warmup; ++i) time_ops(b, ops);
+
+    snprintf(r->name, sizeof(r->name), "%s", b->name);
+    r->min = 0;
+    for (int i = 0; i < args.reps; ++i) {
+        double per_op = (double) time_ops(b, ops) / ops;
+        sum += per_op;
+        squares += per_op * per_op;
+        if (i == 0 || per_op < r->min) r->min = per_op;
+    }
+    b->teardown();
+    silence(0);
+
+    r->mean = sum / args.reps;
+    double variance = (squares - sum * sum / args.reps) / (args.reps - 1);
+    r->stddev = variance > 0 ? sqrt(variance) : 0.0;
+    r->ops = ops;
+    return 1;
+}
+
+/**
+ * Times one repetition of "ops" operations, in nanoseconds.
+ */
+long long time_ops(struct bench *b, long long ops) {
+    long long start = now_ns();
+    b->run(ops);
+    return now_ns() - start;
+}
+
+/**
+ * The disk reports every block it moves on standard output, which would
+ * bury the results, so that goes to /dev/null while a benchmark runs.
+ */
+void silence(int on) {
+    fflush(stdout);
+    if (on) {
+        int null = open("/dev/null", O_WRONLY);
+        saved_stdout = dup(1);
+        if (null >= 0) {
+            dup2(null, 1);
+            close(null);
+        }
+    } else if (saved_stdout >= 0) {
+        dup2(saved_stdout, 1);
+        close(saved_stdout);
+        saved_stdout = -1;
+    }
+}
+
+/**
+ * Reads the results saved by an earlier run.  Returns how many there are,
+ * or -1 with errno set if the file cannot be read.
+ */
+int load_baseline(const char *name, struct result *results, int max) {
+    FILE *file = fopen(name, "r");
+    char line[256];
+    int n = 0;
+
+    if (file == NULL) return -1;
+    while (n < max && fgets(line, sizeof(line), file) != NULL) {
+        struct result *r = &results[n];
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%47s %lf %lf %lf", r->name, &r->mean, &r->stddev, &r->min) == 4 && r->mean > 0) ++n;
+    }
+    fclose(file);
+    return n;
+}
+
+/**
+ * Saves results as a baseline, one benchmark per line.  Returns 0 with
+ * errno set if the file cannot be written.
+ */
+int save_baseline(const char *name, struct result *results, int n) {
+    FILE *file = fopen(name, "w");
+    if (file == NULL) return 0;
+    fprintf(file, "# benchmark ns/op stddev min\n");
+    for (int i = 0; i < n; ++i) {
+        fprintf(file, "%s %.2f %.2f %.2f\n", results[i].name, results[i].mean, results[i].stddev, results[i].min);
+    }
+    return fclose(file) == 0;
+}
+
+struct result * find_result(struct result *results, int n, const char *name) {
+    for (int i = 0; i < n; ++i) {
+        if (!strcmp(results[i].name, name)) return &results[i];
+    }
+    return NULL;
+}
+
+/**
+ * Nanoseconds on the monotonic clock.
+ */
+long long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * A number below "n", from a generator of its own so that every run picks
+ * the same blocks.
+ */
+int next_random(int n) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return (int) (random_state % n);
+}
+
+
+// Signal delivery ------------------------------------------------------------
+// A signal sent to the process itself and handled, with nothing to do.
+
+void signal_handler(int sig) {
+    ++signals;
+}
+
+int setup_signal(struct bench *b) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signal_handler;
+    sigemptyset(&sa.sa_mask);
+    return sigaction(SIGUSR1, &sa, NULL) == 0;
+}
+
+void run_signal(long long ops) {
+    for (long long i = 0; i < ops; ++i) raise(SIGUSR1);
+}
+
+void teardown_signal() {
+    signal(SIGUSR1, SIG_DFL);
+}
+
+
+// System calls behind the page table -----------------------------------------
+// mprotect takes access to one page away and gives it back, two calls an
+// operation.  remap_file_pages points one page of a shared mapping at the
+// other of the two pages of its file and back, also two calls.
+
+int setup_mprotect(struct bench *b) {
+    mapping_size = PAGE_SIZE;
+    mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        mapping = NULL;
+        return 0;
+    }
+    mapping[0] = 1;
+    return 1;
+}
+
+void run_mprotect(long long ops) {
+    for (long long i = 0; i < ops; ++i) {
+        mprotect(mapping, PAGE_SIZE, PROT_NONE);
+        mprotect(mapping, PAGE_SIZE, PROT_READ | PROT_WRITE);
+    }
+}
+
+int setup_remap(struct bench *b) {
+    snprintf(scratch, sizeof(scratch), "/tmp/virtmem-bench.%d", getpid());
+    scratch_fd = open(scratch, O_CREAT | O_TRUNC | O_RDWR, 0600);
+    if (scratch_fd < 0) return 0;
+    unlink(scratch);
+    if (ftruncate(scratch_fd, 2 * PAGE_SIZE) < 0) return 0;
+    mapping_size = 2 * PAGE_SIZE;
+    mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, scratch_fd, 0);
+    if (mapping == MAP_FAILED) {
+        mapping = NULL;
+        return 0;
+    }
+    mapping[0] = mapping[PAGE_SIZE] = 1;
+    return 1;
+}
+
+void run_remap(long long ops) {
+    for (long long i = 0; i < ops; ++i) {
+        remap_file_pages(mapping, PAGE_SIZE, 0, 1, 0);
+        remap_file_pages(mapping, PAGE_SIZE, 0, 0, 0);
+    }
+}
+
+void teardown_mapping() {
+    if (mapping != NULL) munmap(mapping, mapping_size);
+    if (scratch_fd >= 0) close(scratch_fd);
+    mapping = NULL;
+    scratch_fd = -1;
+}
+
+
+// Page table -----------------------------------------------------------------
+// set_entry maps a page read-only and unmaps it again, two calls an
+// operation, over pages spread across a page table of "size" pages.  A minor
+// fault is the round trip from touching a page without access, through the
+// signal and the handler mapping it, back to the access; each operation
+// first takes access away again with set_entry.  A major fault is the same
+// with the handler reading the page from the scratch disk first.
+
+void fault_handler(struct page_table *pt, int page) {
+    if (major) disk_read(disk, page, page_table_get_physmem(pt) + (size_t) page * PAGE_SIZE);
+    page_table_set_entry(pt, page, page, PROT_READ | PROT_WRITE);
+}
+
+int setup_page_table(struct bench *b) {
+    major = b->policy;
+    if (major && !setup_disk(b)) return 0;
+    pt = page_table_create(b->size, b->size < FRAMES ? b->size : FRAMES, fault_handler);
+    return pt != NULL;
+}
+
+void run_set_entry(long long ops) {
+    int npages = page_table_get_npages(pt);
+    for (long long i = 0; i < ops; ++i) {
+        // A stride coprime with the size visits every page, far apart
+        int page = (int) (i * 4099 % npages);
+        page_table_set_entry(pt, page, (int) (i % FRAMES), PROT_READ);
+        page_table_set_entry(pt, page, (int) (i % FRAMES), PROT_NONE);
+    }
+}
+
+void run_fault(long long ops) {
+    char *virtmem = page_table_get_virtmem(pt);
+    for (long long i = 0; i < ops; ++i) {
+        int page = (int) (i % FAULT_PAGES);
+        page_table_set_entry(pt, page, page, PROT_NONE);
+        virtmem[(size_t) page * PAGE_SIZE] = 1;
+    }
+}
+
+void teardown_page_table() {
+    if (pt != NULL) page_table_delete(pt);
+    pt = NULL;
+    if (major) teardown_disk();
+    major = 0;
+}
+
+
+// Victim selection -----------------------------------------------------------
+// The lists and heap the replacement policies of main.c keep their frames
+// on (see frames.h), driven the way the fault handlers drive them: they are
+// filled with "size" frames and then every operation is a miss that takes
+// the policy's victim off and puts the frame back on with a page never seen
+// before (filling them already leaves them as they stay), every other one dirty so that the custom policy has clean pages
+// to look for and GreedyDual two costs.  Under 2FIFO a page bumped to the
+// second-chance list also loses its access in the pager, which is the
+// set_entry benchmark and is left out here.
+
+int setup_victim(struct bench *b) {
+    frame_table = calloc(b->size, sizeof(f_node));
+    greedy_heap = malloc(b->size * sizeof(int));
+    if (frame_table == NULL || greedy_heap == NULL) {
+        teardown_victim();
+        return 0;
+    }
+    victim_policy = b->policy;
+    victim_frames = b->size;
+    fifo_head = fifo_tail = NULL;
+    ff_head = ff_tail = sf_head = sf_tail = NULL;
+    f_entries = s_entries = 0;
+    split_lists(b->size);
+    greedy_size = 0;
+    greedy_inflation = 0;
+    greedy_read_ns = 100000;
+    greedy_write_ns = 200000;
+
+    for (int i = 0; i < b->size; ++i) {
+        frame_table[i].page = i;
+        frame_table[i].bits = (i & 1) ? PROT_READ | PROT_WRITE : PROT_READ;
+        switch (victim_policy) {
+            case VICTIM_2FIFO:  sfo_insert(&frame_table[i]); break;
+            case VICTIM_GREEDY: greedy_insert(i); break;
+            default:            fifo_insert(i); break;
+        }
+    }
+    next_key = b->size;
+    return 1;
+}
+
+void run_victim(long long ops) {
+    int frame_index = -1;
+    f_node *node;
+
+    for (long long i = 0; i < ops; ++i) {
+        switch (victim_policy) {
+            case VICTIM_FIFO:
+                frame_index = fifo_remove();
+                break;
+            case VICTIM_CUSTOM:
+                if ((frame_index = find_clean_frame(victim_frames)) < 0) frame_index = fifo_remove();
+                break;
+            case VICTIM_2FIFO:
+                node = sfo_victim();
+                if (node->f_list == 1) {
+                    frame_index = sfo_remove(node, &ff_head);
+                    f_entries--;
+                } else {
+                    frame_index = sfo_remove(node, &sf_head);
+                    s_entries--;
+                }
+                break;
+            case VICTIM_GREEDY:
+                frame_index = greedy_remove();
+                break;
+        }
+        frame_table[frame_index].page = (int) next_key;
+        frame_table[frame_index].bits = (next_key & 1) ? PROT_READ | PROT_WRITE : PROT_READ;
+        ++next_key;
+        switch (victim_policy) {
+            case VICTIM_2FIFO:  sfo_insert(&frame_table[frame_index]); break;
+            case VICTIM_GREEDY: greedy_insert(frame_index); break;
+            default:            fifo_insert(frame_index); break;
+        }
+    }
+}
+
+void teardown_victim() {
+    free(frame_table);
+    free(greedy_heap);
+    frame_table = NULL;
+    greedy_heap = NULL;
+}
+
+
+// Shadows --------------------------------------------------------------------
+// The shadow simulations of the policies (see shadow.h) that the adaptive
+// policy feeds sampled faults to, filled with "size" pages and then fed pages
+// never seen before, every one a miss that evicts, and every other one a
+// write so that the policies preferring clean pages have some to look for.
+
+int setup_shadow(struct bench *b) {
+    shadow = shadow_create(b->policy, b->size, 1);
+    if (shadow == NULL) return 0;
+    next_key = 0;
+    run_shadow(b->size);
+    return 1;
+}
+
+void run_shadow(long long ops) {
+    for (long long i = 0; i < ops; ++i) {
+        shadow_access(shadow, next_key, (int) (next_key & 1));
+        ++next_key;
+    }
+}
+
+void teardown_shadow() {
+    if (shadow != NULL) shadow_delete(shadow);
+    shadow = NULL;
+}
+
+
+// Disk I/O -------------------------------------------------------------------
+// A block read or written at random through the virtual disk, with its I/O
+// queue and thread, and through pread and pwrite on a file of the same
+// size, which is what the disk's thread does in the end.  The batched
+// benchmarks read "size" blocks a request and still time each block.  With
+// -M the same runs against a disk kept by a memory server.
+
+int setup_disk(struct bench *b) {
+    const char *name = scratch;
+    snprintf(scratch, sizeof(scratch), "/tmp/virtmem-bench.%d", getpid());
+    disk = disk_open_striped(&name, 1, 1, BLOCK_SIZE, DISK_BLOCKS);
+    return fill_disk(b);
+}
+
+int setup_remote(struct bench *b) {
+    scratch[0] = '\0';
+    disk = disk_open_remote(args.memserver, BLOCK_SIZE, DISK_BLOCKS);
+    return fill_disk(b);
+}
+
+int fill_disk(struct bench *b) {
+    if (disk == NULL) return 0;
+    batch_size = b->size > 0 ? b->size : 1;
+    memset(block, 1, sizeof(block));
+    for (int i = 0; i < DISK_BLOCKS; ++i) disk_write(disk, i, block);
+    return 1;
+}
+
+void run_disk_read(long long ops) {
+    for (long long i = 0; i < ops; ++i) disk_read(disk, next_random(DISK_BLOCKS), block);
+}
+
+void run_disk_write(long long ops) {
+    for (long long i = 0; i < ops; ++i) disk_write(disk, next_random(DISK_BLOCKS), block);
+}
+
+void run_disk_read_batch(long long ops) {
+    int blocks[BATCH_BLOCKS];
+    char *data[BATCH_BLOCKS];
+    for (long long i = 0; i < ops; i += batch_size) {
+        for (int j = 0; j < batch_size; ++j) {
+            blocks[j] = next_random(DISK_BLOCKS);
+            data[j] = batch[j];
+        }
+        disk_read_batch(disk, blocks, data, batch_size);
+    }
+}
+
+void teardown_disk() {
+    if (disk != NULL) disk_close(disk);
+    disk = NULL;
+    if (scratch[0] != '\0') unlink(scratch);
+    batch_size = 1;
+}
+
+int setup_file(struct bench *b) {
+    snprintf(scratch, sizeof(scratch), "/tmp/virtmem-bench.%d", getpid());
+    scratch_fd = open(scratch, O_CREAT | O_TRUNC | O_RDWR, 0600);
+    if (scratch_fd < 0) return 0;
+    unlink(scratch);
+    memset(block, 1, sizeof(block));
+    for (int i = 0; i < DISK_BLOCKS; ++i) {
+        if (pwrite(scratch_fd, block, BLOCK_SIZE, (off_t) i * BLOCK_SIZE) != BLOCK_SIZE) return 0;
+    }
+    return 1;
+}
+
+void run_pread(long long ops) {
+    for (long long i = 0; i < ops; ++i) {
+        if (pread(scratch_fd, block, BLOCK_SIZE, (off_t) next_random(DISK_BLOCKS) * BLOCK_SIZE) < 0) break;
+    }
+}
+
+void run_pwrite(long long ops) {
+    for (long long i = 0; i < ops; ++i) {
+        if (pwrite(scratch_fd, block, BLOCK_SIZE, (off_t) next_random(DISK_BLOCKS) * BLOCK_SIZE) < 0) break;
+    }
+}
+
+void teardown_file() {
+    if (scratch_fd >= 0) close(scratch_fd);
+    scratch_fd = -1;
+}
@@ -0,0 +1,309 @@
+/*
+A stand-in for a remote memory server: keeps the blocks of a virtmem run
+with -M in its own memory, answering requests over a Unix socket as
+described in memserver.h.
+*/
+
+#include "memserver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define IO_BUFFER (256 * 1024)
+
+struct args {
+    const char *path;
+    int verbose;
+};
+struct args args;
+
+/**
+ * The blocks, shared by every connection.  They outlive the connections,
+ * and take a new size only while nobody is connected.
+ */
+struct store {
+    pthread_mutex_t lock;
+    char *data;
+    int block_size;
+    int nblocks;
+    int clients;
+};
+struct store store = { PTHREAD_MUTEX_INITIALIZER };
+
+volatile sig_atomic_t stopping = 0;
+
+void usage();
+void on_signal(int sig);
+int listen_on(const char *path);
+void *serve(void *arg);
+int attach(struct memserver_hello *hello);
+void detach();
+int read_full(int fd, void *buf, size_t len);
+int write_full(int fd, const void *buf, size_t len);
+
+
+/**
+ * Main function.  Parses arguments and hands every connection to a thread
+ * of its own until interrupted.
+ */
+int main( int argc, char *argv[] ) {
+    int opt;
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        switch (opt) {
+            case 'v': args.verbose = 1; break;
+            default:  usage(); return 1;
+        }
+    }
+    if (argc - optind != 1) {
+        usage();
+        return 1;
+    }
+    args.path = argv[optind];
+
+    int fd = listen_on(args.path);
+    if (fd < 0) {
+        fprintf(stderr, "couldn't listen on %s: %s\n", args.path, strerror(errno));
+        return 1;
+    }
+
+    // Without SA_RESTART, so a signal breaks us out of accept
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Connections come and go from several threads, so keep their lines whole
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    if (args.verbose) printf("serving on %s\n", args.path);
+
+    while (!stopping) {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "accept failed: %s\n", strerror(errno));
+            break;
+        }
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve, (void *) (long) client) != 0) {
+            fprintf(stderr, "couldn't start a thread for a connection\n");
+            close(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(fd);
+    unlink(args.path);
+    return 0;
+}
+
+/**
+ * Prints the command line usage.
+ */
+void usage() {
+    printf("use: virtmem-memserver [options] <socket>\n");
+    printf("  hold the disk of a virtmem run with -M socket in memory\n");
+    printf("  -v        report connections as they come and go\n");
+}
+
+void on_signal(int sig) {
+    (void) sig;
+    stopping = 1;
+}
+
+/**
+ * Binds a listening socket to a path, first clearing away a socket left
+ * there by an earlier server, but nothing else.
+ */
+int listen_on(const char *path) {
+    struct sockaddr_un addr;
+    struct stat st;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Serves one connection.  Takes in as much as the socket has, answers
+ * every whole request in it, and sends the replies back together, so a
+ * batch sent as one message is answered as one.
+ */
+void *serve(void *arg) {
+    int fd = (int) (long) arg;
+    struct memserver_hello hello;
+    struct memserver_reply reply = { 0, 0 };
+
+    if (!read_full(fd, &hello, sizeof(hello))) {
+        close(fd);
+        return NULL;
+    }
+    if (hello.magic != MEMSERVER_MAGIC || hello.version != MEMSERVER_VERSION) {
+        reply.status = EPROTO;
+    } else if (hello.block_size < 1 || hello.nblocks < 0) {
+        reply.status = EINVAL;
+    } else {
+        reply.status = attach(&hello);
+    }
+    if (!write_full(fd, &reply, sizeof(reply)) || reply.status != 0) {
+        if (reply.status == 0) detach();
+        close(fd);
+        return NULL;
+    }
+    if (args.verbose) printf("client connected: %d blocks of %d bytes\n", hello.nblocks, hello.block_size);
+
+    // Room for at least one write coming in and one read going out
+    int block_size = hello.block_size;
+    size_t in_size = IO_BUFFER, out_size = IO_BUFFER;
+    if (in_size < 2 * (sizeof(struct memserver_request) + block_size)) in_size = 2 * (sizeof(struct memserver_request) + block_size);
+    if (out_size < 2 * (sizeof(struct memserver_reply) + block_size)) out_size = 2 * (sizeof(struct memserver_reply) + block_size);
+    char *in = malloc(in_size);
+    char *out = malloc(out_size);
+    size_t have = 0;
+    long long reads = 0, writes = 0;
+
+    while (in && out) {
+        ssize_t got = read(fd, in + have, in_size - have);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        have += got;
+
+        size_t pos = 0, pending = 0;
+        int ok = 1;
+        while (ok && have - pos >= sizeof(struct memserver_request)) {
+            struct memserver_request req;
+            memcpy(&req, in + pos, sizeof(req));
+            size_t need = sizeof(req) + (req.op == MEMSERVER_WRITE ? block_size : 0);
+            if (have - pos < need) break;
+
+            if (out_size - pending < sizeof(reply) + block_size) {
+                ok = write_full(fd, out, pending);
+                pending = 0;
+            }
+
+            reply.tag = req.tag;
+            reply.status = 0;
+            if (req.op != MEMSERVER_READ && req.op != MEMSERVER_WRITE) reply.status = EINVAL;
+            else if (req.block < 0 || req.block >= hello.nblocks) reply.status = EINVAL;
+            memcpy(out + pending, &reply, sizeof(reply));
+            pending += sizeof(reply);
+
+            if (reply.status == 0) {
+                char *block = store.data + (size_t) req.block * block_size;
+                pthread_mutex_lock(&store.lock);
+                if (req.op == MEMSERVER_WRITE) {
+                    memcpy(block, in + pos + sizeof(req), block_size);
+                    writes++;
+                } else {
+                    memcpy(out + pending, block, block_size);
+                    pending += block_size;
+                    reads++;
+                }
+                pthread_mutex_unlock(&store.lock);
+            }
+            pos += need;
+        }
+
+        if (!ok || (pending > 0 && !write_full(fd, out, pending))) break;
+        memmove(in, in + pos, have - pos);
+        have -= pos;
+    }
+
+    if (args.verbose) printf("client disconnected after %lld reads, %lld writes\n", reads, writes);
+    free(in);
+    free(out);
+    detach();
+    close(fd);
+    return NULL;
+}
+
+/**
+ * Joins the store for a client, sizing it afresh if the client wants a
+ * different disk and nobody else is using it.  Returns 0 or an errno value.
+ */
+int attach(struct memserver_hello *hello) {
+    int status = 0;
+
+    pthread_mutex_lock(&store.lock);
+    if (store.data == NULL || store.block_size != hello->block_size || store.nblocks != hello->nblocks) {
+        if (store.clients > 0) {
+            status = EBUSY;
+        } else {
+            char *data = calloc((size_t) hello->nblocks + 1, hello->block_size);
+            if (data == NULL) {
+                status = ENOMEM;
+            } else {
+                free(store.data);
+                store.data = data;
+                store.block_size = hello->block_size;
+                store.nblocks = hello->nblocks;
+            }
+        }
+    }
+    if (status == 0) store.clients++;
+    pthread_mutex_unlock(&store.lock);
+    return status;
+}
+
+void detach() {
+    pthread_mutex_lock(&store.lock);
+    store.clients--;
+    pthread_mutex_unlock(&store.lock);
+}
+
+/**
+ * Reads exactly len bytes, returning 0 if the connection ends first.
+ */
+int read_full(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t got = read(fd, p, len);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return 0;
+        p += got;
+        len -= got;
+    }
+    return 1;
+}
+
+/**
+ * Writes exactly len bytes, returning 0 if the connection is gone.
+ */
+int write_full(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t put = write(fd, p, len);
+        if (put < 0 && errno == EINTR) continue;
+        if (put < 0) return 0;
+        p += put;
+        len -= put;
+    }
+    return 1;
+}
@@ -0,0 +1,149 @@
+/*
+Watches a running virtmem through the statistics it publishes with -s,
+printing a line per interval in the manner of vmstat.
+*/
+
+#include "stats_shm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define HEADER_EVERY 20
+
+struct args {
+    const char *name;
+    int interval_ms;
+    int count;        // Lines to print before stopping, 0 for no limit
+};
+struct args args;
+
+void usage();
+void print_header(struct stats_shm *s);
+void print_line(struct stats_shm *now, struct stats_shm *prev);
+double percentile(long long *hist, long long total, double fraction);
+int pager_alive(struct stats_shm *s);
+
+
+/**
+ * Main function.  Parses arguments and samples the segment until the pager
+ * is done or the count runs out.
+ */
+int main( int argc, char *argv[] ) {
+    args.interval_ms = 1000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+        switch (opt) {
+            case 'i': args.interval_ms = atoi(optarg); break;
+            case 'n': args.count = atoi(optarg); break;
+            default:  usage(); return 1;
+        }
+    }
+    if (argc - optind != 1 || args.interval_ms <= 0) {
+        usage();
+        return 1;
+    }
+    args.name = argv[optind];
+
+    struct stats_shm *shm = stats_shm_open(args.name);
+    if (shm == NULL) {
+        if (errno == EPROTO) {
+            fprintf(stderr, "%s was not written by a compatible virtmem\n", args.name);
+        } else {
+            fprintf(stderr, "couldn't open statistics segment %s: %s\n", args.name, strerror(errno));
+        }
+        return 1;
+    }
+
+    struct stats_shm prev, now;
+    if (stats_shm_read(shm, &prev) < 0) {
+        fprintf(stderr, "couldn't get a consistent copy of %s\n", args.name);
+        return 1;
+    }
+    print_header(&prev);
+
+    for (int lines = 0; args.count == 0 || lines < args.count; ++lines) {
+        usleep(args.interval_ms * 1000);
+        if (stats_shm_read(shm, &now) < 0) continue;
+        if (lines > 0 && lines % HEADER_EVERY == 0) print_header(&now);
+        print_line(&now, &prev);
+        prev = now;
+        if (!now.running || !pager_alive(&now)) {
+            printf("virtmem %d is done\n", now.pid);
+            break;
+        }
+    }
+
+    stats_shm_close(shm, NULL);
+    return 0;
+}
+
+/**
+ * Prints the command line usage.
+ */
+void usage() {
+    printf("use: virtmem-top [options] <name>\n");
+    printf("  watch the statistics a virtmem run with -s name publishes\n");
+    printf("  -i ms     time between lines (default 1000)\n");
+    printf("  -n count  stop after this many lines\n");
+}
+
+/**
+ * Prints what is being watched and the column headings.
+ */
+void print_header(struct stats_shm *s) {
+    printf("virtmem %d: %d pages x %d spaces, %d frames, policy %s%s\n", s->pid, s->npages, s->nspaces,
+        s->nframes, s->adaptive ? "adaptive, now " : "", s->policy);
+    printf("%8s %7s %7s %7s %6s %6s %5s %5s %6s %6s %6s %9s %9s\n", "flt/s", "rd/s", "wr/s", "ev/s",
+        "free", "dirty%", "busy", "pin", "list1", "list2", "traps", "p50(us)", "p99(us)");
+}
+
+/**
+ * Prints the rates over the interval between two copies of the segment, the
+ * state of the frames in the later one, and the fault latencies in between.
+ */
+void print_line(struct stats_shm *now, struct stats_shm *prev) {
+    double secs = (now->updated_ns - prev->updated_ns) / 1e9;
+    long long hist[STATS_SHM_BUCKETS];
+    long long total = 0;
+
+    for (int i = 0; i < STATS_SHM_BUCKETS; ++i) {
+        hist[i] = now->latency[i] - prev->latency[i];
+        total += hist[i];
+    }
+
+    #define RATE(field) (secs > 0 ? (now->field - prev->field) / secs : 0.0)
+    int used = now->nframes - now->free_frames;
+    printf("%8.0f %7.0f %7.0f %7.0f %6d %6.1f %5d %5d %6d %6d %6lld %9.1f %9.1f\n",
+        RATE(page_faults), RATE(disk_reads), RATE(disk_writes), RATE(evictions),
+        now->free_frames, used > 0 ? 100.0 * now->dirty_frames / used : 0.0,
+        now->busy_frames, now->pinned_frames, now->first_list, now->second_list,
+        now->traps - prev->traps, percentile(hist, total, 0.5) / 1000, percentile(hist, total, 0.99) / 1000);
+    #undef RATE
+    fflush(stdout);
+}
+
+/**
+ * Estimates a percentile of the latencies in a histogram, in nanoseconds,
+ * from the upper bound of the bucket it falls in.
+ */
+double percentile(long long *hist, long long total, double fraction) {
+    long long seen = 0;
+    if (total == 0) return 0.0;
+    for (int i = 0; i < STATS_SHM_BUCKETS; ++i) {
+        seen += hist[i];
+        if (seen >= fraction * total) return (double) (2LL << i);
+    }
+    return (double) (2LL << (STATS_SHM_BUCKETS - 1));
+}
+
+/**
+ * Whether the pager that wrote the segment still runs.
+ */
+int pager_alive(struct stats_shm *s) {
+    return kill(s->pid, 0) == 0 || errno == EPERM;
+}
@@ -0,0 +1,379 @@
+
+#include "workload.h"
+#include "page_table.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#define WORKLOAD_PATTERNS 6
+#define WORKLOAD_NAME_MAX 256
+
+static const char *pattern_names[WORKLOAD_PATTERNS] = { "uniform", "zipf", "hotcold", "loop", "stride", "phase" };
+
+struct workload {
+	struct workload_spec spec;
+	int npages;
+	int wss;
+	long long refs;
+	long long made;
+	unsigned long long state;
+	double *cdf;		/* Cumulative probability of each zipf rank */
+	int scatter;		/* Spreads zipf ranks over the working set */
+};
+
+/*
+The workloads carry their own generator, so that the streams are the same
+wherever they run and do not disturb the programs that call rand.
+*/
+
+static unsigned long long splitmix( unsigned long long x )
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x^(x>>30))*0xbf58476d1ce4e5b9ULL;
+	x = (x^(x>>27))*0x94d049bb133111ebULL;
+	return x^(x>>31);
+}
+
+static unsigned long long next_random( unsigned long long *state )
+{
+	unsigned long long x = *state;
+	x ^= x>>12;
+	x ^= x<<25;
+	x ^= x>>27;
+	*state = x;
+	return x*0x2545f4914f6cdd1dULL;
+}
+
+static double next_uniform( unsigned long long *state )
+{
+	return (next_random(state)>>11)*(1.0/9007199254740992.0);
+}
+
+static int gcd( int a, int b )
+{
+	while(b) {
+		int t = a%b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* Set one key=value setting, returning 0 if it is unknown or out of range. */
+
+static int parse_setting( struct workload_spec *spec, const char *setting )
+{
+	const char *eq = strchr(setting,'=');
+	char *end;
+	double value;
+
+	if(!eq || eq==setting || !eq[1]) return 0;
+	value = strtod(eq+1,&end);
+	if(*end) return 0;
+
+	#define KEY(name) (eq-setting==(int)strlen(name) && !strncmp(setting,name,eq-setting))
+	if(KEY("seed")) {
+		spec->seed = strtoull(eq+1,&end,0);
+		return !*end;
+	} else if(KEY("refs")) {
+		spec->refs = (long long)value;
+		return value>=0;
+	} else if(KEY("wss")) {
+		spec->wss = (int)value;
+		return value>=0;
+	} else if(KEY("write")) {
+		spec->write = value;
+		return value>=0 && value<=1;
+	} else if(KEY("theta")) {
+		spec->theta = value;
+		return value>0;
+	} else if(KEY("hot")) {
+		spec->hot = value;
+		return value>0 && value<1;
+	} else if(KEY("hotprob")) {
+		spec->hotprob = value;
+		return value>=0 && value<=1;
+	} else if(KEY("stride")) {
+		spec->stride = (int)value;
+		return value>=1;
+	} else if(KEY("phases")) {
+		spec->phases = (int)value;
+		return value>=1;
+	}
+	#undef KEY
+	return 0;
+}
+
+int workload_parse( const char *program, struct workload_spec *spec )
+{
+	char buf[WORKLOAD_NAME_MAX];
+	char *setting, *save;
+	int i;
+
+	if(strlen(program)>=sizeof(buf)) return 0;
+	strcpy(buf,program);
+
+	memset(spec,0,sizeof(*spec));
+	spec->pattern = -1;
+	spec->seed = 1;
+	spec->write = 0.25;
+	spec->theta = 0.99;
+	spec->hot = 0.2;
+	spec->hotprob = 0.8;
+	spec->stride = 16;
+	spec->phases = 4;
+
+	setting = strtok_r(buf,":",&save);
+	for(i=0;setting && i<WORKLOAD_PATTERNS;i++) {
+		if(!strcmp(setting,pattern_names[i])) spec->pattern = i;
+	}
+	if(spec->pattern<0) return 0;
+
+	while((setting = strtok_r(0,":",&save))) {
+		if(!parse_setting(spec,setting)) return 0;
+	}
+	return 1;
+}
+
+struct workload * workload_create( const struct workload_spec *spec, int npages )
+{
+	struct workload *w;
+	int i;
+
+	if(npages<1) return 0;
+
+	w = calloc(1,sizeof(struct workload));
+	if(!w) return 0;
+
+	w->spec = *spec;
+	w->npages = npages;
+	w->wss = spec->wss>0 && spec->wss<npages ? spec->wss : npages;
+	w->refs = spec->refs>0 ? spec->refs : 10LL*npages;
+	w->state = splitmix(spec->seed);
+	if(!w->state) w->state = 1;
+
+	if(spec->pattern==WORKLOAD_ZIPF) {
+		double sum = 0;
+		w->cdf = malloc(sizeof(double)*w->wss);
+		if(!w->cdf) {
+			free(w);
+			return 0;
+		}
+		for(i=0;i<w->wss;i++) {
+			sum += 1.0/pow(i+1,spec->theta);
+			w->cdf[i] = sum;
+		}
+		for(i=0;i<w->wss;i++) w->cdf[i] /= sum;
+
+		// Any step coprime with the working set visits every page once
+		w->scatter = (int)(w->wss*0.6180339887)|1;
+		while(gcd(w->scatter,w->wss)!=1) w->scatter++;
+	}
+
+	return w;
+}
+
+int workload_next( struct workload *w, int *write )
+{
+	struct workload_spec *spec = &w->spec;
+	int page = 0;
+
+	if(w->made>=w->refs) return -1;
+
+	switch(spec->pattern) {
+		case WORKLOAD_UNIFORM:
+			page = next_random(&w->state)%w->wss;
+			break;
+		case WORKLOAD_ZIPF: {
+			double u = next_uniform(&w->state);
+			int lo = 0, hi = w->wss-1;
+			while(lo<hi) {
+				int mid = (lo+hi)/2;
+				if(w->cdf[mid]<u) lo = mid+1;
+				else hi = mid;
+			}
+			page = (int)((long long)lo*w->scatter%w->wss);
+			break;
+		}
+		case WORKLOAD_HOTCOLD: {
+			int nhot = (int)(spec->hot*w->wss);
+			if(nhot<1) nhot = 1;
+			if(nhot>=w->wss || next_uniform(&w->state)<spec->hotprob) {
+				page = next_random(&w->state)%nhot;
+			} else {
+				page = nhot+next_random(&w->state)%(w->wss-nhot);
+			}
+			break;
+		}
+		case WORKLOAD_LOOP:
+			page = w->made%w->wss;
+			break;
+		case WORKLOAD_STRIDE: {
+			long long pos = w->made*spec->stride;
+			page = (pos+pos/w->wss)%w->wss;
+			break;
+		}
+		case WORKLOAD_PHASE: {
+			long long per = w->refs/spec->phases;
+			long long phase = per>0 ? w->made/per : 0;
+			long long base;
+			if(phase>=spec->phases) phase = spec->phases-1;
+			base = spec->phases>1 ? phase*(w->npages-w->wss)/(spec->phases-1) : 0;
+			page = base+next_random(&w->state)%w->wss;
+			break;
+		}
+	}
+
+	*write = next_uniform(&w->state)<spec->write;
+	w->made++;
+	return page;
+}
+
+void workload_delete( struct workload *w )
+{
+	free(w->cdf);
+	free(w);
+}
+
+/*
+Running a workload as a program.  Reads and writes go through either plain
+memory or the software access functions.
+*/
+
+struct workload_run {
+	const char *program;
+	struct workload_spec spec;
+	char *data;
+	struct page_table *pt;
+	size_t length;
+	size_t page_size;
+	int total;
+};
+
+static int workload_advice( int pattern )
+{
+	switch(pattern) {
+		case WORKLOAD_LOOP:   return PAGE_ADVICE_SEQUENTIAL;
+		case WORKLOAD_STRIDE: return PAGE_ADVICE_NORMAL;
+		default:              return PAGE_ADVICE_RANDOM;
+	}
+}
+
+static void * workload_body( void *arg )
+{
+	struct workload_run *run = arg;
+	int npages = run->length/run->page_size;
+	struct workload *w = workload_create(&run->spec,npages);
+	unsigned long long values = splitmix(run->spec.seed^0x6a09e667f3bcc908ULL)|1;
+	unsigned char *written = calloc(npages>0 ? npages : 1,1);
+	int page, write;
+	char value;
+
+	if(!w || !written) {
+		fprintf(stderr,"couldn't create workload %s\n",run->program);
+		if(w) workload_delete(w);
+		free(written);
+		return 0;
+	}
+
+	if(run->pt) page_table_advise(page_table_get_virtmem(run->pt),run->length,workload_advice(run->spec.pattern));
+	else page_table_advise(run->data,run->length,workload_advice(run->spec.pattern));
+
+	while((page = workload_next(w,&write))>=0) {
+		// Each page is always touched at the same byte, so that a read sees the last write
+		size_t addr = (size_t)page*run->page_size+splitmix(page)%run->page_size;
+		if(write) {
+			value = (char)(next_random(&values)>>56);
+			if(run->pt) page_table_store(run->pt,addr,value);
+			else run->data[addr] = value;
+			written[page] = 1;
+		} else {
+			value = run->pt ? page_table_load(run->pt,addr) : run->data[addr];
+			// Pages never written hold whatever the disk had, so leave them out
+			if(written[page]) run->total += value;
+		}
+	}
+
+	free(written);
+	workload_delete(w);
+	return 0;
+}
+
+static const char * workload_name( const struct workload_spec *spec )
+{
+	return pattern_names[spec->pattern];
+}
+
+static int workload_setup( struct workload_run *run, const char *program )
+{
+	memset(run,0,sizeof(*run));
+	run->program = program;
+	if(!workload_parse(program,&run->spec)) {
+		fprintf(stderr,"unknown program: %s\n",program);
+		return 0;
+	}
+	return 1;
+}
+
+void workload_program( const char *program, char *data, size_t length, size_t page_size )
+{
+	struct workload_run run;
+
+	if(!workload_setup(&run,program)) return;
+	run.data = data;
+	run.length = length;
+	run.page_size = page_size;
+	workload_body(&run);
+
+	printf("%s result is %d\n",workload_name(&run.spec),run.total);
+}
+
+void parallel_workload_program( const char *program, char *data, size_t length, size_t page_size, int nthreads )
+{
+	struct workload_run *runs = malloc(sizeof(struct workload_run)*nthreads);
+	pthread_t *threads = malloc(sizeof(pthread_t)*nthreads);
+	int npages = length/page_size;
+	int total = 0;
+	int i;
+
+	for(i=0;i<nthreads;i++) {
+		int start = (long long)npages*i/nthreads;
+		int end = (long long)npages*(i+1)/nthreads;
+		if(!workload_setup(&runs[i],program)) {
+			nthreads = i;
+			break;
+		}
+		runs[i].data = data+(size_t)start*page_size;
+		runs[i].length = (size_t)(end-start)*page_size;
+		runs[i].page_size = page_size;
+		runs[i].spec.seed += i;
+		if(runs[i].spec.refs>0) runs[i].spec.refs /= nthreads;
+		if(runs[i].spec.wss>0) runs[i].spec.wss = (runs[i].spec.wss+nthreads-1)/nthreads;
+		pthread_create(&threads[i],0,workload_body,&runs[i]);
+	}
+
+	for(i=0;i<nthreads;i++) {
+		pthread_join(threads[i],0);
+		total += runs[i].total;
+	}
+
+	if(nthreads>0) printf("%s result is %d\n",workload_name(&runs[0].spec),total);
+	free(threads);
+	free(runs);
+}
+
+void soft_workload_program( const char *program, struct page_table *pt, size_t length )
+{
+	struct workload_run run;
+
+	if(!workload_setup(&run,program)) return;
+	run.pt = pt;
+	run.length = length;
+	run.page_size = page_table_get_page_size(pt);
+	workload_body(&run);
+
+	printf("%s result is %d\n",workload_name(&run.spec),run.total);
+}
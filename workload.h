@@ -0,0 +1,81 @@
+
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <stddef.h>
+
+/*
+Synthetic workloads: streams of page references drawn from a chosen
+distribution.  A workload is given on the command line as a program named
+after its pattern, optionally followed by colon separated settings, e.g.
+
+	zipf:theta=0.99:wss=512:refs=200000:write=0.3:seed=7
+
+Every reference reads or writes one byte of the chosen page.  The stream
+depends on nothing but the settings, the number of pages and the seed, so
+that runs can be repeated exactly.
+*/
+
+#define WORKLOAD_UNIFORM 0	/* Any page of the working set alike */
+#define WORKLOAD_ZIPF    1	/* Page of rank r with probability ~ 1/r^theta */
+#define WORKLOAD_HOTCOLD 2	/* A "hot" share of the pages gets "hotprob" of the references */
+#define WORKLOAD_LOOP    3	/* The working set in order, over and over */
+#define WORKLOAD_STRIDE  4	/* Every "stride"th page, shifting by one on each wrap */
+#define WORKLOAD_PHASE   5	/* Uniform over a working set that moves "phases" times */
+
+struct workload_spec {
+	int pattern;
+	unsigned long long seed;
+	long long refs;		/* References to make, 0 for ten per page */
+	int wss;		/* Pages in the working set, 0 for all of them */
+	double write;		/* Share of references that are writes */
+	double theta;		/* Skew of WORKLOAD_ZIPF */
+	double hot;		/* Share of the working set that is hot */
+	double hotprob;		/* Share of references that go to the hot pages */
+	int stride;		/* Pages between references of WORKLOAD_STRIDE */
+	int phases;		/* Working sets of WORKLOAD_PHASE */
+};
+
+/*
+Parse a workload given as described above into "spec", with defaults for
+the settings left out.  Returns 1 on success, or 0 if it names no pattern
+or has a setting that is unknown or out of range.
+*/
+
+int workload_parse( const char *program, struct workload_spec *spec );
+
+struct workload;
+
+/*
+Create a stream of references to pages 0 up to "npages" for "spec".
+Returns a pointer to a new workload, or null on failure.
+*/
+
+struct workload * workload_create( const struct workload_spec *spec, int npages );
+
+/*
+Get the next page to reference, and whether to write it.  Returns -1 once
+the stream has made all of its references.
+*/
+
+int workload_next( struct workload *w, int *write );
+
+/* Delete a workload. */
+
+void workload_delete( struct workload *w );
+
+/*
+Run a workload as a program on "data", made up of pages of "page_size"
+bytes.  Like the other programs they print a result, here a checksum of
+the bytes read.  The parallel version splits the data into one contiguous
+chunk per thread, each with its own stream seeded from the one given.
+The software version accesses the virtual memory of "pt".
+*/
+
+struct page_table;
+
+void workload_program( const char *program, char *data, size_t length, size_t page_size );
+void parallel_workload_program( const char *program, char *data, size_t length, size_t page_size, int nthreads );
+void soft_workload_program( const char *program, struct page_table *pt, size_t length );
+
+#endif